@@ -0,0 +1,75 @@
+#include <new>
+#include "arena.h"
+
+Arena::~Arena()
+{
+    for (size_t i = 0; i < chunks.size(); ++i)
+        ::operator delete(chunks[i].data);
+}
+
+void *
+Arena::allocate(size_t size, size_t align)
+{
+    if (!chunks.empty()) {
+        size_t start = (offset + align - 1) & ~(align - 1);
+        if (start + size <= chunks[current].size) {
+            offset = start + size;
+            return chunks[current].data + start;
+        }
+        current++;
+    }
+    // the chunks after the current one are empty, the first that is large enough is used
+    while (current < chunks.size() && chunks[current].size < size)
+        current++;
+    if (current == chunks.size()) {
+        chunk c;
+        c.size = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+        // chunks from operator new are aligned for any type
+        c.data = static_cast<uint8_t*>(::operator new(c.size));
+        chunks.push_back(c);
+        grown++;
+    }
+    offset = size;
+    return chunks[current].data;
+}
+
+arena_mark
+Arena::mark() const
+{
+    arena_mark m;
+    m.chunk = current;
+    m.offset = offset;
+    return m;
+}
+
+void
+Arena::release(arena_mark m)
+{
+    current = m.chunk;
+    offset = m.offset;
+    if (current == 0 && offset == 0)
+        trim();
+}
+
+// frees the chunks that are larger than ARENA_KEEP, the arena is empty
+void
+Arena::trim()
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        if (chunks[i].size > ARENA_KEEP)
+            ::operator delete(chunks[i].data);
+        else
+            chunks[kept++] = chunks[i];
+    }
+    chunks.resize(kept);
+}
+
+size_t
+Arena::used() const
+{
+    size_t bytes = offset;
+    for (size_t i = 0; i < current && i < chunks.size(); ++i)
+        bytes += chunks[i].size;
+    return bytes;
+}
@@ -0,0 +1,96 @@
+/**
+ * @file arena.h
+ * @brief Bump allocator for the temporaries of a command
+ *
+ * Memory is taken from large chunks by moving an offset. Nothing is freed on
+ * its own: an ArenaScope gives back everything allocated while it existed,
+ * so the outermost scope of a command empties the arena. The chunks are kept
+ * for the next command, which then makes no heap allocations of its own.
+ * Chunks larger than ARENA_KEEP, taken for a rare large buffer, are freed
+ * when the arena is emptied. An Arena is used by one thread at a time.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#define ARENA_CHUNK (256 * 1024)   // bytes of a chunk, unless an allocation needs more
+#define ARENA_KEEP (1024 * 1024)   // larger chunks are freed when the arena is emptied
+
+// a position in the arena, everything allocated after it is given back together
+struct arena_mark {
+    size_t chunk;
+    size_t offset;
+};
+
+class Arena {
+private:
+    struct chunk {
+        uint8_t *data;
+        size_t size;
+    };
+    std::vector<chunk> chunks;
+    size_t current = 0;     // index of the chunk in use
+    size_t offset = 0;      // bytes used in the current chunk
+    unsigned grown = 0;     // chunks taken from the heap so far
+    void trim();
+public:
+    Arena() {}
+    ~Arena();
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+    // 'size' bytes aligned to 'align', which must be a power of 2
+    void *allocate(size_t size, size_t align = alignof(std::max_align_t));
+    // room for 'count' objects of type T, not initialised
+    template <class T>
+    T *alloc(size_t count) { return static_cast<T*>(allocate(count * sizeof(T), alignof(T))); }
+    arena_mark mark() const;
+    // gives back everything allocated after 'm'
+    void release(arena_mark m);
+    // bytes in use, and the number of chunks ever taken from the heap
+    size_t used() const;
+    unsigned heap_chunks() const { return grown; }
+};
+
+// Gives back everything allocated in the arena during its lifetime.
+class ArenaScope {
+private:
+    Arena &arena;
+    arena_mark start;
+public:
+    ArenaScope(Arena &a) : arena(a), start(a.mark()) {}
+    ~ArenaScope() { arena.release(start); }
+};
+
+// Lets a container take its memory from an arena. deallocate does nothing,
+// the memory comes back with the scope. Without an arena it uses the heap.
+template <class T>
+struct ArenaAllocator {
+    typedef T value_type;
+    Arena *arena;
+    ArenaAllocator() : arena(nullptr) {}
+    ArenaAllocator(Arena &a) : arena(&a) {}
+    template <class U>
+    ArenaAllocator(const ArenaAllocator<U> &other) : arena(other.arena) {}
+    T *allocate(size_t n)
+    {
+        if (arena)
+            return arena->alloc<T>(n);
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+    void deallocate(T *p, size_t)
+    {
+        if (!arena)
+            ::operator delete(p);
+    }
+};
+
+template <class T, class U>
+bool operator==(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b) { return a.arena == b.arena; }
+template <class T, class U>
+bool operator!=(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b) { return a.arena != b.arena; }
+
+#endif // __ARENA_H__
@@ -1,27 +1,40 @@
 #include <iostream>
+#include <cstring>
+#include <climits>
+#include <fcntl.h>
+#include <cerrno>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <sys/uio.h>
 #include "disk.h"
+#include "journal.h"
+#include "scan.h"
 
-Disk::Disk()
+Disk::Disk(const std::string &diskfile)
 {
     // first check if the disk file exists, otherwise create it.
-    if (!disk_file_exists(DISKNAME)) {
+    if (!disk_file_exists(diskfile)) {
         std::cout << "No disk file found...\n";
-        std::cout << "Creating disk file: " << DISKNAME << std::endl;
-        std::ofstream f(DISKNAME, std::ios::binary | std::ios::out);
+        std::cout << "Creating disk file: " << diskfile << std::endl;
+        std::ofstream f(diskfile, std::ios::binary | std::ios::out);
         f.seekp((1<<23)-1);
         f.write("", 1);
     }
-    // the disk is simulated as a binary file
-    diskfile.open(DISKNAME, std::ios::in | std::ios::out | std::ios::binary);
-    if (!diskfile.is_open()) {
-        std::cerr << "ERROR: Can't open diskfile: " << DISKNAME << ", exiting..."<< std::endl;
+    // the disk is simulated as a binary file, accessed with pread/pwrite so
+    // that buffered blocks can be written back in runs and fdatasync'ed
+    diskfd = open(diskfile.c_str(), O_RDWR);
+    if (diskfd < 0) {
+        std::cerr << "ERROR: Can't open diskfile: " << diskfile << ", exiting..."<< std::endl;
         exit(-1);
     }
+    last_sync = std::chrono::steady_clock::now();
 }
 
 Disk::~Disk()
 {
-    diskfile.close();
+    stop_flusher();
+    sync();
+    close(diskfd);
 }
 
 bool
@@ -41,13 +54,52 @@ Disk::write(unsigned block_no, uint8_t *blk)
         std::cout << "Disk::write - ERROR: Invalid block number (" << block_no << ")\n";
         return -1;
     }
-    unsigned offset = block_no * BLOCK_SIZE;
-    diskfile.seekp(offset, std::ios_base::beg);
-    diskfile.write((char*)blk, BLOCK_SIZE);
-    diskfile.flush();
+    // a freed metadata block may be reused for file data
+    meta.erase(block_no);
+    trimmed.erase(block_no);
+    drop_ahead(block_no);
+    mark(block_no);
+    if (policy == FLUSH_BLOCK) {
+        dirty.erase(block_no);
+        return write_through(block_no, blk);
+    }
+    // buffered policies: a block written twice before the commit is only written once
+    dirty[block_no].assign(blk, blk + BLOCK_SIZE);
+    if (policy == FLUSH_GROUP && dirty.size() >= group_blocks) {
+        // only file data is written early, metadata waits for the end of the command
+        int status = write_blocks(dirty);
+        if (status)
+            return status;
+        dirty.clear();
+    }
+    return 0;
+}
+
+int
+Disk::write_meta(unsigned block_no, uint8_t *blk)
+{
+    if (journal == nullptr)
+        return write(block_no, blk);
+    if (DEBUG)
+        std::cout << "Disk::write_meta(" << block_no << ")\n";
+    if (block_no >= no_blocks) {
+        std::cout << "Disk::write - ERROR: Invalid block number (" << block_no << ")\n";
+        return -1;
+    }
+    dirty.erase(block_no);
+    trimmed.erase(block_no);
+    drop_ahead(block_no);
+    mark(block_no);
+    meta[block_no].assign(blk, blk + BLOCK_SIZE);
     return 0;
 }
 
+void
+Disk::set_journal(Journal *j)
+{
+    journal = j;
+}
+
 // reads one block from the disk
 int
 Disk::read(unsigned block_no, uint8_t *blk)
@@ -59,8 +111,414 @@ Disk::read(unsigned block_no, uint8_t *blk)
         std::cout << "Disk::write - ERROR: Invalid block number (" << block_no << ")\n";
         return -1;
     }
-    unsigned offset = block_no * BLOCK_SIZE;
-    diskfile.seekg(offset, std::ios_base::beg);
-    diskfile.read((char*)blk, BLOCK_SIZE);
+    std::map<unsigned, std::vector<uint8_t> >::iterator it = meta.find(block_no);
+    if (it == meta.end()) {
+        it = dirty.find(block_no);
+        if (it == dirty.end()) {
+            std::unique_lock<std::mutex> guard(ahead_lock);
+            it = ahead.find(block_no);
+            if (it == ahead.end()) {
+                guard.unlock();
+                return read_through(block_no, blk);
+            }
+            // a block that was read ahead is read once
+            memcpy(blk, it->second.data(), BLOCK_SIZE);
+            ahead.erase(it);
+            ahead_used++;
+            return 0;
+        }
+    }
+    memcpy(blk, it->second.data(), BLOCK_SIZE);
+    return 0;
+}
+
+int
+Disk::read_many(const std::vector<unsigned> &blocks, uint8_t *data)
+{
+    size_t i = 0;
+    while (i < blocks.size()) {
+        // a run of adjacent blocks that are only in the disk file
+        unsigned first = blocks[i];
+        unsigned count = 0;
+        while (i + count < blocks.size() && blocks[i + count] == first + count && count < IOV_MAX &&
+               first + count < no_blocks && !buffered(first + count))
+            count++;
+        if (count <= 1) {
+            if (read(first, data + i * BLOCK_SIZE))
+                return -1;
+            i++;
+            continue;
+        }
+        struct iovec iov[IOV_MAX];
+        for (unsigned j = 0; j < count; j++) {
+            iov[j].iov_base = data + (i + j) * BLOCK_SIZE;
+            iov[j].iov_len = BLOCK_SIZE;
+        }
+        ssize_t n = preadv(diskfd, iov, count, (off_t)first * BLOCK_SIZE);
+        if (n < 0) {
+            std::cout << "Disk::read - ERROR: Can't read blocks (" << first << ".." << first + count - 1 << ")\n";
+            return -1;
+        }
+        // past the end of the disk file the blocks read as zeroes
+        if (n < (ssize_t)count * BLOCK_SIZE)
+            memset(data + i * BLOCK_SIZE + n, 0, (size_t)count * BLOCK_SIZE - n);
+        i += count;
+    }
+    return 0;
+}
+
+int
+Disk::write_many(const std::vector<unsigned> &blocks, const uint8_t *data)
+{
+    if (policy != FLUSH_BLOCK) {
+        for (size_t i = 0; i < blocks.size(); i++)
+            if (write(blocks[i], (uint8_t*)data + i * BLOCK_SIZE))
+                return -1;
+        return 0;
+    }
+    std::map<unsigned, std::vector<uint8_t> > run;
+    for (size_t i = 0; i < blocks.size(); i++) {
+        if (blocks[i] >= no_blocks) {
+            std::cout << "Disk::write - ERROR: Invalid block number (" << blocks[i] << ")\n";
+            return -1;
+        }
+        meta.erase(blocks[i]);
+        trimmed.erase(blocks[i]);
+        drop_ahead(blocks[i]);
+        mark(blocks[i]);
+        dirty.erase(blocks[i]);
+        run[blocks[i]].assign(data + i * BLOCK_SIZE, data + (i + 1) * BLOCK_SIZE);
+    }
+    return write_blocks(run);
+}
+
+bool
+Disk::buffered(unsigned block_no)
+{
+    if (meta.count(block_no) || dirty.count(block_no))
+        return true;
+    std::lock_guard<std::mutex> guard(ahead_lock);
+    return ahead.count(block_no) > 0;
+}
+
+int
+Disk::prefetch(const std::vector<unsigned> &blocks)
+{
+    std::lock_guard<std::mutex> guard(ahead_lock);
+    size_t i = 0;
+    while (i < blocks.size()) {
+        // a run of adjacent blocks that are not buffered yet
+        unsigned first = blocks[i];
+        unsigned count = 0;
+        while (i < blocks.size() && blocks[i] == first + count && count < IOV_MAX && blocks[i] < no_blocks &&
+               !meta.count(blocks[i]) && !dirty.count(blocks[i]) && !ahead.count(blocks[i])) {
+            count++;
+            i++;
+        }
+        if (count == 0) {
+            i++;
+            continue;
+        }
+        std::vector<std::vector<uint8_t> > data(count, std::vector<uint8_t>(BLOCK_SIZE));
+        struct iovec iov[IOV_MAX];
+        for (unsigned j = 0; j < count; j++) {
+            iov[j].iov_base = data[j].data();
+            iov[j].iov_len = BLOCK_SIZE;
+        }
+        ssize_t n = preadv(diskfd, iov, count, (off_t)first * BLOCK_SIZE);
+        if (n < 0) {
+            std::cout << "Disk::read - ERROR: Can't read blocks (" << first << ".." << first + count - 1 << ")\n";
+            return -1;
+        }
+        for (unsigned j = 0; j < count; j++) {
+            // past the end of the disk file the blocks read as zeroes
+            if ((ssize_t)(j + 1) * BLOCK_SIZE > n) {
+                size_t valid = n > (ssize_t)j * BLOCK_SIZE ? n - j * BLOCK_SIZE : 0;
+                memset(data[j].data() + valid, 0, BLOCK_SIZE - valid);
+            }
+            ahead[first + j].swap(data[j]);
+            ahead_order.push_back(first + j);
+        }
+    }
+    // the oldest blocks make room, the ones that were never read are wasted
+    while (ahead.size() > READ_AHEAD_BUFFER && !ahead_order.empty()) {
+        unsigned block_no = ahead_order.front();
+        ahead_order.pop_front();
+        if (ahead.erase(block_no))
+            ahead_wasted++;
+    }
+    if (ahead_order.size() > 2 * READ_AHEAD_BUFFER) {
+        // drop the entries of blocks that were read already
+        std::deque<unsigned> order;
+        for (size_t j = 0; j < ahead_order.size(); j++)
+            if (ahead.count(ahead_order[j]))
+                order.push_back(ahead_order[j]);
+        ahead_order.swap(order);
+    }
+    return 0;
+}
+
+void
+Disk::drop_ahead(unsigned block_no)
+{
+    std::lock_guard<std::mutex> guard(ahead_lock);
+    if (ahead.erase(block_no))
+        ahead_wasted++;
+}
+
+void
+Disk::ahead_stats(unsigned &used, unsigned &wasted)
+{
+    std::lock_guard<std::mutex> guard(ahead_lock);
+    used = ahead_used;
+    wasted = ahead_wasted;
+    ahead_used = 0;
+    ahead_wasted = 0;
+}
+
+void
+Disk::trim(unsigned block_no)
+{
+    if (block_no >= no_blocks)
+        return;
+    dirty.erase(block_no);
+    drop_ahead(block_no);
+    trimmed.insert(block_no);
+}
+
+long long
+Disk::host_bytes()
+{
+    struct stat st;
+    if (fstat(diskfd, &st) != 0)
+        return -1;
+    return (long long)st.st_blocks * 512;
+}
+
+int
+Disk::write_through(unsigned block_no, uint8_t *blk)
+{
+    // a block of zeroes is written as a hole, it then takes no space on the host
+    if (can_punch && scan_zero(blk, BLOCK_SIZE) && punch(block_no, 1) == 0)
+        return 0;
+    off_t offset = (off_t)block_no * BLOCK_SIZE;
+    if (pwrite(diskfd, blk, BLOCK_SIZE, offset) != BLOCK_SIZE) {
+        std::cout << "Disk::write - ERROR: Can't write block (" << block_no << ")\n";
+        return -1;
+    }
+    return 0;
+}
+
+int
+Disk::read_through(unsigned block_no, uint8_t *blk)
+{
+    off_t offset = (off_t)block_no * BLOCK_SIZE;
+    ssize_t n = pread(diskfd, blk, BLOCK_SIZE, offset);
+    if (n < 0) {
+        std::cout << "Disk::read - ERROR: Can't read block (" << block_no << ")\n";
+        return -1;
+    }
+    if (n < BLOCK_SIZE)
+        memset(blk + n, 0, BLOCK_SIZE - n);
+    return 0;
+}
+
+// writes the blocks in ascending order, one pwritev per run of adjacent blocks.
+// A run of blocks of zeroes is punched out of the disk file instead.
+int
+Disk::write_blocks(std::map<unsigned, std::vector<uint8_t> > &blocks)
+{
+    std::map<unsigned, std::vector<uint8_t> >::iterator it = blocks.begin();
+    while (it != blocks.end()) {
+        struct iovec iov[IOV_MAX];
+        unsigned first = it->first;
+        int count = 0;
+        if (can_punch && scan_zero(it->second.data(), BLOCK_SIZE)) {
+            std::map<unsigned, std::vector<uint8_t> >::iterator next = it;
+            while (next != blocks.end() && next->first == first + count && scan_zero(next->second.data(), BLOCK_SIZE)) {
+                count++;
+                ++next;
+            }
+            if (punch(first, count) == 0) {
+                it = next;
+                continue;
+            }
+            count = 0;
+        }
+        while (it != blocks.end() && it->first == first + count && count < IOV_MAX) {
+            iov[count].iov_base = it->second.data();
+            iov[count].iov_len = BLOCK_SIZE;
+            count++;
+            ++it;
+        }
+        ssize_t len = (ssize_t)count * BLOCK_SIZE;
+        if (pwritev(diskfd, iov, count, (off_t)first * BLOCK_SIZE) != len) {
+            std::cout << "Disk::write - ERROR: Can't write blocks (" << first << ".." << first + count - 1 << ")\n";
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// makes a hole of 'count' blocks in the disk file, which reads as zeroes
+int
+Disk::punch(unsigned first, unsigned count)
+{
+    if (!can_punch)
+        return -1;
+    if (fallocate(diskfd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  (off_t)first * BLOCK_SIZE, (off_t)count * BLOCK_SIZE) != 0) {
+        if (errno == EOPNOTSUPP || errno == ENOSYS) {
+            // the blocks are written as they are from now on
+            can_punch = false;
+            return -1;
+        }
+        std::cout << "Disk::punch - ERROR: Can't punch blocks (" << first << ".." << first + count - 1 << ")\n";
+        return -1;
+    }
+    return 0;
+}
+
+// punches the freed blocks, in runs of adjacent blocks
+int
+Disk::punch_trimmed()
+{
+    std::set<unsigned>::iterator it = trimmed.begin();
+    while (can_punch && it != trimmed.end()) {
+        unsigned first = *it;
+        unsigned count = 0;
+        while (it != trimmed.end() && *it == first + count) {
+            count++;
+            ++it;
+        }
+        punch(first, count);
+    }
+    trimmed.clear();
+    return 0;
+}
+
+int
+Disk::barrier()
+{
+    if (fdatasync(diskfd) != 0) {
+        std::cout << "Disk::sync - ERROR: fdatasync failed\n";
+        return -1;
+    }
+    return 0;
+}
+
+int
+Disk::set_policy(int new_policy, unsigned ms, unsigned blocks)
+{
+    if (new_policy != FLUSH_BLOCK && new_policy != FLUSH_COMMAND && new_policy != FLUSH_GROUP) {
+        std::cout << "Disk::set_policy - ERROR: Unknown durability policy (" << new_policy << ")\n";
+        return -1;
+    }
+    // the flusher is stopped before taking busy, it may be waiting for it
+    stop_flusher();
+    std::lock_guard<std::recursive_mutex> guard(busy);
+    // whatever was buffered under the old policy is committed first
+    int status = sync();
+    if (status)
+        return status;
+    policy = new_policy;
+    // at least 1 ms, so the flusher does not spin
+    group_ms = ms > 0 ? ms : 1;
+    group_blocks = blocks > 0 ? blocks : 1;
+    if (policy == FLUSH_GROUP) {
+        flusher_stop = false;
+        flusher = std::thread(&Disk::flush_loop, this);
+    }
+    return 0;
+}
+
+// the flusher thread of FLUSH_GROUP: a group is committed group_ms after the
+// last commit even when no command ends, so an idle disk does not keep
+// acknowledged writes in memory
+void
+Disk::flush_loop()
+{
+    std::unique_lock<std::mutex> wait(flusher_lock);
+    while (!flusher_stop) {
+        flusher_wake.wait_for(wait, std::chrono::milliseconds(group_ms));
+        if (flusher_stop)
+            break;
+        wait.unlock();
+        {
+            std::lock_guard<std::recursive_mutex> guard(busy);
+            std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - last_sync;
+            if ((!dirty.empty() || !meta.empty()) &&
+                std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count() >= group_ms)
+                sync();
+        }
+        wait.lock();
+    }
+}
+
+void
+Disk::stop_flusher()
+{
+    if (!flusher.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> guard(flusher_lock);
+        flusher_stop = true;
+    }
+    flusher_wake.notify_one();
+    flusher.join();
+}
+
+int
+Disk::end_command()
+{
+    std::lock_guard<std::recursive_mutex> guard(busy, std::adopt_lock);
+    // nothing written, nothing to make durable
+    if (dirty.empty() && meta.empty() && trimmed.empty())
+        return 0;
+    if (policy == FLUSH_COMMAND)
+        return sync();
+    if (policy == FLUSH_GROUP) {
+        std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - last_sync;
+        // a group is kept within the journal region, so its commit takes no overflow blocks
+        bool journal_full = journal != nullptr && meta.size() + 8 > journal->capacity();
+        if (dirty.size() + meta.size() >= group_blocks || journal_full ||
+            std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count() >= group_ms)
+            return sync();
+        return 0;
+    }
+    // FLUSH_BLOCK: file data is already written, every command is its own transaction
+    if (!meta.empty())
+        return sync();
+    return 0;
+}
+
+// durable point: everything written before this call survives a crash
+int
+Disk::sync()
+{
+    std::lock_guard<std::recursive_mutex> guard(busy);
+    // file data first, so that committed metadata never points to unwritten blocks
+    int status = write_blocks(dirty);
+    if (status)
+        return status;
+    dirty.clear();
+    if (journal != nullptr && !meta.empty()) {
+        status = journal->commit(*this, meta);
+        if (status)
+            return status;
+        meta.clear();
+    }
+    else {
+        status = write_blocks(meta);
+        if (status)
+            return status;
+        meta.clear();
+        status = barrier();
+        if (status)
+            return status;
+    }
+    // the FAT that frees the trimmed blocks is durable now, their data can go
+    punch_trimmed();
+    last_sync = std::chrono::steady_clock::now();
     return 0;
 }
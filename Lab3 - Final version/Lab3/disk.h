@@ -1,5 +1,13 @@
 #include <iostream>
 #include <fstream>
+#include <map>
+#include <set>
+#include <deque>
+#include <vector>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
 
 #ifndef __DISK_H__
 #define __DISK_H__
@@ -8,21 +16,120 @@
 #define BLOCK_SIZE 4096
 #define DEBUG false
 
+// durability policies, i.e. when written blocks reach stable storage
+#define FLUSH_BLOCK 0    // every block is written to the disk file at once (default)
+#define FLUSH_COMMAND 1  // blocks are buffered and made durable at the end of each command
+#define FLUSH_GROUP 2    // commands are grouped and made durable every N ms or N blocks
+
+#define GROUP_COMMIT_MS 50
+#define GROUP_COMMIT_BLOCKS 256
+
+// blocks kept in the read-ahead buffer, the oldest unread ones are dropped first
+#define READ_AHEAD_BUFFER 128
+
+class Journal;
+
 class Disk {
+    friend class Journal;
 private:
-    std::fstream diskfile;
+    int diskfd;
     const unsigned no_blocks = 2048;
     const unsigned disk_size = BLOCK_SIZE * no_blocks;
     bool disk_file_exists (const std::string& name);
+    // blocks written but not yet passed on to the disk file, sorted by block number
+    std::map<unsigned, std::vector<uint8_t> > dirty;
+    int policy = FLUSH_BLOCK;
+    unsigned group_ms = GROUP_COMMIT_MS;
+    unsigned group_blocks = GROUP_COMMIT_BLOCKS;
+    // metadata blocks waiting to be committed through the journal
+    std::map<unsigned, std::vector<uint8_t> > meta;
+    Journal *journal = nullptr;
+    std::chrono::steady_clock::time_point last_sync;
+    // freed blocks, punched out of the disk file once the FAT that frees them is committed
+    std::set<unsigned> trimmed;
+    bool can_punch = true;  // false when the file system of the disk file has no hole punching
+    // blocks read ahead of the file system, dropped when they are read or written
+    std::map<unsigned, std::vector<uint8_t> > ahead;
+    std::mutex ahead_lock;  // read may be called by several threads, and a hit takes the block out
+    std::deque<unsigned> ahead_order;  // order the blocks were read ahead in
+    unsigned ahead_used = 0;     // read-ahead blocks that were read
+    unsigned ahead_wasted = 0;   // read-ahead blocks that were dropped unread
+    void drop_ahead(unsigned block_no);
+    bool buffered(unsigned block_no);
+    int write_through(unsigned block_no, uint8_t *blk);
+    int read_through(unsigned block_no, uint8_t *blk);
+    int write_blocks(std::map<unsigned, std::vector<uint8_t> > &blocks);
+    int punch(unsigned first, unsigned count);
+    // a bit per block, set when the block is written, see track_changes
+    uint8_t *changes = nullptr;
+    void mark(unsigned block_no) { if (changes) changes[block_no / 8] |= 1 << (block_no % 8); }
+    int punch_trimmed();
+    int barrier();
+    // held for a whole command and by the flusher, so that the flusher never
+    // commits a half done command. Recursive, a command may call sync itself
+    std::recursive_mutex busy;
+    // under FLUSH_GROUP, commits a group after group_ms when no command ends
+    std::thread flusher;
+    std::mutex flusher_lock;
+    std::condition_variable flusher_wake;
+    bool flusher_stop = false;
+    void flush_loop();
+    void stop_flusher();
 public:
-    Disk();
+    // opens the disk file, it is created if it does not exist
+    Disk(const std::string &diskfile = DISKNAME);
     ~Disk();
     unsigned get_no_blocks() { return no_blocks; }
     unsigned get_disk_size() { return disk_size; }
     // writes one block to the disk
     int write(unsigned block_no, uint8_t *blk);
-    // reads one block from the disk
+    // reads one block from the disk. Several threads may read at the same
+    // time, as long as none of them writes.
     int read(unsigned block_no, uint8_t *blk);
+    // reads the blocks to 'data', one after the other, with one preadv per
+    // run of adjacent blocks that are not buffered. Same threading as read.
+    int read_many(const std::vector<unsigned> &blocks, uint8_t *data);
+    // writes the blocks from 'data' like write does, but with one pwritev
+    // per run of adjacent blocks when they are written to the disk file at once
+    int write_many(const std::vector<unsigned> &blocks, const uint8_t *data);
+    // a block was freed: a buffered write of it is dropped, and after the next
+    // commit it is punched out of the disk file (the file gets a hole there)
+    void trim(unsigned block_no);
+    // bytes of the disk file that are stored on the host, holes excluded
+    long long host_bytes();
+    // reads the blocks into the read-ahead buffer, runs of adjacent blocks
+    // with one preadv. Blocks that are buffered already are skipped.
+    int prefetch(const std::vector<unsigned> &blocks);
+    // the read-ahead blocks read and dropped unread since the last call
+    void ahead_stats(unsigned &used, unsigned &wasted);
+    // writes one metadata block (FAT or directory block), the block is logged
+    // in the journal together with the other metadata blocks of the command
+    int write_meta(unsigned block_no, uint8_t *blk);
+    // attaches the journal of a mounted file system (nullptr detaches it)
+    void set_journal(Journal *j);
+    // sets the bit of every block written from now on in 'bitmap' (no_blocks
+    // bits, block 0 in the low bit of the first byte), nullptr stops it
+    void track_changes(uint8_t *bitmap) { changes = bitmap; }
+
+    // selects when written blocks are made durable, see FLUSH_* above
+    int set_policy(int new_policy, unsigned ms = GROUP_COMMIT_MS, unsigned blocks = GROUP_COMMIT_BLOCKS);
+    int get_policy() { return policy; }
+    // marks the start of a file system command, the flusher waits until it ends
+    void begin_command() { busy.lock(); }
+    // marks the end of a file system command, commits according to the policy
+    int end_command();
+    // durable point: writes all buffered blocks and waits for the device (fdatasync)
+    int sync();
+};
+
+// Calls Disk::begin_command() and Disk::end_command() around a file system
+// command, whatever path it returns by.
+class DiskCommand {
+private:
+    Disk &disk;
+public:
+    DiskCommand(Disk &d) : disk(d) { disk.begin_command(); }
+    ~DiskCommand() { disk.end_command(); }
 };
 
 #endif // __DISK_H__
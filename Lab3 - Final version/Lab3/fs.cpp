@@ -29,18 +29,134 @@ Hoppas detta räcker. Lycka till med rättningen!
 
 #include <iostream>
 #include <cstring>
-#include <cmath>
+#include <algorithm>
 #include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <chrono>
+#include <ctime>
+#include <thread>
 #include "fs.h"
+#include "fsck.h"
+#include "lz.h"
+#include "xxhash.h"
+#include "scan.h"
 
-FS::FS()
+// prints to the console of the FS; when it is silent the message is not formatted
+#define CONSOLE if (console == nullptr) ; else *console
+// records the call when a trace is being recorded, see trace.h
+#define TRACE(...) trace_call traced(recorder, __VA_ARGS__)
+
+const char *fs_status_text(int status)
+{
+    switch (status) {
+    case FS_OK: return "success";
+    case FS_EIO: return "input/output error";
+    case FS_ENOENT: return "no such file or directory";
+    case FS_EEXIST: return "file exists";
+    case FS_EACCES: return "permission denied";
+    case FS_ENOTDIR: return "not a directory";
+    case FS_EISDIR: return "is a directory";
+    case FS_ENOSPC: return "no space left on the disk";
+    case FS_EDIRFULL: return "directory full";
+    case FS_ENAME: return "bad file name";
+    case FS_EFBIG: return "file too large";
+    case FS_EBADF: return "bad file descriptor";
+    case FS_EMFILE: return "too many open files";
+    case FS_ESTALE: return "stale file descriptor";
+    case FS_EBUSY: return "directory in use";
+    case FS_EINVAL: return "invalid argument";
+    case FS_ECORRUPT: return "file system damaged";
+    case FS_ENOFS: return "no file system";
+    }
+    return "unknown error";
+}
+
+FS::FS(std::ostream *console, const std::string &diskfile) : console(console), disk(diskfile)
 {
-    std::cout << "FS::FS()... Creating file system\n";
+    CONSOLE << "FS::FS()... Creating file system\n";
+    // the blocks written from now on are the next delta, see export_delta
+    disk.track_changes(super.changed);
+    mount();
+}
+
+void FS::set_console(std::ostream *out)
+{
+    console = out;
 }
 
 FS::~FS()
 {
+    DiskCommand command(disk);
+    // unmount: the clean flag lets the next mount skip the consistency scan
+    if (has_super) {
+        ReadFromFAT();
+        writeSuper(true);
+    }
+    disk.sync();
+    disk.set_journal(nullptr);
+}
+
+int FS::mount(){
+    // replay a transaction left behind by a crash, then log all metadata writes
+    // through the journal (a disk formatted without a journal is used as is)
+    if (journal.replay(disk) == 0) {
+        disk.set_journal(&journal);
+    }
+
+    uint8_t block[BLOCK_SIZE];
+    int status = disk.read(SUPER_BLOCK, block);
+    if (status) return status;
+    memcpy(&super, block, sizeof(super));
+    if (super.magic != SUPER_MAGIC) {
+        // not formatted, or formatted before there was a superblock
+        return 0;
+    }
+    if (super.version != FS_VERSION || super.block_size != BLOCK_SIZE || super.no_blocks != disk.get_no_blocks()) {
+        CONSOLE << "Error: Unsupported disk format (version " << super.version << ", "
+                << super.no_blocks << " blocks of " << super.block_size << " bytes), format the disk\n";
+        return FS_ENOFS;
+    }
+    has_super = true;
+
+    status = ReadFromFAT();
+    if (status) return status;
+    if (!super.clean) {
+        // the last session crashed, nothing in the superblock can be trusted
+        CONSOLE << "FS: disk was not unmounted cleanly, checking it...\n";
+        fsck_report report;
+        status = fsck_check(disk, fat, super.refcount, true, report, 0, snapshotRoots());
+        if (status) return status;
+        if (console) fsck_print(report, *console);
+        // so are the bits of the changed blocks, the next delta has to be a full one
+        super.delta_base = 0;
+        status = writeToFAT();
+        if (status) return status;
+    }
+    // mark the disk as mounted until ~FS() writes the clean flag again
+    status = writeSuper(false);
+    if (status) return status;
+    return disk.sync();
+}
+
+int FS::writeSuper(bool clean){
+    super.clean = clean ? 1 : 0;
+    super.generation++;
+    uint8_t block[BLOCK_SIZE];
+    memset(block, 0, BLOCK_SIZE);
+    memcpy(block, &super, sizeof(super));
+    return disk.write_meta(SUPER_BLOCK, block);
+}
 
+unsigned FS::countFreeBlocks(){
+    unsigned free_blocks = 0;
+    for (int i = 0; i < (BLOCK_SIZE / 2); i++){
+        if (fat[i] == FAT_FREE){
+            free_blocks++;
+        }
+    }
+    return free_blocks;
 }
 
 //Userdefined functions
@@ -50,12 +166,7 @@ int FS::ReadFromFAT(){
 }
 
 int FS::findFreeBlock() {
-    int fatIndex;
-    for (fatIndex = 2; fatIndex < (BLOCK_SIZE / 2); fatIndex++){
-        if (fat[fatIndex] == FAT_FREE){
-            break;
-        }
-    }
+    int fatIndex = 2 + scan_word(&fat[2], (BLOCK_SIZE / 2) - 2, FAT_FREE);
     if (fatIndex == (BLOCK_SIZE / 2)) {
         fatIndex = -1;
     }
@@ -65,7 +176,9 @@ int FS::findFreeBlock() {
 
 // formats the disk, i.e., creates an empty file system
 int FS::format(){
-    std::cout << "FS::format()\n";
+    TRACE(TRACE_FORMAT);
+    DiskCommand command(disk);
+    CONSOLE << "FS::format()\n";
 
     // initializes FAT
     fat[ROOT_BLOCK] = FAT_EOF;
@@ -75,18 +188,55 @@ int FS::format(){
     {
         fat[i] = FAT_FREE;
     }
-    int status = writeToFAT();
+    // whatever the data blocks held is punched out of the disk file
+    for (int i = FIRST_DATA_BLOCK; i < (BLOCK_SIZE / 2); i++)
+    {
+        disk.trim(i);
+    }
+    // the journal region and the superblock are reserved like the root and FAT blocks
+    for (int i = JOURNAL_BLOCK; i <= SUPER_BLOCK; i++)
+    {
+        fat[i] = FAT_EOF;
+    }
+    int status = journal.format(disk);
     if(status){
         return status;
     }
-    //initialize blocks to all zeroes
-    uint8_t root_block[BLOCK_SIZE];
-    for (int i = 0; i < BLOCK_SIZE; i++)
+    disk.set_journal(&journal);
+
+    uint64_t generation = has_super ? super.generation : 0;
+    memset(&super, 0, sizeof(super));
+    super.magic = SUPER_MAGIC;
+    super.version = FS_VERSION;
+    super.block_size = BLOCK_SIZE;
+    super.no_blocks = disk.get_no_blocks();
+    super.root_block = ROOT_BLOCK;
+    super.fat_block = FAT_BLOCK;
+    super.journal_block = JOURNAL_BLOCK;
+    super.journal_blocks = JOURNAL_BLOCKS;
+    super.generation = generation;
+    has_super = true;
+    block_index.clear();
+    block_key.assign(BLOCK_SIZE / 2, 0);
+    for (int fd = 0; fd < MAX_OPEN_FILES; fd++)
     {
-        root_block[i] = 0;
+        handles[fd].used = false;
+    }
+    ahead = read_ahead();
+
+    status = writeToFAT();
+    if(status){
+        return status;
+    }
+    status = writeSuper(false);
+    if(status){
+        return status;
     }
+    //initialize blocks to all zeroes
+    uint8_t root_block[BLOCK_SIZE];
+    memset(root_block, 0, BLOCK_SIZE);
 
-    status = disk.write(ROOT_BLOCK, root_block);
+    status = disk.write_meta(ROOT_BLOCK, root_block);
     goHome();
     return status;
 }
@@ -161,8 +311,8 @@ int FS::GetDirectoryBlock(std::string filepath, int &dir_block, uint8_t accessri
                 return sts;
 
             if (dir_entries[dir_index].type != TYPE_DIR) {
-                std::cout << "Error: Filepath is not a directory: " << dirname << "\n";
-                return 1;
+                CONSOLE << "Error: Filepath is not a directory: " << dirname << "\n";
+                return FS_ENOTDIR;
             }
             dir_block = dir_entries[dir_index].first_blk;
         }
@@ -216,22 +366,31 @@ int FS::FileEntry(int dir_block, std::string filepath, int &index, dir_entry *di
         }
     }
 
+    if (index == -1 && NewOrOld == NEW) {
+        // the entries may be taken by the content of small files, one is moved out to blocks
+        status = spillInline(dir_block, dir_entries, index);
+        if (status)
+            return status;
+    }
+
     if (index < 0) {
         if (index == -2) {
-            std::cout << "Error: File already exists: " << filename << "\n";
+            CONSOLE << "Error: File already exists: " << filename << "\n";
+            status = FS_EEXIST;
         }
         else {
             if (NewOrOld == NEW){
-                std::cout << "Error: No more free directory entries\n";
+                CONSOLE << "Error: No more free directory entries\n";
+                status = FS_EDIRFULL;
             }
             else{
-                std::cout << "Error: File not found: " << filename << "\n";
+                CONSOLE << "Error: File not found: " << filename << "\n";
+                status = FS_ENOENT;
             }
         }
-        status = 1;
     }
 
-    if (accessrights > 0) {
+    if (accessrights > 0 && index >= 0) {
 
     // Check file access
         if (NewOrOld == OLD) {
@@ -242,32 +401,32 @@ int FS::FileEntry(int dir_block, std::string filepath, int &index, dir_entry *di
             if (!access) {
                 switch ((int)dir_entries[index].access_rights){ 
                 case 1:
-                    std::cout << "Error 1: EXE access is only permitted\n";
+                    CONSOLE << "Error 1: EXE access is only permitted\n";
 
                     break;
                 case 2:
-                    std::cout << "Error 2: Write access is only permitted\n";
+                    CONSOLE << "Error 2: Write access is only permitted\n";
                     break;
                 case 3:
-                    std::cout << "Error 3: Execute & Write access is only permitted \n";
+                    CONSOLE << "Error 3: Execute & Write access is only permitted \n";
                     break;
                 case 4:
-                    std::cout << "Error 4: Read access is only permitted \n";
+                    CONSOLE << "Error 4: Read access is only permitted \n";
                     break;
                 case 5:
-                    std::cout << "Error 5: Read & Executute access is only permitted \n";
+                    CONSOLE << "Error 5: Read & Executute access is only permitted \n";
                     break;
                 case 6:
-                    std::cout << "Error 6: Read & Write access is only permitted \n";
+                    CONSOLE << "Error 6: Read & Write access is only permitted \n";
                     break;
                 case 7:
-                    std::cout << "Error 7: Read & Write & Execute access is only permitted \n";
+                    CONSOLE << "Error 7: Read & Write & Execute access is only permitted \n";
                     break;
                 default:
                     
                     break;
                 }
-                return -1; 
+                return FS_EACCES;
             }
         }
     }
@@ -277,17 +436,30 @@ int FS::FileEntry(int dir_block, std::string filepath, int &index, dir_entry *di
 // create <filepath> creates a new file on the disk, the data content is
 // written on the following rows (ended with an empty row)
 int FS::create(std::string filepath){
+    return createFile(filepath, nullptr, 0);
+}
+
+// creates a new file with 'length' bytes of 'data' as its content
+int FS::create(std::string filepath, const char *data, uint32_t length){
+    return createFile(filepath, data, length);
+}
 
-    std::cout << "FS::create(" << filepath << ")\n";
+// the content is 'data', or the lines read from stdin when 'data' is nullptr
+int FS::createFile(std::string filepath, const char *data, uint32_t length){
+    TRACE(TRACE_CREATE, filepath, length);
+    DiskCommand command(disk);
+
+    CONSOLE << "FS::create(" << filepath << ")\n";
     int status = ReadFromFAT();
     if(status){
         return status;
     }
-    if(filepath.length() > 55){
-        std::cout << "Error: Name can't be longer than 55\n" << std::endl;
-        return 1;
+    // the entry holds the name of the file, not the path to it
+    std::string nameOfFile = getFileName(filepath);
+    if(nameOfFile.length() > 55){
+        CONSOLE << "Error: Name can't be longer than 55\n" << std::endl;
+        return FS_ENAME;
     }
-    std::string nameOfFile = filepath;
     dir_info dir; 
 
     //status = FileEntry(dir.block,filepath,dir.index,dir.entries, NEW);
@@ -296,94 +468,42 @@ int FS::create(std::string filepath){
         return status;
     }
     
-    int curr_blk = findFreeBlock();
-    if(curr_blk == -1){
-        std::cout << "Error: No free blocks\n" << std::endl;
-        return 1;
-    }
-    //std::cout << "CHECK: " << working_directory << dir.entries[dir.index].access_rights << std::endl;
-
-    fat[curr_blk] = FAT_EOF;
-    int first_block = curr_blk;
-    char data[BLOCK_SIZE] = {int(0)}; //Data container  memset(data, 0, BLOCK_SIZE);
-    memset(data,0,BLOCK_SIZE);
-
-    std::string line = ".";
-    uint32_t size = 0;      // Current block size counter
-    uint32_t tot_size = 0;  // File size counter
-    //To find the next block
-    bool done = false;
-    while(!done){
-        std::getline(std::cin, line); // max is 4096
-        //std::cout << "block: " << (line.length() + 1 + size) << std::endl;
-        if(line.empty()){
-            //std::cout << "Done " << std::endl;
-            done = true;
-            status = disk.write(curr_blk, (uint8_t*)data);
-            if (status){
-                return status;
-            }   
-        }
-        else if((line.length() + 1 + size) > BLOCK_SIZE){
-            int length = BLOCK_SIZE - size;
-            tot_size += length;
-            memcpy(&data[size], line.c_str(), length);
-            //std::cout << "DEBUG: Placing " << line.substr(length) << " at block " << curr_blk << std::endl;
-
-            status = disk.write(curr_blk, (uint8_t*)data);
-            
-            if(status){
-                return 1;
-            }
-            memset(data,0,BLOCK_SIZE);
-            int new_block = findFreeBlock();
-                if (new_block == -1) {
-                    std::cout << "Error: No free blocks\n";
-                    return 1;
-                }
-            //std::cout << "DEBUG: Old block: " << curr_blk << " New block: " << new_block << std::endl;
-
-            fat[new_block] = FAT_EOF;
-            fat[curr_blk] = new_block;
-            curr_blk = new_block;
-            size = 0;
-            line = line.substr(length);
-            //tot_size++;
-            tot_size++;
-            
+    // the content is written as it is read, every line ends with a NUL
+    chain_writer writer;
+    writerInit(writer, compression);
+    std::string line;
+    while(data == nullptr && std::getline(std::cin, line) && !line.empty()){
+        status = writerPut(writer, line.c_str(), line.length() + 1);
+        if(status){
+            return status;
         }
-        else{
-            //std::cout << "DEBUG: Placing " << line << " at block " << curr_blk << std::endl;
-            memcpy(&data[size], line.c_str(), line.length() + 1);
-            size += line.length();
-            tot_size += line.length();
-            //tot_size++;
-            tot_size++;
-            line.clear();
+    }
+    if(data != nullptr && length > 0){
+        status = writerPut(writer, data, length);
+        if(status){
+            return status;
         }
     }
-    status = disk.write(curr_blk, (uint8_t*)data);
+    // the size of content read from stdin is only known now
+    traced.record.num[0] = writer.size;
+    status = writerStore(writer, dir);
     if(status){
         return status;
     }
-    if(dir.index == -1){
-        std::cout << "Error: The directory is full" << std::endl;
-        return 1;
-    }
     memcpy(dir.entries[dir.index].file_name, nameOfFile.c_str(), nameOfFile.length() + 1);
-    dir.entries[dir.index].first_blk = first_block;
-    dir.entries[dir.index].size = tot_size;
-    dir.entries[dir.index].type = TYPE_FILE;
     dir.entries[dir.index].access_rights = READ | WRITE;
 
-    status = disk.write(dir.block, (uint8_t*)dir.entries);
+    status = disk.write_meta(dir.block, (uint8_t*)dir.entries);
     if (status){
         return status;
     }
 
-    status = writeToFAT();
-    if (status){
-        return status;
+    // an inline file is only the directory block, the FAT is unchanged
+    if (!(dir.entries[dir.index].type & TYPE_INLINE)){
+        status = writeToFAT();
+        if (status){
+            return status;
+        }
     }
     return 0;
 }
@@ -391,7 +511,16 @@ int FS::create(std::string filepath){
 // cat <filepath> reads the content of a file and prints it on the screen
 int FS::cat(std::string filepath)
 {
-    std::cout << "FS::cat(" << filepath << ")\n";
+    std::ostream discard(nullptr);
+    return cat(filepath, console ? *console : discard);
+}
+
+// writes the content of a file to 'out', one line at a time
+int FS::cat(std::string filepath, std::ostream &out)
+{
+    TRACE(TRACE_CAT, filepath);
+    DiskCommand command(disk);
+    CONSOLE << "FS::cat(" << filepath << ")\n";
 
     // read FAT from disk to memory
     int sts = ReadFromFAT();
@@ -403,41 +532,36 @@ int FS::cat(std::string filepath)
     if (sts) return sts;
 
     if (dir.entries[dir.index].type == TYPE_DIR) {
-        std::cout << "Error: '" << filepath << "' is a directory\n";
-        return 1;
+        CONSOLE << "Error: '" << filepath << "' is a directory\n";
+        return FS_EISDIR;
     }
 
-    int file_blk = dir.entries[dir.index].first_blk;
     uint32_t file_size = dir.entries[dir.index].size;
 
     uint32_t size = 0;
     uint32_t tot_size = 0;
     char data[BLOCK_SIZE];
 
-    sts = disk.read(file_blk, (uint8_t*)data);
+    chain_reader reader;
+    sts = readerInit(reader, dir.entries[dir.index], dir.entries);
+    if (sts)
+        return sts;
+    sts = readerNext(reader, data);
     if (sts)
         return sts;
 
     while (tot_size < file_size) {
 
         // A line can potentially span over multiple blocks, so check block boundaries.
-        int len = 0;
-        for (int i = size; i < BLOCK_SIZE; i++, len++)
-            if (data[i] == '\0') break;
+        int len = scan_byte(&data[size], BLOCK_SIZE - size, '\0');
 
-        printf("%-*.*s", len, len, &data[size]);
+        out.write(&data[size], len);
         size += len;
         tot_size += len;
         if (size == BLOCK_SIZE) {
             // line continues in next block
             size = 0;
-            file_blk = fat[file_blk];
-            if (file_blk == FAT_EOF) {
-                printf("Programming error ... unexpected EOF detected\n");
-                return 1;
-            }
-
-            sts = disk.read(file_blk, (uint8_t*)data);
+            sts = readerNext(reader, data);
             if (sts)
                 return sts;
 
@@ -445,7 +569,7 @@ int FS::cat(std::string filepath)
         else {
             size++;
             tot_size++;
-            printf("\n");
+            out.put('\n');
         }
     }
 
@@ -454,71 +578,118 @@ int FS::cat(std::string filepath)
 
 // ls lists the content in the currect directory (files and sub-directories)
 int FS::ls(){
+    return ls("", false);
+}
+
+static bool nameBefore(const dir_entry *a, const dir_entry *b){
+    return strcmp(a->file_name, b->file_name) < 0;
+}
+
+// ls [-l] [dirpath] lists the directory sorted by name, with -l also the
+// first block, the number of blocks of the chain and the flags of each entry
+int FS::ls(std::string dirpath, bool long_format){
+    TRACE(TRACE_LS, dirpath, long_format);
+    DiskCommand command(disk);
 
-    std::cout << "FS::ls()\n";
+    CONSOLE << "FS::ls(" << dirpath << ")\n";
 
     // read FAT from disk to memory
     int status = ReadFromFAT();
     if (status){
         return status;
     }
-    
-    
-    // Get the directory entries for the current dir
-    dir_entry dir_entries[MAX_DIR_ENTRIES];
-    status = disk.read(curr_blk, (uint8_t*)dir_entries);
+
+    dir_stream dir;
+    status = opendir(dirpath, dir);
     if (status){
         return status;
     }
-    std::string cwd = working_directory;
-
-    std::cout << "Name \t Size \t Access rights \t Type " << std::endl;
-    std::cout << "---- \t ---- \t ------------- \t ---- " << std::endl;
-    
-    for (int i = 0; i < (int)MAX_DIR_ENTRIES; i++){
-        if (dir_entries[i].file_name[0] != 0){
-            std::string blocks = std::to_string(curr_blk);
-            std::string filetype;
-            std::string access_right = "";
-        
-            if (dir_entries[i].access_rights & READ) {
-                access_right += "r";
-            } else {
-                access_right += "-";
-            }
+    const dir_entry *sorted[MAX_DIR_ENTRIES];
+    unsigned count = 0;
+    for (const dir_entry *entry = readdir(dir); entry != nullptr; entry = readdir(dir)){
+        sorted[count++] = entry;
+    }
+    std::sort(sorted, sorted + count, nameBefore);
+    if (console == nullptr){
+        return 0;
+    }
 
-            if (dir_entries[i].access_rights & WRITE) {
-                access_right += "w";
-            } else {
-                access_right += "-";
-            }
+    CONSOLE << "Name \t Size \t Access rights \t Type ";
+    CONSOLE << (long_format ? "\t First block \t Blocks \t Flags " : "") << std::endl;
+    CONSOLE << "---- \t ---- \t ------------- \t ---- ";
+    CONSOLE << (long_format ? "\t ----------- \t ------ \t ----- " : "") << std::endl;
 
-            if (dir_entries[i].access_rights & EXECUTE) {
-                access_right += "x";
-            } else {
-                access_right += "-";
-            }
+    for (unsigned i = 0; i < count; i++){
+        const dir_entry &entry = *sorted[i];
+        char access_right[4] = "---";
+        if (entry.access_rights & READ) access_right[0] = 'r';
+        if (entry.access_rights & WRITE) access_right[1] = 'w';
+        if (entry.access_rights & EXECUTE) access_right[2] = 'x';
 
-            int curr_blk = dir_entries[i].first_blk;
-            if (curr_blk != ROOT_BLOCK){
-                if(dir_entries[i].type == 0){
-                    std::cout << dir_entries[i].file_name << "\t " << dir_entries[i].size << "\t " << access_right << "\t" << "\t" << " file" << std::endl;
-                }
-                else{
-                    std::cout << dir_entries[i].file_name << "\t " << " - " << "\t " << access_right << "\t" << "\t" << " dir" << std::endl;
+        if ((entry.type & TYPE_MASK) == TYPE_FILE){
+            CONSOLE << entry.file_name << "\t " << entry.size << "\t " << access_right << "\t" << "\t" << " file";
+        }
+        else{
+            CONSOLE << entry.file_name << "\t " << " - " << "\t " << access_right << "\t" << "\t" << " dir";
+        }
+        if (long_format){
+            // an inline file has its data in the slots of the directory block
+            unsigned blocks = 0;
+            bool shared = false;
+            if (!(entry.type & TYPE_INLINE)){
+                for (int block = entry.first_blk; block >= 0 && block < BLOCK_SIZE / 2 && blocks < BLOCK_SIZE / 2; block = fat[block]){
+                    shared = shared || (has_super && super.refcount[block] > 0);
+                    blocks++;
                 }
             }
-
+            std::string flags;
+            if (entry.type & TYPE_COMPRESSED) flags += "c";
+            if (entry.type & TYPE_INLINE) flags += "i";
+            if (shared) flags += "s";
+            CONSOLE << "\t " << entry.first_blk << "\t\t " << blocks << "\t\t " << (flags.empty() ? "-" : flags);
         }
+        CONSOLE << std::endl;
     }
-    std::cout << "\n"; // Just too make some spaceing for estetics
+    CONSOLE << "\n"; // Just too make some spaceing for estetics
 
     return 0;
 }
 
+// opens the directory <dirpath>, the current directory when it is empty
+int FS::opendir(std::string dirpath, dir_stream &dir){
+    DiskCommand command(disk);
+    dir.block = curr_blk;
+    if (!dirpath.empty()){
+        dir_entry entry;
+        int status = stat(dirpath, entry);
+        if (status) return status;
+        if ((entry.type & TYPE_MASK) != TYPE_DIR){
+            CONSOLE << "Error: Filepath is not a directory: " << dirpath << "\n";
+            return FS_ENOTDIR;
+        }
+        dir.block = entry.first_blk;
+    }
+    dir.next = 0;
+    return disk.read(dir.block, (uint8_t*)dir.entries);
+}
+
+// the next entry of the directory, the entries stay valid until the next opendir
+const dir_entry *FS::readdir(dir_stream &dir){
+    while (dir.next < MAX_DIR_ENTRIES){
+        const dir_entry &entry = dir.entries[dir.next++];
+        if (entry.file_name[0] != 0 && entry.file_name[0] != INLINE_SLOT &&
+            strcmp(entry.file_name, PARENT_DIR.c_str()) != 0){
+            return &entry;
+        }
+    }
+    return nullptr;
+}
+
 // cp <sourcepath> <destpath> makes an exact copy of the file
 // <sourcepath> to a new file <destpath>
 int FS::cp(std::string sourcepath, std::string destpath){
+    TRACE(TRACE_CP, sourcepath, destpath);
+    DiskCommand command(disk);
     int status = ReadFromFAT();
     if (status){
         return status;
@@ -547,7 +718,7 @@ int FS::cp(std::string sourcepath, std::string destpath){
             }
     }
     if(checker == -1){
-        std::cout << "Error: The source file doesn't exist!" << std::endl;
+        CONSOLE << "Error: The source file doesn't exist!" << std::endl;
         return 0;
     }
     if(destpath == ".."){ 
@@ -588,7 +759,7 @@ int FS::cp(std::string sourcepath, std::string destpath){
         }
     }
     if(!dir_exists){
-        std::cout << "Error: The destination directory doesn't exist!" << std::endl;
+        CONSOLE << "Error: The destination directory doesn't exist!" << std::endl;
         return 0;
     }
 
@@ -608,6 +779,10 @@ int FS::cp(std::string sourcepath, std::string destpath){
         status = FindingFileEntry(path, NEW, destination, WRITE);
         if(status) return status;
     }
+    if(source.block == destination.block){
+        // the lookup of the new entry may have moved a small file out of the block
+        memcpy(source.entries, destination.entries, BLOCK_SIZE);
+    }
 
     char data[BLOCK_SIZE];
     memset(data, 0, BLOCK_SIZE);
@@ -615,13 +790,25 @@ int FS::cp(std::string sourcepath, std::string destpath){
     int first_block = -1;
     int previous_block = -1;
     int source_block = source.entries[source.index].first_blk;
+    bool inlined = source.entries[source.index].type & TYPE_INLINE;
+    if(inlined){
+        // a small file is stored again below, inline in the destination directory if it fits
+        source_block = FAT_EOF;
+    }
+    else if(dedup && super.refcount[source_block] < MAX_REFCOUNT){
+        // a clone: the copy shares all blocks with the source
+        super.refcount[source_block]++;
+        refcounts_changed = true;
+        first_block = source_block;
+        source_block = FAT_EOF;
+    }
     while(source_block != FAT_EOF){
 
         //finding FAT free entry
         int curr_blk = findFreeBlock();
         if(curr_blk < 0){
-            std::cout << "Error: There isn't anymore free blocks in FAT" << std::endl;
-            return 1;
+            CONSOLE << "Error: There isn't anymore free blocks in FAT" << std::endl;
+            return FS_ENOSPC;
         }
 
         if(first_block == -1){
@@ -632,7 +819,7 @@ int FS::cp(std::string sourcepath, std::string destpath){
         }
         fat[curr_blk] = FAT_EOF;
 
-        status = disk.read(source_block, (uint8_t*)data);
+        status = readBlock(source_block, (uint8_t*)data);
         if(status) return status;
         status = disk.write(curr_blk, (uint8_t*)data);
         if(status) return status;
@@ -653,8 +840,19 @@ int FS::cp(std::string sourcepath, std::string destpath){
         memcpy(destination.entries[destination.index].file_name, destpath.c_str(), destpath.length() + 1);
     }
     destination.entries[destination.index].first_blk = first_block;
+    if(inlined){
+        uint8_t content[INLINE_MAX];
+        status = readInline(source.entries, source.entries[source.index], content);
+        if(status) return status;
+        chain_writer writer;
+        writerInit(writer, false);
+        status = writerPut(writer, (char*)content, source.entries[source.index].size);
+        if(status) return status;
+        status = writerStore(writer, destination);
+        if(status) return status;
+    }
 
-    status = disk.write(destination.block, (uint8_t*)destination.entries);
+    status = disk.write_meta(destination.block, (uint8_t*)destination.entries);
     if(status) return status;
 
     status = writeToFAT();
@@ -666,6 +864,8 @@ int FS::cp(std::string sourcepath, std::string destpath){
 
 // mv <sourcepath> <destpath> renames the file <sourcepath> to the name <destpath>,
 int FS::mv(std::string sourcepath, std::string destpath){ // cp and rm combined
+    TRACE(TRACE_MV, sourcepath, destpath);
+    DiskCommand command(disk);
     int status = ReadFromFAT();
     if (status){
         return status;
@@ -695,7 +895,7 @@ int FS::mv(std::string sourcepath, std::string destpath){ // cp and rm combined
             }
     }
     if(checker == -1){
-        std::cout << "Error: The source file doesn't exist!" << std::endl;
+        CONSOLE << "Error: The source file doesn't exist!" << std::endl;
         return 0;
     }
     if(destpath == ".."){ 
@@ -737,7 +937,7 @@ int FS::mv(std::string sourcepath, std::string destpath){ // cp and rm combined
         }
     }
     if(!dir_exists){
-        std::cout << "Error: The destination directory doesn't exist!" << std::endl;
+        CONSOLE << "Error: The destination directory doesn't exist!" << std::endl;
         return 0;
     }
 
@@ -757,62 +957,35 @@ int FS::mv(std::string sourcepath, std::string destpath){ // cp and rm combined
         if(status) return status;
     }
 
-    char data[BLOCK_SIZE];
-    memset(data, 0, BLOCK_SIZE);
-
-    int first_block = -1;
-    int previous_block = -1;
-    int source_block = source.entries[source.index].first_blk;
-    while(source_block != FAT_EOF){
-
-        //finding FAT free entry
-        int curr_blk = findFreeBlock();
-        if(curr_blk < 0){
-            std::cout << "Error: There isn't anymore free blocks in FAT" << std::endl;
-            return 1;
-        }
-
-        if(first_block == -1){
-            first_block = curr_blk;
-        }
-        if(previous_block != -1){
-            fat[previous_block] = curr_blk;
-        }
-        fat[curr_blk] = FAT_EOF;
-
-        status = disk.read(source_block, (uint8_t*)data);
-        if(status) return status;
-        status = disk.write(curr_blk, (uint8_t*)data);
-        if(status) return status;
-
-        previous_block = curr_blk;
-        source_block = fat[source_block];
-    }
-
-
     //copying the file entry info from source to destination
     
-    //set the new filename and the new first-block
+    //set the new filename, the chain of the file stays where it is
     if(bool_dir){
         memcpy(&destination.entries[destination.index], &source.entries[source.index], sizeof(dir_entry));
 
         memcpy(destination.entries[destination.index].file_name, sourcepath.c_str(), sourcepath.length() + 1);
-        destination.entries[destination.index].first_blk = first_block;
+        if(source.entries[source.index].type & TYPE_INLINE){
+            // the content of a small file moves with it to the other directory block
+            uint8_t content[INLINE_MAX];
+            status = readInline(source.entries, source.entries[source.index], content);
+            if(status) return status;
+            chain_writer writer;
+            writerInit(writer, false);
+            status = writerPut(writer, (char*)content, source.entries[source.index].size);
+            if(status) return status;
+            status = writerStore(writer, destination);
+            if(status) return status;
+            freeInline(source.entries, source.entries[source.index]);
+        }
 
-        status = disk.write(destination.block, (uint8_t*)destination.entries);
+        status = disk.write_meta(destination.block, (uint8_t*)destination.entries);
         if(status) return status;
-        
-        int disk_block = source.entries[source.index].first_blk;
-        while(disk_block != FAT_EOF){
-            int next_block = fat[disk_block];
-            fat[disk_block] = FAT_FREE;
-            disk_block = next_block;
-        }
 
         //writing the empty block to disk
         memset(&source.entries[source.index], 0, sizeof(dir_entry));
-        status = disk.write(source.block, (uint8_t*)source.entries);
+        status = disk.write_meta(source.block, (uint8_t*)source.entries);
         if (status) return status;
+        dropHandles(source.block, source.index);
     }
     else{
         status = FindingFileEntry(sourcepath, OLD, source, READ);
@@ -820,7 +993,7 @@ int FS::mv(std::string sourcepath, std::string destpath){ // cp and rm combined
         //std::cout << "Check (rename) source.entries[source.index].file_name = "<< source.entries[source.index].file_name << std::endl;
         memcpy(source.entries[source.index].file_name, destpath.c_str(), destpath.length() + 1);
 
-        status = disk.write(source.block, (uint8_t*)source.entries);
+        status = disk.write_meta(source.block, (uint8_t*)source.entries);
         if (status) return status;
     }
     
@@ -832,56 +1005,37 @@ int FS::mv(std::string sourcepath, std::string destpath){ // cp and rm combined
 
 // rm <filepath> removes / deletes the file <filepath>
 int FS::rm(std::string filepath){
-    std::cout << "FS::rm(" << filepath << ")\n";
+    TRACE(TRACE_RM, filepath);
+    DiskCommand command(disk);
+    CONSOLE << "FS::rm(" << filepath << ")\n";
     
     int status = ReadFromFAT();
     if(status) return status;
-    
-       //check if the desitnation file already exists
-    dir_entry dir_entries[MAX_DIR_ENTRIES];
-    status = disk.read(curr_blk, (uint8_t*)dir_entries);
-    if (status){
-        return status;
-    }
-    
-    int checker = -1;
-    for (int i = 0; i < (int)MAX_DIR_ENTRIES; i++){
-        if (dir_entries[i].file_name[0] != 0){
-            std::string blocks = std::to_string(curr_blk);
-                if((dir_entries[i].file_name == filepath)){
-                    checker = 1;
-                    if((dir_entries[i].file_name == filepath) && dir_entries[i].type == TYPE_DIR){
-                        checker = -2;
-                    }
-                }
-                
-            }
-    }
-    if(checker == -1){
-        std::cout << "Error: The file or directory doesn't exist!" << std::endl;
-        return 1;
-    }
-    if(checker == -2){
-        std::cout << "Error: You can't remove a directory!" << std::endl;
-        return 1;
-    }
 
+    // the file is looked up by its path, it need not be in the working directory
     dir_info source;
+    status = FindingFileEntry(filepath, OLD, source, 0);
+    if(status) return status;
+    if(source.entries[source.index].type == TYPE_DIR){
+        CONSOLE << "Error: You can't remove a directory!" << std::endl;
+        return FS_EISDIR;
+    }
     status = FindingFileEntry(filepath, OLD, source, WRITE);
     if(status) return status;
 
     
-    int disk_block = source.entries[source.index].first_blk;
-    while(disk_block != FAT_EOF){
-        int next_block = fat[disk_block];
-        fat[disk_block] = FAT_FREE;
-        disk_block = next_block;
+    if(source.entries[source.index].type & TYPE_INLINE){
+        freeInline(source.entries, source.entries[source.index]);
+    }
+    else{
+        releaseChain(source.entries[source.index].first_blk);
     }
 
     //writing the empty block to disk
     memset(&source.entries[source.index], 0, sizeof(dir_entry));
-    status = disk.write(source.block, (uint8_t*)source.entries);
+    status = disk.write_meta(source.block, (uint8_t*)source.entries);
     if (status) return status;
+    dropHandles(source.block, source.index);
     
     status = writeToFAT();
     if (status) return status;
@@ -889,134 +1043,580 @@ int FS::rm(std::string filepath){
     return 0;
 }
 
-int FS::get_file_string(std::string filepath,std::string &text){
-    //This function works the same as cat but modifies the reference text to be the text of the filepath. 
-    int status = ReadFromFAT();
-    if(status){
-        return status;
+// cp -r <sourcepath> <destpath> copies the directory <sourcepath> and all
+// below it to <destpath>, or into <destpath> if that is a directory
+int FS::copy_tree(std::string sourcepath, std::string destpath){
+    TRACE(TRACE_COPY_TREE, sourcepath, destpath);
+    DiskCommand command(disk);
+    dir_info source;
+    int status = FindingFileEntry(sourcepath, OLD, source, READ);
+    if (status) return status;
+    dir_entry root = source.entries[source.index];
+    if ((root.type & TYPE_MASK) != TYPE_DIR){
+        // a file is copied like cp does
+        return cp(sourcepath, destpath);
     }
 
-    dir_info dir;
-    dir_entry dir_entries[MAX_DIR_ENTRIES];
-    
-    status = FindingFileEntry(filepath,OLD,dir,READ);
-    if(status){
-        return status;
-    }
-    
-    int file_block = dir.entries[dir.index].first_blk;
-    
+    CONSOLE << "FS::copy_tree(" << sourcepath << ", " << destpath << ")\n";
+    status = ReadFromFAT();
+    if (status) return status;
 
-    uint32_t size = 0;
-    uint32_t tot_size = 0;
+    int parent;
+    std::string name;
+    status = treeDestination(destpath, root.file_name, parent, name);
+    if (status) return status;
 
-    char data[BLOCK_SIZE];
-    
+    // 1. plan: the blocks of the copy are allocated in the FAT
+    tree_plan plan;
+    int new_block = findFreeBlock();
+    if (new_block < 0){
+        CONSOLE << "Error: There isn't anymore free blocks in FAT" << std::endl;
+        return FS_ENOSPC;
+    }
+    fat[new_block] = FAT_EOF;
+    status = planTree(root.first_blk, new_block, parent, plan);
+    if (status) return status;
+    if (plan.sources.count(parent)){
+        CONSOLE << "Error: A directory can't be copied into itself\n";
+        return FS_EINVAL;
+    }
+    dir_info destination;
+    destination.block = parent;
+    status = FileEntry(parent, name, destination.index, destination.entries, NEW, 0);
+    if (status) return status;
 
-    status = disk.read(file_block, (uint8_t*)data);
-    if(status){
-        return status;
+    // 2. the data blocks, by the pool of threads
+    status = copyBlocks(plan);
+    if (status) return status;
+
+    // 3. the directory blocks, the new entry and the FAT in one commit
+    for (std::map<int, int>::iterator it = plan.clones.begin(); it != plan.clones.end(); ++it){
+        super.refcount[it->first] += it->second;
+        refcounts_changed = true;
+    }
+    for (std::map<int, std::vector<dir_entry> >::iterator it = plan.dirs.begin(); it != plan.dirs.end(); ++it){
+        status = disk.write_meta(it->first, (uint8_t*)it->second.data());
+        if (status) return status;
     }
-    int length = 0;
+    destination.entries[destination.index] = root;
+    memset(destination.entries[destination.index].file_name, 0, sizeof(root.file_name));
+    memcpy(destination.entries[destination.index].file_name, name.c_str(), name.length() + 1);
+    destination.entries[destination.index].first_blk = new_block;
+    status = disk.write_meta(destination.block, (uint8_t*)destination.entries);
+    if (status) return status;
+    return writeToFAT();
+}
 
-    while(tot_size < dir.entries[dir.index].size){
-        for (int i = size; i < BLOCK_SIZE; i++, length++){
-            if (data[i] == '\0'){
-                break;
-            } 
+// the directory a tree is copied to and the name of its top directory:
+// <destpath>, or 'source_name' inside <destpath> if that is a directory
+int FS::treeDestination(std::string destpath, std::string source_name, int &parent, std::string &name){
+    int status = GetDirectoryBlock(destpath, parent, WRITE);
+    if (status) return status;
+    name = getFileName(destpath);
+    dir_entry dir_entries[MAX_DIR_ENTRIES];
+    status = disk.read(parent, (uint8_t*)dir_entries);
+    if (status) return status;
+    for (int i = 0; i < (int)MAX_DIR_ENTRIES && !name.empty(); i++){
+        if (dir_entries[i].file_name[0] != INLINE_SLOT && strcmp(dir_entries[i].file_name, name.c_str()) == 0){
+            if (dir_entries[i].type != TYPE_DIR){
+                CONSOLE << "Error: File already exists: " << name << "\n";
+                return FS_EEXIST;
+            }
+            parent = dir_entries[i].first_blk;
+            name = "";
         }
-        text += &data[size];
-        size += length;
-        tot_size += length;
-        size++;
-        tot_size++;
-        
+    }
+    if (name.empty()){
+        name = source_name;
+    }
+    if (name.empty() || name.length() > 55){
+        CONSOLE << "Error: Name can't be empty or longer than 55\n" << std::endl;
+        return FS_ENAME;
     }
     return 0;
-
 }
 
-int FS::get_free_blocks(int* free_blocks,int amount_blocks,int start_block){
-    //get new
-    int status = disk.read(FAT_BLOCK, (uint8_t*) &fat);
-    if(status){
-        return status;
+// the entry of the file or directory, the root directory has the name "/"
+int FS::stat(std::string path, dir_entry &entry){
+    TRACE(TRACE_STAT, path);
+    DiskCommand command(disk);
+    if (!path.empty() && path[0] == SNAPSHOT_PREFIX){
+        return snapshotEntry(path, entry);
+    }
+    if (path == "/"){
+        memset(&entry, 0, sizeof(entry));
+        entry.file_name[0] = '/';
+        entry.first_blk = ROOT_BLOCK;
+        entry.type = TYPE_DIR;
+        entry.access_rights = READ | WRITE | EXECUTE;
+        return 0;
     }
+    dir_info dir;
+    int status = FindingFileEntry(path, OLD, dir, 0);
+    if (status) return status;
+    entry = dir.entries[dir.index];
+    return 0;
+}
 
-    int free_blocks_counter = 0;
-    //calculates free blocks
-    for(int i = 2; i < BLOCK_SIZE/2 && free_blocks_counter < amount_blocks; i++){
-        if(fat[i] == FAT_EOF){
-            free_blocks[free_blocks_counter+start_block] = i;
-            free_blocks_counter++;
-        }
+// the entries of the directory, without the parent entry and the inline slots
+int FS::list(std::string dirpath, std::vector<dir_entry> &entries){
+    TRACE(TRACE_LIST, dirpath);
+    DiskCommand command(disk);
+    dir_stream dir;
+    int status = opendir(dirpath, dir);
+    if (status) return status;
+    entries.clear();
+    for (const dir_entry *entry = readdir(dir); entry != nullptr; entry = readdir(dir)){
+        entries.push_back(*entry);
     }
-    //std::cerr << "DEBUG: Free blocks: " << *free_blocks << std::endl;
-
     return 0;
 }
-int FS::update_FAT(int* free_block, int block_amount){
-    // WARNING THIS IS COPYPASTED
-    if (disk.read(FAT_BLOCK, (uint8_t*) &fat) < 0 ) {
-        std::cerr << "Error: FAT encountered disk Error" << std::endl;
-        return -1;
+
+// rm -r <dirpath> removes the directory <dirpath> and all below it
+int FS::remove_tree(std::string dirpath){
+    TRACE(TRACE_REMOVE_TREE, dirpath);
+    DiskCommand command(disk);
+    dir_info target;
+    int status = FindingFileEntry(dirpath, OLD, target, WRITE);
+    if (status) return status;
+    dir_entry &entry = target.entries[target.index];
+    if (entry.type != TYPE_DIR){
+        return rm(dirpath);
+    }
+    if (strcmp(entry.file_name, PARENT_DIR.c_str()) == 0){
+        CONSOLE << "Error: " << PARENT_DIR << " can't be removed\n";
+        return FS_EBUSY;
     }
 
-	// link FAT
-	for (int i = 0; i < block_amount-1; i++){
-        // if no free blocks in FAT was reached (incase other function than get_free_blocks was used)
-        if (i >= BLOCK_SIZE/2) {
-            std::cerr << "Error: Disk is full" << std::endl;
-            return -1;
-        }
+    CONSOLE << "FS::remove_tree(" << dirpath << ")\n";
+    status = ReadFromFAT();
+    if (status) return status;
 
-		fat[free_block[i]] = free_block[i+1];
-	}
-	fat[free_block[block_amount-1]] = FAT_EOF;
+    ArenaScope scope(arena);
+    block_list dirs(arena);
+    block_list chains(arena);
+    status = walkTree(entry.first_blk, dirs, chains);
+    if (status) return status;
+    for (size_t i = 0; i < dirs.size(); i++){
+        if (dirs[i] == curr_blk){
+            CONSOLE << "Error: The working directory can't be removed\n";
+            return FS_EBUSY;
+        }
+    }
 
-	// FAT update
-	if (disk.write(FAT_BLOCK, (uint8_t*) &fat) != 0){
-		std::cerr << "Error: FAT encountered disk Error" << std::endl;
-		return -1;
-	}
-    //std::cerr << "DEBUG: No Error - Disk updated" << std::endl;
-	return 0;
+    for (size_t i = 0; i < chains.size(); i++){
+        releaseChain(chains[i]);
+    }
+    for (size_t i = 0; i < dirs.size(); i++){
+        fat[dirs[i]] = FAT_FREE;
+        disk.trim(dirs[i]);
+        // the files of the removed directories can't be used through a descriptor any more
+        dropHandles(dirs[i], -1);
+    }
+    memset(&entry, 0, sizeof(dir_entry));
+    status = disk.write_meta(target.block, (uint8_t*)target.entries);
+    if (status) return status;
+    return writeToFAT();
 }
-int FS::write_block(std::string text, int block_amount, int* free_blocks){
-    int status = update_FAT(free_blocks,block_amount);
-    if(status) return status;
-    char c_write[BLOCK_SIZE];
-    
-    for(int i = 0; i < block_amount -1; i++){
-        text.copy(c_write, BLOCK_SIZE, i*BLOCK_SIZE);
-        //std::cout << "DEBUG- text: " << text << std::endl;
 
-        if(disk.write(free_blocks[i], (uint8_t*) &c_write) != 0){
-            std::cerr << "Error: Couldnt write" << std::endl;
+// import-tree <hostdir> <fsdir> copies the directory <hostdir> of the host
+// and all below it to <fsdir>, or into <fsdir> if that is a directory
+int FS::import_tree(std::string hostdir, std::string fsdir){
+    TRACE(TRACE_IMPORT_TREE, hostdir, fsdir);
+    DiskCommand command(disk);
+    CONSOLE << "FS::import_tree(" << hostdir << ", " << fsdir << ")\n";
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int status = ReadFromFAT();
+    if (status) return status;
 
-        }
-        
+    // 1. the sizes of all files and the layout of every directory block
+    std::vector<import_node> nodes(1);
+    removeTrailingSlash(hostdir);
+    nodes[0].path = hostdir;
+    nodes[0].dir = true;
+    nodes[0].parent = -1;
+    status = scanHost(0, nodes);
+    if (status) return status;
+
+    int parent;
+    std::string name;
+    status = treeDestination(fsdir, getFileName(hostdir), parent, name);
+    if (status) return status;
+
+    // 2. the blocks: one per directory, and one run for the data of all files if the FAT has it
+    unsigned dir_count = 0;
+    unsigned data_blocks = 0;
+    for (size_t i = 0; i < nodes.size(); i++){
+        if (nodes[i].dir){
+            dir_count++;
+        }
+        else if (!nodes[i].inlined){
+            data_blocks += (nodes[i].size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        }
+    }
+    if (dir_count + data_blocks > countFreeBlocks()){
+        CONSOLE << "Error: The tree needs " << dir_count + data_blocks << " blocks, there are "
+                << countFreeBlocks() << " free blocks\n";
+        return FS_ENOSPC;
+    }
+    for (size_t i = 0; i < nodes.size(); i++){
+        if (nodes[i].dir){
+            nodes[i].block = findFreeBlock();
+            fat[nodes[i].block] = FAT_EOF;
+        }
+    }
+    int run = findFreeRun(data_blocks);
+    std::vector<unsigned> blocks;
+    for (size_t i = 0; i < nodes.size(); i++){
+        import_node &node = nodes[i];
+        if (node.dir || node.inlined){
+            continue;
+        }
+        unsigned length = (node.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        int file_run = run >= 0 ? run + (int)blocks.size() : findFreeRun(length);
+        int previous = -1;
+        for (unsigned j = 0; j < length; j++){
+            int block = file_run >= 0 ? file_run + (int)j : findFreeBlock();
+            if (previous == -1){
+                node.block = block;
+            }
+            else {
+                fat[previous] = block;
+            }
+            fat[block] = FAT_EOF;
+            blocks.push_back(block);
+            previous = block;
+        }
+    }
+
+    // 3. the data of all files, read from the host and written STREAM_BLOCKS blocks at a time
+    ArenaScope scope(arena);
+    uint8_t *data = arena.alloc<uint8_t>((size_t)STREAM_BLOCKS * BLOCK_SIZE);
+    size_t written = 0;
+    size_t filled = 0;
+    for (size_t i = 0; i < nodes.size(); i++){
+        if (nodes[i].dir || nodes[i].inlined){
+            continue;
+        }
+        for (uint32_t offset = 0; offset < nodes[i].size; ){
+            uint32_t length = std::min<uint32_t>(nodes[i].size - offset, (STREAM_BLOCKS - filled) * BLOCK_SIZE);
+            size_t length_blocks = (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            memset(&data[filled * BLOCK_SIZE], 0, length_blocks * BLOCK_SIZE);
+            status = readHost(nodes[i], offset, length, &data[filled * BLOCK_SIZE]);
+            if (status) return status;
+            offset += length;
+            filled += length_blocks;
+            if (filled == STREAM_BLOCKS || written + filled == blocks.size()){
+                std::vector<unsigned> batch(blocks.begin() + written, blocks.begin() + written + filled);
+                status = disk.write_many(batch, data);
+                if (status) return status;
+                written += filled;
+                filled = 0;
+            }
+        }
+    }
+
+    // 4. every directory block is built in memory and written once
+    unsigned files = 0;
+    for (size_t i = 0; i < nodes.size(); i++){
+        import_node &node = nodes[i];
+        if (!node.dir){
+            continue;
+        }
+        dir_entry entries[MAX_DIR_ENTRIES];
+        memset(entries, 0, sizeof(entries));
+        memcpy(entries[0].file_name, PARENT_DIR.c_str(), PARENT_DIR.length() + 1);
+        entries[0].first_blk = node.parent < 0 ? parent : nodes[node.parent].block;
+        entries[0].type = TYPE_DIR;
+        entries[0].access_rights = READ | WRITE | EXECUTE;
+        int free_slot = MAX_DIR_ENTRIES - 1;
+        for (size_t j = 0; j < node.children.size(); j++){
+            import_node &child = nodes[node.children[j]];
+            dir_entry &entry = entries[j + 1];
+            memcpy(entry.file_name, child.name.c_str(), child.name.length() + 1);
+            entry.size = child.dir ? 0 : child.size;
+            entry.first_blk = child.block;
+            entry.type = child.dir ? TYPE_DIR : TYPE_FILE;
+            entry.access_rights = child.dir ? READ | WRITE | EXECUTE : READ | WRITE;
+            if (child.dir){
+                continue;
+            }
+            files++;
+            if (child.inlined){
+                uint8_t content[INLINE_MAX];
+                status = readHost(child, 0, child.size, content);
+                if (status) return status;
+                entry.type |= TYPE_INLINE;
+                entry.first_blk = INLINE_END;
+                // the slots are taken from the end of the block, like writerInline does
+                int needed = (child.size + INLINE_DATA - 1) / INLINE_DATA;
+                for (int k = needed - 1; k >= 0; k--){
+                    inline_slot *slot = (inline_slot*)&entries[free_slot];
+                    slot->marker = INLINE_SLOT;
+                    slot->next = entry.first_blk;
+                    memcpy(slot->data, content + k * INLINE_DATA, std::min<uint32_t>(INLINE_DATA, child.size - k * INLINE_DATA));
+                    entry.first_blk = free_slot--;
+                }
+            }
+        }
+        status = disk.write_meta(node.block, (uint8_t*)entries);
+        if (status) return status;
+    }
+
+    dir_info destination;
+    destination.block = parent;
+    status = FileEntry(parent, name, destination.index, destination.entries, NEW, 0);
+    if (status) return status;
+    dir_entry &entry = destination.entries[destination.index];
+    memcpy(entry.file_name, name.c_str(), name.length() + 1);
+    entry.size = 0;
+    entry.first_blk = nodes[0].block;
+    entry.type = TYPE_DIR;
+    entry.access_rights = READ | WRITE | EXECUTE;
+    status = disk.write_meta(destination.block, (uint8_t*)destination.entries);
+    if (status) return status;
+    status = writeToFAT();
+    if (status) return status;
+
+    double ms = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() * 1000;
+    CONSOLE << files << " files, " << dir_count << " directories, " << dir_count + data_blocks << " blocks, " << ms << " ms" << std::endl;
+    return 0;
+}
+
+// adds the entries of the host directory of 'node' to the tree, and the
+// entries of its sub-directories. A small file is inlined if the slots fit.
+int FS::scanHost(int node, std::vector<import_node> &nodes){
+    std::string path = nodes[node].path;
+    DIR *dir = ::opendir(path.c_str());
+    if (dir == nullptr){
+        CONSOLE << "Error: Can't open the directory " << path << " on the host\n";
+        return FS_EIO;
+    }
+    std::vector<std::string> names;
+    struct dirent *item;
+    while ((item = ::readdir(dir)) != nullptr){
+        std::string name = item->d_name;
+        if (name != "." && name != ".."){
+            names.push_back(name);
+        }
+    }
+    ::closedir(dir);
+    std::sort(names.begin(), names.end());
+
+    for (size_t i = 0; i < names.size(); i++){
+        import_node child;
+        child.path = path + "/" + names[i];
+        child.name = names[i];
+        child.parent = node;
+        child.size = 0;
+        child.inlined = false;
+        child.block = -1;
+        struct stat st;
+        if (::stat(child.path.c_str(), &st) != 0 || !(S_ISDIR(st.st_mode) || S_ISREG(st.st_mode))){
+            CONSOLE << "Skipping " << child.path << ", not a file or a directory\n";
+            continue;
+        }
+        if (child.name.length() > 55){
+            CONSOLE << "Error: Name can't be longer than 55: " << child.path << "\n";
+            return FS_ENAME;
+        }
+        child.dir = S_ISDIR(st.st_mode);
+        if (!child.dir && st.st_size > 0){
+            // a last line without a newline still gets its NUL
+            child.size = st.st_size;
+            int fd = ::open(child.path.c_str(), O_RDONLY);
+            char last = '\n';
+            if (fd < 0 || pread(fd, &last, 1, st.st_size - 1) != 1){
+                CONSOLE << "Error: Can't read " << child.path << " on the host\n";
+                if (fd >= 0) ::close(fd);
+                return FS_EIO;
+            }
+            ::close(fd);
+            if (last != '\n'){
+                child.size++;
+            }
+            if ((uint64_t)st.st_size + 1 > (uint64_t)(BLOCK_SIZE / 2) * BLOCK_SIZE){
+                CONSOLE << "Error: " << child.path << " is larger than the disk\n";
+                return FS_EFBIG;
+            }
+        }
+        nodes[node].children.push_back(nodes.size());
+        nodes.push_back(child);
+    }
+    // entry 0 is the parent entry
+    if (nodes[node].children.size() > MAX_DIR_ENTRIES - 1){
+        CONSOLE << "Error: " << path << " has more than " << MAX_DIR_ENTRIES - 1 << " entries\n";
+        return FS_EDIRFULL;
+    }
+    // the entries left over hold small files
+    int free_slots = MAX_DIR_ENTRIES - 1 - nodes[node].children.size();
+    for (size_t i = 0; i < nodes[node].children.size(); i++){
+        import_node &child = nodes[nodes[node].children[i]];
+        int needed = (child.size + INLINE_DATA - 1) / INLINE_DATA;
+        if (!child.dir && child.size <= INLINE_MAX && needed <= free_slots){
+            child.inlined = true;
+            free_slots -= needed;
+        }
+    }
+    std::vector<int> children = nodes[node].children;
+    for (size_t i = 0; i < children.size(); i++){
+        if (nodes[children[i]].dir){
+            int status = scanHost(children[i], nodes);
+            if (status) return status;
+        }
+    }
+    return 0;
+}
+
+// reads 'length' bytes of a host file from 'offset' to 'data': every newline
+// becomes the NUL that ends a line
+int FS::readHost(import_node &node, uint32_t offset, uint32_t length, uint8_t *data){
+    int fd = ::open(node.path.c_str(), O_RDONLY);
+    if (fd < 0){
+        CONSOLE << "Error: Can't read " << node.path << " on the host\n";
+        return FS_EIO;
+    }
+    uint32_t done = 0;
+    while (done < length){
+        ssize_t n = ::pread(fd, data + done, length - done, offset + done);
+        if (n <= 0){
+            break;
+        }
+        done += n;
+    }
+    ::close(fd);
+    if (done + 1 == length && offset + length == node.size){
+        // the NUL of a last line without a newline
+        data[done++] = 0;
+    }
+    if (done != length){
+        CONSOLE << "Error: " << node.path << " changed on the host while it was imported\n";
+        return FS_EIO;
+    }
+    for (uint8_t *p = data, *end = data + done; p < end; p++){
+        p += scan_byte(p, end - p, '\n');
+        if (p < end){
+            *p = 0;
+        }
+    }
+    return 0;
+}
+
+// export-tree <fsdir> <hostdir> copies the directory <fsdir> and all below
+// it to the new directory <hostdir> of the host
+int FS::export_tree(std::string fsdir, std::string hostdir){
+    TRACE(TRACE_EXPORT_TREE, fsdir, hostdir);
+    DiskCommand command(disk);
+    CONSOLE << "FS::export_tree(" << fsdir << ", " << hostdir << ")\n";
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int dir_block = ROOT_BLOCK;
+    if (!fsdir.empty() && fsdir[0] == SNAPSHOT_PREFIX){
+        dir_entry entry;
+        int status = snapshotEntry(fsdir, entry);
+        if (status) return status;
+        if ((entry.type & TYPE_MASK) != TYPE_DIR){
+            CONSOLE << "Error: Filepath is not a directory: " << fsdir << "\n";
+            return FS_ENOTDIR;
+        }
+        dir_block = entry.first_blk;
+    }
+    else if (fsdir != "/"){
+        dir_info dir;
+        int status = FindingFileEntry(fsdir, OLD, dir, READ);
+        if (status) return status;
+        if (dir.entries[dir.index].type != TYPE_DIR){
+            CONSOLE << "Error: Filepath is not a directory: " << fsdir << "\n";
+            return FS_ENOTDIR;
+        }
+        dir_block = dir.entries[dir.index].first_blk;
+    }
+    if (::mkdir(hostdir.c_str(), 0755) != 0){
+        CONSOLE << "Error: Can't create the directory " << hostdir << " on the host\n";
+        return FS_EIO;
+    }
+    unsigned files = 0;
+    unsigned dirs = 1;
+    int status = exportDir(dir_block, hostdir, files, dirs);
+    if (status) return status;
+    double ms = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() * 1000;
+    CONSOLE << files << " files, " << dirs << " directories, " << ms << " ms" << std::endl;
+    return 0;
+}
+
+// writes the files and sub-directories of the directory in 'dir_block' to
+// 'path' on the host, every NUL that ends a line becomes a newline
+int FS::exportDir(int dir_block, std::string path, unsigned &files, unsigned &dirs){
+    ArenaScope scope(arena);
+    dir_entry *entries = arena.alloc<dir_entry>(MAX_DIR_ENTRIES);
+    int status = disk.read(dir_block, (uint8_t*)entries);
+    if (status) return status;
+    for (unsigned i = 0; i < MAX_DIR_ENTRIES; i++){
+        dir_entry &entry = entries[i];
+        if (entry.file_name[0] == 0 || entry.file_name[0] == INLINE_SLOT || strcmp(entry.file_name, PARENT_DIR.c_str()) == 0){
+            continue;
+        }
+        std::string host_path = path + "/" + entry.file_name;
+        if (entry.type == TYPE_DIR){
+            if (::mkdir(host_path.c_str(), 0755) != 0){
+                CONSOLE << "Error: Can't create the directory " << host_path << " on the host\n";
+                return FS_EIO;
+            }
+            dirs++;
+            status = exportDir(entry.first_blk, host_path, files, dirs);
+            if (status) return status;
+            continue;
+        }
+        if (!(entry.access_rights & READ)){
+            CONSOLE << "Skipping " << host_path << ", no read access\n";
+            continue;
+        }
+        // the file is read and written STREAM_BLOCKS blocks at a time
+        int fd = ::open(host_path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (fd < 0){
+            CONSOLE << "Error: Can't write " << host_path << " on the host\n";
+            return FS_EIO;
+        }
+        ArenaScope file_scope(arena);
+        char *content = arena.alloc<char>((size_t)STREAM_BLOCKS * BLOCK_SIZE);
+        chain_reader reader;
+        status = readerInit(reader, entry, entries);
+        for (uint32_t offset = 0; status == 0 && offset < entry.size; ){
+            uint32_t length = std::min<uint32_t>(entry.size - offset, STREAM_BLOCKS * BLOCK_SIZE);
+            for (uint32_t done = 0; status == 0 && done < length; done += BLOCK_SIZE){
+                status = readerNext(reader, &content[done]);
+            }
+            if (status) break;
+            for (char *p = content, *end = content + length; p < end; p++){
+                p += scan_byte(p, end - p, 0);
+                if (p < end){
+                    *p = '\n';
+                }
+            }
+            if (::write(fd, content, length) != (ssize_t)length){
+                CONSOLE << "Error: Can't write " << host_path << " on the host\n";
+                status = FS_EIO;
+            }
+            offset += length;
+        }
+        if (status){
+            ::close(fd);
+            return status;
+        }
+        ::close(fd);
+        files++;
     }
-    //Write the last block
-    text.copy(c_write,text.length()%BLOCK_SIZE,(block_amount-1)*BLOCK_SIZE);
-    c_write[text.length()%BLOCK_SIZE] = '\0';
-    disk.write(free_blocks[block_amount-1],(uint8_t*) &c_write);
-    //std::cout << "DEBUG- c_write: " << c_write << std::endl;
     return 0;
 }
+
 // append <filepath1> <filepath2> appends the contents of file <filepath1> to
 // the end of file <filepath2>. The file <filepath1> is unchanged.
 int FS::append(std::string sourcepath, std::string destinationpath){
+    TRACE(TRACE_APPEND, sourcepath, destinationpath);
+    DiskCommand command(disk);
     int status = ReadFromFAT();
     if(status) return status;
 
-    std::cout << "FS::append(" << sourcepath << "," << destinationpath << ")\n";
-    std::string temp_append_text;
-    
-
-    get_file_string(sourcepath,temp_append_text);
-    
-    std::string append_text = "\n" + temp_append_text;
+    CONSOLE << "FS::append(" << sourcepath << "," << destinationpath << ")\n";
     
     //Find first block of paths
     dir_info source;
@@ -1026,69 +1626,380 @@ int FS::append(std::string sourcepath, std::string destinationpath){
     
     status = FindingFileEntry(destinationpath, OLD, destination, WRITE);
     if(status) return status;
-    
 
     if (!(source.entries[source.index].access_rights & READ)) {
-        std::cout << "Error: You do not have access rights to read from source! :(\n";
+        CONSOLE << "Error: You do not have access rights to read from source! :(\n";
         return 0;
     }
     if (!(destination.entries[destination.index].access_rights & WRITE)) {
-        std::cout << "Error: You do not have access rights to write to destination! :(\n";
+        CONSOLE << "Error: You do not have access rights to write to destination! :(\n";
         return 0;
     }
-    int source_block = source.entries[source.index].first_blk;
-    int destination_block = destination.entries[destination.index].first_blk;
-    int source_size = source.entries[source.index].size;
-    int destination_size = destination.entries[destination.index].size;
-    int tot_size = destination_size + source_size;
-
-    //We need the latest fat from disk
-
-    if(disk.read(FAT_BLOCK,(uint8_t*) &fat)< 0){
-        return -1;
+    if(destination.entries[destination.index].type & TYPE_COMPRESSED){
+        // the last block is modified in place, which needs the content as it is
+        status = inflateFile(destination);
+        if(status) return status;
     }
-    while(fat[destination_block] != FAT_EOF){
-        destination_block = fat[destination_block];
+    dir_entry &dest = destination.entries[destination.index];
+    dir_entry src = source.entries[source.index];
+    bool same_file = source.block == destination.block && source.index == destination.index;
+    if(same_file){
+        src = dest;
     }
 
-    char text_buffer[BLOCK_SIZE];
-    if(disk.read(destination_block,(uint8_t*) &text_buffer)<0){
-        return -1;
-    }
-    append_text = text_buffer + append_text;
-    //Calculation of how many blocks file will be
-    int block_amount = ceil((append_text.length()+1) / (float) BLOCK_SIZE);
-    if(block_amount < 0){
-        return -1;
+    chain_reader reader;
+    status = readerInit(reader, src, same_file ? destination.entries : source.entries);
+    if(status) return status;
+    // a file appended to itself is read from the blocks it had before, which
+    // writerOpen keeps until the file is finished
+    ArenaScope scope(arena);
+    block_list own_blocks{ArenaAllocator<int>(arena)};
+    if(same_file && !(src.type & TYPE_INLINE)){
+        status = getChain(src.first_blk, own_blocks);
+        if(status) return status;
     }
-    destination.entries[destination.index].size = tot_size;
 
+    // the content of the source is written after the last byte of the destination
+    chain_writer writer;
+    if(dest.type & TYPE_INLINE){
+        // a small file is written again as a whole, inline if it still fits
+        uint8_t content[INLINE_MAX];
+        status = readInline(destination.entries, dest, content);
+        if(status) return status;
+        freeInline(destination.entries, dest);
+        writerInit(writer, false);
+        status = writerPut(writer, (char*)content, dest.size);
+    }
+    else{
+        status = writerOpen(writer, dest);
+    }
+    if(status) return status;
+    char data[BLOCK_SIZE];
+    for(uint32_t tot_size = 0, i = 0; tot_size < src.size; tot_size += BLOCK_SIZE, i++){
+        if(own_blocks.empty()){
+            status = readerNext(reader, data);
+        }
+        else{
+            status = i < own_blocks.size() ? readBlock(own_blocks[i], (uint8_t*)data) : FS_ECORRUPT;
+        }
+        if(status == 0){
+            status = writerPut(writer, data, std::min<uint32_t>(BLOCK_SIZE, src.size - tot_size));
+        }
+        if(status) return status;
+    }
+    status = writerStore(writer, destination);
+    if(status) return status;
 
-    int free_blocks[block_amount+1];
-
-    free_blocks[0] = destination_block;
-    
-    status = (get_free_blocks(free_blocks,block_amount-1,1));    
+    status = disk.write_meta(destination.block, (uint8_t*)destination.entries);
     if(status){
         return status;
     }
-    
-    status = write_block(append_text,block_amount,free_blocks);
+    status = writeToFAT();
     if(status){
         return status;
     }
+    return 0;
 
-    status = disk.write(destination.block, (uint8_t*)destination.entries);
-    if(status){
-        return status;
+}
+
+// write <filepath> <offset> <data> writes 'length' bytes at 'offset' in the
+// file. Only the blocks in the range are read and written, a file that is
+// shorter than 'offset' is first extended with zeroes.
+int FS::write(std::string filepath, uint32_t offset, const char *data, uint32_t length){
+    TRACE(TRACE_WRITE, filepath, offset, length);
+    DiskCommand command(disk);
+    CONSOLE << "FS::write(" << filepath << "," << offset << ")\n";
+    int status = ReadFromFAT();
+    if (status) return status;
+
+    dir_info dir;
+    status = FindingFileEntry(filepath, OLD, dir, WRITE);
+    if (status) return status;
+    dir_entry &entry = dir.entries[dir.index];
+    if ((entry.type & TYPE_MASK) == TYPE_DIR){
+        CONSOLE << "Error: '" << filepath << "' is a directory\n";
+        return FS_EISDIR;
     }
-    status = writeToFAT();
-    if(status){
+    if ((uint64_t)offset + length > disk.get_disk_size()){
+        CONSOLE << "Error: The file would be larger than the disk\n";
+        return FS_EFBIG;
+    }
+    return writeRange(dir, offset, data, length, std::max(entry.size, offset + length));
+}
+
+// truncate <filepath> <length> cuts the file to 'length' bytes, or extends it
+// with zeroes. The blocks after the new end are given back.
+int FS::truncate(std::string filepath, uint32_t length){
+    TRACE(TRACE_TRUNCATE, filepath, length);
+    DiskCommand command(disk);
+    CONSOLE << "FS::truncate(" << filepath << "," << length << ")\n";
+    int status = ReadFromFAT();
+    if (status) return status;
+
+    dir_info dir;
+    status = FindingFileEntry(filepath, OLD, dir, WRITE);
+    if (status) return status;
+    dir_entry &entry = dir.entries[dir.index];
+    if ((entry.type & TYPE_MASK) == TYPE_DIR){
+        CONSOLE << "Error: '" << filepath << "' is a directory\n";
+        return FS_EISDIR;
+    }
+    if (length > disk.get_disk_size()){
+        CONSOLE << "Error: The file would be larger than the disk\n";
+        return FS_EFBIG;
+    }
+    if (length >= entry.size || (entry.type & TYPE_INLINE)){
+        return writeRange(dir, std::min(entry.size, length), nullptr, length > entry.size ? length - entry.size : 0, length);
+    }
+    if (entry.type & TYPE_COMPRESSED){
+        status = inflateFile(dir);
+        if (status) return status;
+    }
+
+    // a file keeps at least one block
+    unsigned last_index = length ? (length - 1) / BLOCK_SIZE : 0;
+    status = unshareChain(entry, last_index);
+    if (status) return status;
+    int block = entry.first_blk;
+    for (unsigned i = 0; i < last_index; i++){
+        block = fat[block];
+    }
+    releaseChain(fat[block]);
+    fat[block] = FAT_EOF;
+    if (length % BLOCK_SIZE){
+        // the bytes after the new end are cleared, so that a file that grows again reads zeroes
+        uint8_t data[BLOCK_SIZE];
+        status = disk.read(block, data);
+        if (status) return status;
+        memset(&data[length % BLOCK_SIZE], 0, BLOCK_SIZE - length % BLOCK_SIZE);
+        forgetBlock(block);
+        status = disk.write(block, data);
+        if (status) return status;
+    }
+    entry.size = length;
+    status = disk.write_meta(dir.block, (uint8_t*)dir.entries);
+    if (status) return status;
+    return writeToFAT();
+}
+// open <filepath> [r|w|rw] resolves the path once and returns a descriptor
+int FS::open(std::string filepath, uint8_t mode){
+    TRACE(TRACE_OPEN, filepath, mode);
+    DiskCommand command(disk);
+    CONSOLE << "FS::open(" << filepath << ")\n";
+    int status = ReadFromFAT();
+    if (status) return status;
+
+    dir_info dir;
+    status = FindingFileEntry(filepath, OLD, dir, mode);
+    if (status) return status;
+    dir_entry &entry = dir.entries[dir.index];
+    if ((entry.type & TYPE_MASK) == TYPE_DIR){
+        CONSOLE << "Error: '" << filepath << "' is a directory\n";
+        return FS_EISDIR;
+    }
+    for (int fd = 0; fd < MAX_OPEN_FILES; fd++){
+        open_file &handle = handles[fd];
+        if (handle.used){
+            continue;
+        }
+        handle.used = true;
+        handle.stale = false;
+        handle.name = entry.file_name;
+        handle.dir_block = dir.block;
+        handle.index = dir.index;
+        handle.mode = mode;
+        handle.pos = 0;
+        handle.blocks.clear();
+        handle.frames.clear();
+        // the block map is built on the first read or write
+        handle.stamp = fat_stamp - 1;
+        traced.record.num[1] = fd;
+        return fd;
+    }
+    CONSOLE << "Error: Too many open files\n";
+    return FS_EMFILE;
+}
+
+// close <fd> gives the descriptor back
+int FS::close(int fd){
+    TRACE(TRACE_CLOSE, fd);
+    DiskCommand command(disk);
+    CONSOLE << "FS::close(" << fd << ")\n";
+    if (fd < 0 || fd >= MAX_OPEN_FILES || !handles[fd].used){
+        CONSOLE << "Error: Bad file descriptor " << fd << "\n";
+        return FS_EBADF;
+    }
+    handles[fd].used = false;
+    handles[fd].blocks.clear();
+    handles[fd].frames.clear();
+    return 0;
+}
+
+// reads up to 'length' bytes at the offset of the descriptor
+int FS::read(int fd, char *data, uint32_t length){
+    TRACE(TRACE_READ, fd, length);
+    DiskCommand command(disk);
+    int status = ReadFromFAT();
+    if (status) return status;
+    dir_info dir;
+    status = handleEntry(fd, dir);
+    if (status) return status;
+    open_file &handle = handles[fd];
+    dir_entry &entry = dir.entries[dir.index];
+    if (!(handle.mode & READ)){
+        CONSOLE << "Error: File descriptor " << fd << " is not open for reading\n";
+        return FS_EBADF;
+    }
+    // the access rights may have changed since the file was opened
+    if (!(entry.access_rights & READ)){
+        CONSOLE << "Error: You do not have access rights to read " << handle.name << "\n";
+        return FS_EACCES;
+    }
+    if (handle.pos >= entry.size){
+        return 0;
+    }
+    uint32_t n = std::min(length, entry.size - handle.pos);
+
+    if (entry.type & TYPE_INLINE){
+        uint8_t content[INLINE_MAX];
+        status = readInline(dir.entries, entry, content);
+        if (status) return status;
+        memcpy(data, &content[handle.pos], n);
+    }
+    else if (entry.type & TYPE_COMPRESSED){
+        // the reader starts at the frame that holds the offset
+        unsigned frame = handle.pos / BLOCK_SIZE;
+        uint32_t start;
+        status = frameStart(handle, frame, start);
+        if (status) return status;
+        chain_reader reader;
+        char chunk[BLOCK_SIZE];
+        status = readerInit(reader, entry, dir.entries);
+        if (status) return status;
+        status = readBlock(handle.blocks[start / BLOCK_SIZE], reader.data);
+        if (status) return status;
+        reader.block = fat[handle.blocks[start / BLOCK_SIZE]];
+        reader.pos = start % BLOCK_SIZE;
+        reader.remaining = entry.size - frame * BLOCK_SIZE;
+        uint32_t done = 0;
+        for (uint32_t chunk_start = frame * BLOCK_SIZE; done < n; chunk_start += BLOCK_SIZE){
+            status = readerNext(reader, chunk);
+            if (status) return status;
+            uint32_t from = std::max(chunk_start, handle.pos + done);
+            uint32_t to = std::min(chunk_start + BLOCK_SIZE, handle.pos + n);
+            if (from < to){
+                memcpy(&data[from - handle.pos], &chunk[from - chunk_start], to - from);
+                done += to - from;
+            }
+        }
+    }
+    else {
+        uint8_t block_data[BLOCK_SIZE];
+        uint32_t done = 0;
+        while (done < n){
+            uint32_t pos = handle.pos + done;
+            unsigned i = pos / BLOCK_SIZE;
+            if (i >= handle.blocks.size()){
+                CONSOLE << "Error: The chain is shorter than the file\n";
+                return FS_ECORRUPT;
+            }
+            status = readBlock(handle.blocks[i], block_data);
+            if (status) return status;
+            uint32_t count = std::min<uint32_t>(BLOCK_SIZE - pos % BLOCK_SIZE, n - done);
+            memcpy(&data[done], &block_data[pos % BLOCK_SIZE], count);
+            done += count;
+        }
+    }
+    handle.pos += n;
+    return n;
+}
+
+// writes 'length' bytes at the offset of the descriptor
+int FS::write(int fd, const char *data, uint32_t length){
+    TRACE(TRACE_FWRITE, fd, length);
+    DiskCommand command(disk);
+    int status = ReadFromFAT();
+    if (status) return status;
+    dir_info dir;
+    status = handleEntry(fd, dir);
+    if (status) return status;
+    open_file &handle = handles[fd];
+    dir_entry &entry = dir.entries[dir.index];
+    if (!(handle.mode & WRITE)){
+        CONSOLE << "Error: File descriptor " << fd << " is not open for writing\n";
+        return FS_EBADF;
+    }
+    if (!(entry.access_rights & WRITE)){
+        CONSOLE << "Error: You do not have access rights to write " << handle.name << "\n";
+        return FS_EACCES;
+    }
+    if ((uint64_t)handle.pos + length > disk.get_disk_size()){
+        CONSOLE << "Error: The file would be larger than the disk\n";
+        return FS_EFBIG;
+    }
+    status = writeRange(dir, handle.pos, data, length, std::max(entry.size, handle.pos + length), &handle.blocks);
+    if (status){
+        // the map may hold blocks that were never committed
+        handle.stamp = fat_stamp - 1;
         return status;
     }
+    handle.stamp = fat_stamp;
+    handle.pos += length;
+    return length;
+}
+
+// seek <fd> <offset> sets the offset of the next read or write, which may be
+// after the end of the file: a write there fills the gap with zeroes
+int FS::seek(int fd, uint32_t offset){
+    TRACE(TRACE_SEEK, fd, offset);
+    if (fd < 0 || fd >= MAX_OPEN_FILES || !handles[fd].used){
+        CONSOLE << "Error: Bad file descriptor " << fd << "\n";
+        return FS_EBADF;
+    }
+    handles[fd].pos = offset;
+    return offset;
+}
+
+// reads the directory block of an open file and checks that the entry is
+// still the same file. The block map is built again if the FAT has changed.
+int FS::handleEntry(int fd, dir_info &dir){
+    if (fd < 0 || fd >= MAX_OPEN_FILES || !handles[fd].used){
+        CONSOLE << "Error: Bad file descriptor " << fd << "\n";
+        return FS_EBADF;
+    }
+    open_file &handle = handles[fd];
+    dir.block = handle.dir_block;
+    dir.index = handle.index;
+    int status = disk.read(dir.block, (uint8_t*)dir.entries);
+    if (status) return status;
+    dir_entry &entry = dir.entries[dir.index];
+    if (handle.stale || handle.name != entry.file_name || (entry.type & TYPE_MASK) != TYPE_FILE){
+        CONSOLE << "Error: The file of descriptor " << fd << " was removed or renamed\n";
+        return FS_ESTALE;
+    }
+    if (handle.stamp != fat_stamp){
+        handle.blocks.clear();
+        handle.frames.clear();
+        if (!(entry.type & TYPE_INLINE)){
+            status = getChain(entry.first_blk, handle.blocks);
+            if (status) return status;
+        }
+        handle.stamp = fat_stamp;
+    }
     return 0;
+}
 
+void FS::dropHandles(int dir_block, int index){
+    for (int fd = 0; fd < MAX_OPEN_FILES; fd++){
+        open_file &handle = handles[fd];
+        if (handle.used && handle.dir_block == dir_block && (index == -1 || handle.index == index)){
+            handle.stale = true;
+            handle.blocks.clear();
+            handle.frames.clear();
+        }
+    }
 }
+
 int FS::get_dir_name(std::string path, std::string &last_dir, std::string &absolute_path){
     //We should extract the path name here
     size_t pos = path.find_last_of("/\\");
@@ -1189,7 +2100,7 @@ int FS::path_handler(std::string &test, bool &is_absolute_path, std::string &dir
         return 0;    
         }
     }
-    return 1;
+    return FS_EINVAL;
 
 }
 int FS::dotdot_remover(std::string &dirpath){
@@ -1218,8 +2129,10 @@ int FS::dotdot_remover(std::string &dirpath){
 
 int FS::mkdir(std::string dirpath)
 {
+    TRACE(TRACE_MKDIR, dirpath);
+    DiskCommand command(disk);
 
-    std::cout << "FS::mkdir(" << dirpath << ")\n";
+    CONSOLE << "FS::mkdir(" << dirpath << ")\n";
     int status = ReadFromFAT();
     dir_info dir;
 
@@ -1227,19 +2140,19 @@ int FS::mkdir(std::string dirpath)
     bool is_absolute_path = false;
     status = dotdot_remover(dirpath);
     if(status){
-        std::cerr << "Error: mkdir " << dirpath << " went bad" << std::endl;
+        CONSOLE << "Error: mkdir " << dirpath << " went bad" << std::endl;
         return status;
     }
     status = path_handler(test, is_absolute_path, dirpath);
     if(status){
-        std::cerr << "Error: mkdir " << dirpath << " went bad" << std::endl;
+        CONSOLE << "Error: mkdir " << dirpath << " went bad" << std::endl;
         return status;
     }
     //check if the desitnation file already exists
     dir_info cwd;
 
     if(dirpath == PARENT_DIR){
-        std::cerr << "Error:" << PARENT_DIR << " is for the parent dir" << std::endl;
+        CONSOLE << "Error:" << PARENT_DIR << " is for the parent dir" << std::endl;
     }
     
     if(status){
@@ -1283,20 +2196,24 @@ int FS::mkdir(std::string dirpath)
     }
     
     if(checker == -2){
-        std::cout << "Error: The file or directory already exist!" << std::endl;
-        return 1;
+        CONSOLE << "Error: The file or directory already exist!" << std::endl;
+        return FS_EEXIST;
     }
     if(status){
         return status;
     }
     int free_block = findFreeBlock();
+    if(free_block < 0){
+        CONSOLE << "Error: There isn't anymore free blocks in FAT" << std::endl;
+        return FS_ENOSPC;
+    }
     fat[free_block] = FAT_EOF;
     memcpy(dir.entries[dir.index].file_name, dirpath.c_str(), dirpath.length() + 1);
     dir.entries[dir.index].first_blk = free_block;
     dir.entries[dir.index].size = 0;
     dir.entries[dir.index].type = TYPE_DIR;
     dir.entries[dir.index].access_rights = READ | WRITE | EXECUTE;
-    status = disk.write(dir.block, (uint8_t*)dir.entries);
+    status = disk.write_meta(dir.block, (uint8_t*)dir.entries);
     if(status){
         return status;
     }
@@ -1308,7 +2225,7 @@ int FS::mkdir(std::string dirpath)
     dir.entries[dir.index].type = TYPE_DIR;
     dir.entries[dir.index].access_rights = READ | WRITE | EXECUTE;
 
-    status = disk.write(free_block, (uint8_t*)dir.entries);
+    status = disk.write_meta(free_block, (uint8_t*)dir.entries);
     if(status){
         return status;
     }
@@ -1320,6 +2237,8 @@ int FS::mkdir(std::string dirpath)
 }
 
 int FS::cd(std::string dirpath) {
+    TRACE(TRACE_CD, dirpath);
+    DiskCommand command(disk);
     if (dirpath == "/" || dirpath == PARENT_DIR) {
         goHome();
         return 0;
@@ -1331,13 +2250,13 @@ int FS::cd(std::string dirpath) {
 
     status = FindingFileEntry(dirpath, OLD, dir, READ);
     if (status != 0) {
-        std::cout << ("Error: '" + dirpath + "' is not a directory") << std::endl;
+        CONSOLE << ("Error: '" + dirpath + "' is not a directory") << std::endl;
         return status;
     }
 
     if (dir.entries[dir.index].type != TYPE_DIR) {
-        std::cout << ("Error: '" + dirpath + "' is not a directory") << std::endl;
-        return -1;
+        CONSOLE << ("Error: '" + dirpath + "' is not a directory") << std::endl;
+        return FS_ENOTDIR;
     }
     if(dirpath.front() == '/'){
         dirpath = dirpath.substr(1,dirpath.length());
@@ -1350,8 +2269,8 @@ int FS::cd(std::string dirpath) {
 
         status = FindingFileEntry(cwd,OLD,test_dir,READ);
         if(status){
-            std::cout << ("Error: '" + cwd + "' is not a directory") << std::endl;
-            return -1;
+            CONSOLE << ("Error: '" + cwd + "' is not a directory") << std::endl;
+            return FS_ENOTDIR;
         }
 
     }
@@ -1376,9 +2295,14 @@ void FS::removeTrailingSlash(std::string& str) {
 //  pwd prints the full path, i.e., from the root directory, to the current
 //  directory, including the currect directory name
 int FS::pwd(){
-    std::cout << "FS::pwd()\n";
-    std::cout << working_directory << std::endl;
+    CONSOLE << "FS::pwd()\n";
+    CONSOLE << working_directory << std::endl;
+
+    return 0;
+}
 
+int FS::pwd(std::string &path){
+    path = working_directory;
     return 0;
 }
 
@@ -1387,7 +2311,8 @@ int FS::pwd(){
 int
 FS::chmod(std::string accessrights, std::string filepath)
 {
-        
+    TRACE(TRACE_CHMOD, accessrights, filepath);
+    DiskCommand command(disk);
     dir_info dir;
     int status = ReadFromFAT();
     if (status){
@@ -1395,19 +2320,19 @@ FS::chmod(std::string accessrights, std::string filepath)
     }
     status = FindingFileEntry(filepath, OLD, dir, 0);
     if(status){
-        std::cout << "Error: That doesn't exist" << std::endl;
-
+        CONSOLE << "Error: That doesn't exist" << std::endl;
+        return status;
     }
     std::string pathname;
     std::string absolute_path;
     get_dir_name(filepath,pathname, absolute_path);
     if(pathname == PARENT_DIR){ 
-        std::cout << "Error: You can't modify the parent directory of " << PARENT_DIR << std::endl;
-        return 1;
+        CONSOLE << "Error: You can't modify the parent directory of " << PARENT_DIR << std::endl;
+        return FS_EBUSY;
     }
     uint8_t accessInt = std::stoi(accessrights);
     dir.entries[dir.index].access_rights = accessInt;
-    status = disk.write(dir.block, (uint8_t*)dir.entries);
+    status = disk.write_meta(dir.block, (uint8_t*)dir.entries);
     if (status){
         return status;
     }
@@ -1416,11 +2341,1652 @@ FS::chmod(std::string accessrights, std::string filepath)
     return 0;
 
 }
-//----------------- OWN FUNCTIONS -----------------
+// sync makes everything written so far durable, whatever the durability policy
+int FS::sync(){
+    TRACE(TRACE_SYNC);
+    DiskCommand command(disk);
+    CONSOLE << "FS::sync()\n";
+    if (has_super) {
+        int status = writeSuper(false);
+        if (status) return status;
+    }
+    return disk.sync();
+}
 
-int FS::writeToFAT(){
-    //writes to FAT
-    int status = disk.write(FAT_BLOCK, (uint8_t*)fat);
+// the number of blocks of the disk and how many of them are free
+void FS::usage(unsigned &blocks, unsigned &free){
+    ReadFromFAT();
+    blocks = disk.get_no_blocks();
+    free = countFreeBlocks();
+}
+
+// df prints the size of the disk, the number of free blocks, the generation
+// and the space the disk file takes on the host
+int FS::df(){
+    CONSOLE << "FS::df()\n";
+    if (!has_super) {
+        CONSOLE << "Error: The disk has no superblock, format it first\n";
+        return FS_ENOFS;
+    }
+    CONSOLE << "Blocks \t Free \t Block size \t Generation \t Host KiB " << std::endl;
+    CONSOLE << super.no_blocks << "\t " << super.free_blocks << "\t " << super.block_size << "\t\t " << super.generation
+            << "\t\t " << disk.host_bytes() / 1024 << std::endl;
+    return 0;
+}
+
+// durability <block|command|group> [ms] [blocks] selects when written blocks are
+// forced to stable storage: after every block, after every command, or grouped
+// over several commands and committed every <ms> milliseconds or <blocks> blocks
+int FS::set_durability(int policy, unsigned group_ms, unsigned group_blocks){
+    CONSOLE << "FS::set_durability(" << policy << ")\n";
+    return disk.set_policy(policy, group_ms, group_blocks);
+}
+
+// fsck [-r] checks the FAT against the directory tree, with -r orphan blocks
+// are reclaimed and broken chains and sizes are repaired
+int FS::fsck(bool repair){
+    fsck_report report;
+    int status = fsck(repair, report);
+    if (status) return status;
+    if (console) fsck_print(report, *console);
+    return 0;
+}
+
+// the same check, the findings are left in 'report'
+int FS::fsck(bool repair, fsck_report &report){
+    TRACE(TRACE_FSCK, repair);
+    DiskCommand command(disk);
+    CONSOLE << "FS::fsck(" << (repair ? "-r" : "") << ")\n";
+    if (!has_super) {
+        CONSOLE << "Error: The disk has no superblock, format it first\n";
+        return FS_ENOFS;
+    }
+    int status = ReadFromFAT();
+    if (status) return status;
+
+    status = fsck_check(disk, fat, super.refcount, repair, report, 0, snapshotRoots());
+    if (status) return status;
+    if (repair && report.repaired > 0) {
+        refcounts_changed = true;
+        status = writeToFAT();
+        if (status) return status;
+        if (dedup) {
+            // blocks may have been freed or cut from their chains
+            status = set_dedup(true);
+            if (status) return status;
+        }
+    }
+    return 0;
+}
+
+// defrag [-n] moves every fragmented file to a contiguous run of blocks and
+// reports the fragmentation per file and for the disk, -n only reports
+int FS::defrag(bool dry_run){
+    defrag_stats stats;
+    return defrag(dry_run, stats);
+}
+
+// the same, the counters are left in 'stats'
+int FS::defrag(bool dry_run, defrag_stats &stats){
+    TRACE(TRACE_DEFRAG, dry_run);
+    DiskCommand command(disk);
+    CONSOLE << "FS::defrag(" << (dry_run ? "-n" : "") << ")\n";
+    int status = ReadFromFAT();
+    if (status) return status;
+
+    CONSOLE << "Name \t Blocks \t Fragments \t Score " << std::endl;
+    CONSOLE << "---- \t ------ \t --------- \t ----- " << std::endl;
+    stats = defrag_stats();
+    status = defragDir(ROOT_BLOCK, "", dry_run, stats);
+    if (status) return status;
+
+    // the score is the share of steps that are not contiguous, 0% when every file is one run
+    unsigned before = stats.steps ? stats.breaks * 100 / stats.steps : 0;
+    unsigned after = stats.steps ? stats.remaining * 100 / stats.steps : 0;
+    CONSOLE << stats.files << " files, fragmentation " << before << "%";
+    if (!dry_run) {
+        CONSOLE << ", " << stats.moved << " files moved, fragmentation now " << after << "%";
+    }
+    CONSOLE << std::endl;
+    return 0;
+}
+
+int FS::defragDir(int dir_block, std::string path, bool dry_run, defrag_stats &stats){
+    dir_entry dir_entries[MAX_DIR_ENTRIES];
+    int status = disk.read(dir_block, (uint8_t*)dir_entries);
+    if (status) return status;
+
+    // the blocks of all moved files, at most every block of the disk, so the
+    // list never grows while the chains of the files come and go
+    ArenaScope scope(arena);
+    block_list old_blocks(arena);
+    old_blocks.reserve(BLOCK_SIZE / 2);
+    for (int i = 0; i < (int)MAX_DIR_ENTRIES; i++){
+        dir_entry &entry = dir_entries[i];
+        // inline files have no chain to defragment
+        if (entry.file_name[0] == 0 || entry.file_name[0] == INLINE_SLOT || PARENT_DIR == entry.file_name
+            || (entry.type & TYPE_INLINE)){
+            continue;
+        }
+        std::string name = path + "/" + entry.file_name;
+        if (entry.type == TYPE_DIR){
+            status = defragDir(entry.first_blk, name, dry_run, stats);
+            if (status) return status;
+            continue;
+        }
+
+        ArenaScope file_scope(arena);
+        block_list chain(arena);
+        status = getChain(entry.first_blk, chain);
+        if (status) return status;
+        unsigned breaks = 0;
+        for (size_t j = 1; j < chain.size(); j++){
+            if (chain[j] != chain[j - 1] + 1){
+                breaks++;
+            }
+        }
+        unsigned steps = chain.size() - 1;
+        stats.files++;
+        stats.steps += steps;
+        stats.breaks += breaks;
+        CONSOLE << name << "\t " << chain.size() << "\t\t " << breaks + 1 << "\t\t "
+                << (steps ? breaks * 100 / steps : 0) << "%" << std::endl;
+        bool shared = false;
+        for (size_t j = 0; j < chain.size(); j++){
+            if (super.refcount[chain[j]] > 0){
+                shared = true;
+            }
+        }
+        if (breaks == 0 || dry_run || shared){
+            // blocks shared with other files (dedup) stay where they are
+            stats.remaining += breaks;
+            continue;
+        }
+
+        int run = findFreeRun(chain.size());
+        if (run < 0){
+            // no hole is large enough, the file stays where it is
+            stats.remaining += breaks;
+            continue;
+        }
+        // copy the data first, the new run is not referenced until the
+        // FAT and the directory block are committed together below
+        char data[BLOCK_SIZE];
+        for (size_t j = 0; j < chain.size(); j++){
+            status = readBlock(chain[j], (uint8_t*)data);
+            if (status) return status;
+            status = disk.write(run + j, (uint8_t*)data);
+            if (status) return status;
+            fat[run + j] = (j + 1 < chain.size()) ? run + j + 1 : FAT_EOF;
+        }
+        old_blocks.insert(old_blocks.end(), chain.begin(), chain.end());
+        entry.first_blk = run;
+        stats.moved++;
+    }
+
+    if (!old_blocks.empty()){
+        // The directory block and the FAT are committed before the old blocks
+        // are freed, so they can't be overwritten while the disk still points
+        // to them. A crash in between only leaves orphans for fsck to reclaim.
+        status = disk.write_meta(dir_block, (uint8_t*)dir_entries);
+        if (status) return status;
+        status = writeToFAT();
+        if (status) return status;
+        status = disk.sync();
+        if (status) return status;
+        for (size_t j = 0; j < old_blocks.size(); j++){
+            fat[old_blocks[j]] = FAT_FREE;
+            forgetBlock(old_blocks[j]);
+            disk.trim(old_blocks[j]);
+        }
+        status = writeToFAT();
+        if (status) return status;
+    }
+    return 0;
+}
+
+// reads a data block of a file chain, and the blocks after it when the
+// reads follow the chain
+int FS::readBlock(int block, uint8_t *data){
+    if (block == ahead.next){
+        ahead.streak++;
+    }
+    else {
+        // a jump, whatever was read ahead is not for this reader
+        ahead.streak = 0;
+        ahead.trigger = -1;
+        ahead.last = -1;
+    }
+    int next = fat[block];
+    ahead.next = (next >= FIRST_DATA_BLOCK && next < BLOCK_SIZE / 2) ? next : -1;
+
+    if (ahead.streak >= READ_AHEAD_STREAK && ahead.next != -1 && (ahead.last == -1 || block == ahead.trigger)){
+        unsigned used, wasted;
+        disk.ahead_stats(used, wasted);
+        if (wasted > used){
+            ahead.window = std::max(ahead.window / 2, (unsigned)READ_AHEAD_MIN);
+        }
+        else if (wasted == 0 && used >= ahead.window){
+            ahead.window = std::min(ahead.window * 2, (unsigned)READ_AHEAD_MAX);
+        }
+        // the window starts after the previous one, or after this block
+        int start = ahead.last != -1 ? fat[ahead.last] : ahead.next;
+        std::vector<unsigned> window;
+        for (int b = start; b >= FIRST_DATA_BLOCK && b < BLOCK_SIZE / 2 && window.size() < ahead.window; b = fat[b]){
+            window.push_back(b);
+        }
+        if (window.empty()){
+            ahead.trigger = -1;
+        }
+        else {
+            if (disk.prefetch(window)) return -1;
+            ahead.trigger = window.front();
+            ahead.last = window.back();
+        }
+    }
+    return disk.read(block, data);
+}
+
+// plans the copy of the directory in 'dir_block' to 'new_block', and of all
+// below it. The blocks of the copy are taken in the FAT, each file in a run
+// of adjacent blocks when there is one.
+int FS::planTree(int dir_block, int new_block, int parent_block, tree_plan &plan){
+    if (!plan.sources.insert(dir_block).second){
+        CONSOLE << "Error: Directory loop at block " << dir_block << ", run fsck\n";
+        return FS_ECORRUPT;
+    }
+    std::vector<dir_entry> entries(MAX_DIR_ENTRIES);
+    int status = disk.read(dir_block, (uint8_t*)entries.data());
+    if (status) return status;
+
+    for (unsigned i = 0; i < MAX_DIR_ENTRIES; i++){
+        dir_entry &entry = entries[i];
+        // the slots of inline files are copied with the directory block
+        if (entry.file_name[0] == 0 || entry.file_name[0] == INLINE_SLOT || (entry.type & TYPE_INLINE)){
+            continue;
+        }
+        if (strcmp(entry.file_name, PARENT_DIR.c_str()) == 0){
+            entry.first_blk = parent_block;
+            continue;
+        }
+        if (entry.type == TYPE_DIR){
+            int block = findFreeBlock();
+            if (block < 0){
+                CONSOLE << "Error: There isn't anymore free blocks in FAT" << std::endl;
+                return FS_ENOSPC;
+            }
+            fat[block] = FAT_EOF;
+            int source = entry.first_blk;
+            entry.first_blk = block;
+            status = planTree(source, block, new_block, plan);
+            if (status) return status;
+            continue;
+        }
+        if (entry.first_blk == (uint16_t)FAT_EOF){
+            continue;
+        }
+        int first = entry.first_blk;
+        if ((dedup || plan.share) && super.refcount[first] + plan.clones[first] < MAX_REFCOUNT){
+            // a clone, like cp makes
+            plan.clones[first]++;
+            continue;
+        }
+        ArenaScope file_scope(arena);
+        block_list chain(arena);
+        status = getChain(first, chain);
+        if (status) return status;
+        int run = findFreeRun(chain.size());
+        int previous = -1;
+        for (size_t j = 0; j < chain.size(); j++){
+            int block = run >= 0 ? run + (int)j : findFreeBlock();
+            if (block < 0){
+                CONSOLE << "Error: There isn't anymore free blocks in FAT" << std::endl;
+                return FS_ENOSPC;
+            }
+            if (previous == -1){
+                entry.first_blk = block;
+            }
+            else {
+                fat[previous] = block;
+            }
+            fat[block] = FAT_EOF;
+            plan.from.push_back(chain[j]);
+            plan.to.push_back(block);
+            previous = block;
+        }
+    }
+    plan.dirs[new_block] = entries;
+    return 0;
+}
+
+// copies the data blocks of the plan, STREAM_BLOCKS at a time. Each thread
+// reads a slice of adjacent jobs of the batch, the batch is then written in one go.
+int FS::copyBlocks(tree_plan &plan){
+    size_t total = plan.from.size();
+    if (total == 0){
+        return 0;
+    }
+    ArenaScope scope(arena);
+    uint8_t *data = arena.alloc<uint8_t>((size_t)std::min<size_t>(total, STREAM_BLOCKS) * BLOCK_SIZE);
+    for (size_t first = 0; first < total; first += STREAM_BLOCKS){
+        size_t n = std::min<size_t>(total - first, STREAM_BLOCKS);
+        size_t workers = std::thread::hardware_concurrency();
+        workers = std::max<size_t>(1, std::min(workers, (n + COPY_SLICE - 1) / COPY_SLICE));
+        std::vector<int> failed(workers, 0);
+        std::vector<std::thread> threads;
+        for (size_t w = 0; w < workers; w++){
+            threads.push_back(std::thread([&, w](){
+                size_t begin = n * w / workers;
+                size_t end = n * (w + 1) / workers;
+                std::vector<unsigned> slice(plan.from.begin() + first + begin, plan.from.begin() + first + end);
+                failed[w] = disk.read_many(slice, &data[begin * BLOCK_SIZE]);
+            }));
+        }
+        for (size_t w = 0; w < workers; w++){
+            threads[w].join();
+        }
+        for (size_t w = 0; w < workers; w++){
+            if (failed[w]) return failed[w];
+        }
+        std::vector<unsigned> batch(plan.to.begin() + first, plan.to.begin() + first + n);
+        int status = disk.write_many(batch, data);
+        if (status) return status;
+    }
+    return 0;
+}
+
+// collects the directory blocks in and below 'dir_block', and the first
+// blocks of the files with a chain
+int FS::walkTree(int dir_block, block_list &dirs, block_list &chains){
+    for (size_t i = 0; i < dirs.size(); i++){
+        if (dirs[i] == dir_block){
+            CONSOLE << "Error: Directory loop at block " << dir_block << ", run fsck\n";
+            return FS_ECORRUPT;
+        }
+    }
+    dirs.push_back(dir_block);
+    dir_entry dir_entries[MAX_DIR_ENTRIES];
+    int status = disk.read(dir_block, (uint8_t*)dir_entries);
+    if (status) return status;
+    for (unsigned i = 0; i < MAX_DIR_ENTRIES; i++){
+        dir_entry &entry = dir_entries[i];
+        if (entry.file_name[0] == 0 || entry.file_name[0] == INLINE_SLOT || (entry.type & TYPE_INLINE) ||
+            strcmp(entry.file_name, PARENT_DIR.c_str()) == 0){
+            continue;
+        }
+        if (entry.type == TYPE_DIR){
+            status = walkTree(entry.first_blk, dirs, chains);
+            if (status) return status;
+        }
+        else if (entry.first_blk != (uint16_t)FAT_EOF){
+            chains.push_back(entry.first_blk);
+        }
+    }
+    return 0;
+}
+
+// collects the blocks of the chain starting at first_blk, a chain that is
+// longer than the FAT (i.e. has a cycle) is an error
+int FS::getChain(int first_blk, block_list &chain){
+    chain.clear();
+    int block = first_blk;
+    while (block != FAT_EOF){
+        if (block < 0 || block >= (BLOCK_SIZE / 2) || chain.size() >= (BLOCK_SIZE / 2)){
+            CONSOLE << "Error: Broken FAT chain at block " << block << ", run fsck\n";
+            return FS_ECORRUPT;
+        }
+        chain.push_back(block);
+        block = fat[block];
+    }
+    return 0;
+}
+
+// first fit search for 'length' adjacent free blocks, returns the first block or -1
+int FS::findFreeRun(int length){
+    int i = 2;
+    while (i < (BLOCK_SIZE / 2)){
+        // skip to the next free block, then count the run that starts there
+        i += scan_word(&fat[i], (BLOCK_SIZE / 2) - i, FAT_FREE);
+        int start = i;
+        while (i < (BLOCK_SIZE / 2) && fat[i] == FAT_FREE && i - start < length){
+            i++;
+        }
+        if (i - start == length){
+            return start;
+        }
+    }
+    return -1;
+}
+
+// record <tracefile|off> records every call to <tracefile>, an empty name stops the recording
+int FS::record(std::string tracefile){
+    CONSOLE << "FS::record(" << tracefile << ")\n";
+    recorder.close();
+    if (!tracefile.empty() && !recorder.open(tracefile)){
+        CONSOLE << "Error: Can't write the trace " << tracefile << "\n";
+        return FS_EIO;
+    }
+    return 0;
+}
+
+// compress <on|off> selects if files created from now on are compressed
+int FS::set_compression(bool on){
+    TRACE(TRACE_COMPRESS, on);
+    compression = on;
+    return 0;
+}
+
+// 'dir_entries' is the directory block that holds 'entry', for inline files
+int FS::readerInit(chain_reader &reader, dir_entry &entry, dir_entry *dir_entries){
+    reader.compressed = entry.type & TYPE_COMPRESSED;
+    reader.inlined = entry.type & TYPE_INLINE;
+    reader.block = entry.first_blk;
+    reader.remaining = entry.size;
+    reader.pos = BLOCK_SIZE;
+    if (reader.inlined){
+        memset(reader.data, 0, BLOCK_SIZE);
+        return readInline(dir_entries, entry, reader.data);
+    }
+    return 0;
+}
+
+// reads the next BLOCK_SIZE bytes of content into 'data', zero padded at the
+// end of the file. Returns FS_ECORRUPT when the chain ends before the content does.
+int FS::readerNext(chain_reader &reader, char *data){
+    if (reader.inlined){
+        if (reader.remaining == 0 && reader.pos == 0){
+            return FS_ECORRUPT;
+        }
+        memcpy(data, reader.data, BLOCK_SIZE);
+        reader.remaining = 0;
+        reader.pos = 0;
+        return 0;
+    }
+    if (!reader.compressed){
+        if (reader.block == FAT_EOF){
+            CONSOLE << "Error: The chain is shorter than the file\n";
+            return FS_ECORRUPT;
+        }
+        int status = readBlock(reader.block, (uint8_t*)data);
+        if (status){
+            return status;
+        }
+        reader.block = fat[reader.block];
+        reader.remaining -= std::min<uint32_t>(reader.remaining, BLOCK_SIZE);
+        return 0;
+    }
+
+    memset(data, 0, BLOCK_SIZE);
+    if (reader.remaining == 0){
+        return 0;
+    }
+    frame_header header;
+    int status = readerBytes(reader, (uint8_t*)&header, sizeof(header));
+    if (status){
+        return status;
+    }
+    if (header.raw_len == 0 || header.raw_len > BLOCK_SIZE || header.stored_len > header.raw_len){
+        CONSOLE << "Error: Corrupt compressed frame\n";
+        return FS_ECORRUPT;
+    }
+    if (header.stored_len == header.raw_len){
+        status = readerBytes(reader, (uint8_t*)data, header.raw_len);
+        if (status){
+            return status;
+        }
+    }
+    else {
+        uint8_t stored[BLOCK_SIZE];
+        status = readerBytes(reader, stored, header.stored_len);
+        if (status){
+            return status;
+        }
+        if (lz_decompress(stored, header.stored_len, (uint8_t*)data, BLOCK_SIZE) != header.raw_len){
+            CONSOLE << "Error: Corrupt compressed frame\n";
+            return FS_ECORRUPT;
+        }
+    }
+    reader.remaining -= std::min<uint32_t>(reader.remaining, header.raw_len);
+    return 0;
+}
+
+// reads 'length' bytes of the frame stream, which runs on over the blocks of the chain
+int FS::readerBytes(chain_reader &reader, uint8_t *data, unsigned length){
+    while (length > 0){
+        if (reader.pos == BLOCK_SIZE){
+            if (reader.block == FAT_EOF){
+                CONSOLE << "Error: The chain is shorter than the file\n";
+                return FS_ECORRUPT;
+            }
+            int status = readBlock(reader.block, reader.data);
+            if (status){
+                return status;
+            }
+            reader.block = fat[reader.block];
+            reader.pos = 0;
+        }
+        unsigned n = std::min(length, BLOCK_SIZE - reader.pos);
+        memcpy(data, &reader.data[reader.pos], n);
+        reader.pos += n;
+        data += n;
+        length -= n;
+    }
+    return 0;
+}
+
+// finds where frame 'frame' of an open compressed file starts in the stream
+// over its chain. The frames before it are skipped by reading their headers
+// only, and every start found is kept in the handle for the next read.
+int FS::frameStart(open_file &handle, unsigned frame, uint32_t &start){
+    if (handle.frames.empty()){
+        handle.frames.push_back(0);
+    }
+    uint8_t block_data[BLOCK_SIZE];
+    int loaded = -1;
+    while (handle.frames.size() <= frame){
+        uint32_t pos = handle.frames.back();
+        frame_header header;
+        uint8_t *bytes = (uint8_t*)&header;
+        for (unsigned i = 0; i < sizeof(header); i++, pos++){
+            unsigned index = pos / BLOCK_SIZE;
+            if (index >= handle.blocks.size()){
+                CONSOLE << "Error: The chain is shorter than the file\n";
+                return FS_ECORRUPT;
+            }
+            if (handle.blocks[index] != loaded){
+                int status = readBlock(handle.blocks[index], block_data);
+                if (status){
+                    return status;
+                }
+                loaded = handle.blocks[index];
+            }
+            bytes[i] = block_data[pos % BLOCK_SIZE];
+        }
+        if (header.raw_len == 0 || header.raw_len > BLOCK_SIZE || header.stored_len > header.raw_len){
+            CONSOLE << "Error: Corrupt compressed frame\n";
+            return FS_ECORRUPT;
+        }
+        handle.frames.push_back(pos + header.stored_len);
+    }
+    start = handle.frames[frame];
+    if (start / BLOCK_SIZE >= handle.blocks.size()){
+        CONSOLE << "Error: The chain is shorter than the file\n";
+        return FS_ECORRUPT;
+    }
+    return 0;
+}
+
+void FS::writerInit(chain_writer &writer, bool compressed){
+    writer.compressed = compressed;
+    writer.first_block = -1;
+    writer.last_block = -1;
+    writer.size = 0;
+    writer.raw_len = 0;
+    writer.out_len = 0;
+    memset(writer.out, 0, BLOCK_SIZE);
+    writer.hashes.clear();
+    writer.released = FAT_EOF;
+}
+
+// adds content to the file, the blocks are allocated in the FAT in memory as they fill up
+int FS::writerPut(chain_writer &writer, const char *data, unsigned length){
+    writer.size += length;
+    if (!writer.compressed){
+        return writerBytes(writer, (const uint8_t*)data, length);
+    }
+    while (length > 0){
+        unsigned n = std::min(length, BLOCK_SIZE - writer.raw_len);
+        memcpy(&writer.raw[writer.raw_len], data, n);
+        writer.raw_len += n;
+        data += n;
+        length -= n;
+        if (writer.raw_len == BLOCK_SIZE){
+            int status = writerFrame(writer);
+            if (status){
+                return status;
+            }
+        }
+    }
+    return 0;
+}
+
+// compresses the content collected so far into one frame, which is stored
+// as it is when compression does not make it smaller
+int FS::writerFrame(chain_writer &writer){
+    uint8_t stored[BLOCK_SIZE];
+    frame_header header;
+    header.raw_len = writer.raw_len;
+    header.stored_len = lz_compress(writer.raw, writer.raw_len, stored, writer.raw_len - 1);
+    int status;
+    if (header.stored_len == 0){
+        header.stored_len = header.raw_len;
+        status = writerBytes(writer, (uint8_t*)&header, sizeof(header));
+        if (status == 0){
+            status = writerBytes(writer, writer.raw, writer.raw_len);
+        }
+    }
+    else {
+        status = writerBytes(writer, (uint8_t*)&header, sizeof(header));
+        if (status == 0){
+            status = writerBytes(writer, stored, header.stored_len);
+        }
+    }
+    writer.raw_len = 0;
+    return status;
+}
+
+int FS::writerBytes(chain_writer &writer, const uint8_t *data, unsigned length){
+    while (length > 0){
+        unsigned n = std::min(length, BLOCK_SIZE - writer.out_len);
+        memcpy(&writer.out[writer.out_len], data, n);
+        writer.out_len += n;
+        data += n;
+        length -= n;
+        if (writer.out_len < BLOCK_SIZE){
+            break;
+        }
+        int status = writerBlock(writer);
+        if (status){
+            return status;
+        }
+    }
+    return 0;
+}
+
+// writes what is left of the content, a file always has at least one block.
+// The FAT is only changed in memory, the caller writes it with the directory.
+int FS::writerFinish(chain_writer &writer){
+    int status = 0;
+    if (writer.compressed && writer.raw_len > 0){
+        status = writerFrame(writer);
+    }
+    if (status == 0 && (writer.out_len > 0 || writer.first_block < 0)){
+        status = writerBlock(writer);
+    }
+    if (status == 0 && dedup && !writer.hashes.empty()){
+        status = dedupChain(writer);
+    }
+    return status;
+}
+
+// continues writing at the end of an uncompressed file. The last block, if
+// it is partly filled, is rewritten with the new content to a new block, and
+// so are the blocks the file shares with other files (copy-on-write).
+int FS::writerOpen(chain_writer &writer, dir_entry &entry){
+    writerInit(writer, false);
+    writer.size = entry.size;
+    unsigned full_blocks = entry.size / BLOCK_SIZE;
+    int block = entry.first_blk;
+    unsigned i = 0;
+    for (; i < full_blocks; i++){
+        if (block == FAT_EOF){
+            CONSOLE << "Error: The chain is shorter than the file\n";
+            return FS_ECORRUPT;
+        }
+        if (has_super && super.refcount[block] > 0){
+            break;
+        }
+        if (writer.first_block < 0){
+            writer.first_block = block;
+        }
+        writer.last_block = block;
+        block = fat[block];
+    }
+    int rest = block;
+    for (; i < full_blocks; i++){
+        if (block == FAT_EOF){
+            CONSOLE << "Error: The chain is shorter than the file\n";
+            return FS_ECORRUPT;
+        }
+        int status = disk.read(block, writer.out);
+        if (status == 0){
+            writer.out_len = BLOCK_SIZE;
+            status = writerBlock(writer);
+        }
+        if (status){
+            return status;
+        }
+        block = fat[block];
+    }
+    writer.out_len = entry.size % BLOCK_SIZE;
+    if (writer.out_len > 0){
+        if (block == FAT_EOF){
+            CONSOLE << "Error: The chain is shorter than the file\n";
+            return FS_ECORRUPT;
+        }
+        int status = disk.read(block, writer.out);
+        if (status){
+            return status;
+        }
+        memset(&writer.out[writer.out_len], 0, BLOCK_SIZE - writer.out_len);
+    }
+    // the copied and partly filled blocks and anything after them are given
+    // back when the file is finished, until then they can still be read
+    writer.released = rest;
+    if (writer.last_block >= 0){
+        fat[writer.last_block] = FAT_EOF;
+    }
+    return 0;
+}
+
+// allocates the next block of the chain and writes the filled block to it
+int FS::writerBlock(chain_writer &writer){
+    int block = findFreeBlock();
+    if (block == -1){
+        CONSOLE << "Error: No free blocks\n";
+        return FS_ENOSPC;
+    }
+    fat[block] = FAT_EOF;
+    if (writer.last_block >= 0){
+        fat[writer.last_block] = block;
+    }
+    else {
+        writer.first_block = block;
+    }
+    writer.last_block = block;
+    if (dedup){
+        writer.hashes.push_back(xxh64(writer.out, BLOCK_SIZE));
+    }
+    int status = disk.write(block, writer.out);
+    memset(writer.out, 0, BLOCK_SIZE);
+    writer.out_len = 0;
+    return status;
+}
+
+// finishes the file and points the entry dir.entries[dir.index] to it. A small
+// file is stored inline in the directory block when it has room for it.
+int FS::writerStore(chain_writer &writer, dir_info &dir){
+    dir_entry &entry = dir.entries[dir.index];
+    releaseChain(writer.released);
+    writer.released = FAT_EOF;
+    int first_slot;
+    if (writerInline(writer, dir, first_slot)){
+        entry.first_blk = first_slot;
+        entry.size = writer.size;
+        entry.type = TYPE_FILE | TYPE_INLINE;
+        return 0;
+    }
+    int status = writerFinish(writer);
+    if (status){
+        return status;
+    }
+    entry.first_blk = writer.first_block;
+    entry.size = writer.size;
+    entry.type = TYPE_FILE | (writer.compressed ? TYPE_COMPRESSED : 0);
+    return 0;
+}
+
+// stores the content in free entries at the end of the directory block, if
+// nothing has been written to blocks yet and the content is small enough
+bool FS::writerInline(chain_writer &writer, dir_info &dir, int &first_slot){
+    if (writer.first_block >= 0 || writer.size > INLINE_MAX){
+        return false;
+    }
+    int needed = (writer.size + INLINE_DATA - 1) / INLINE_DATA;
+    std::vector<int> slots;
+    for (int i = MAX_DIR_ENTRIES - 1; i > 0 && (int)slots.size() < needed; i--){
+        if (i != dir.index && dir.entries[i].file_name[0] == 0){
+            slots.push_back(i);
+        }
+    }
+    if ((int)slots.size() < needed){
+        return false;
+    }
+    // the content is still in the buffer of the frame or of the block
+    const uint8_t *content = writer.compressed ? writer.raw : writer.out;
+    first_slot = INLINE_END;
+    for (int i = needed - 1; i >= 0; i--){
+        inline_slot *slot = (inline_slot*)&dir.entries[slots[i]];
+        memset(slot, 0, sizeof(inline_slot));
+        slot->marker = INLINE_SLOT;
+        slot->next = first_slot;
+        memcpy(slot->data, content + i * INLINE_DATA, std::min<uint32_t>(INLINE_DATA, writer.size - i * INLINE_DATA));
+        first_slot = slots[i];
+    }
+    return true;
+}
+
+// copies the content of an inline file into 'data' (INLINE_MAX bytes)
+int FS::readInline(dir_entry *dir_entries, dir_entry &entry, uint8_t *data){
+    int slot_index = entry.first_blk;
+    for (uint32_t pos = 0; pos < entry.size; pos += INLINE_DATA){
+        inline_slot *slot = (inline_slot*)&dir_entries[slot_index];
+        if (slot_index >= (int)MAX_DIR_ENTRIES || slot->marker != INLINE_SLOT || entry.size > INLINE_MAX){
+            CONSOLE << "Error: Broken inline file " << entry.file_name << ", run fsck\n";
+            return FS_ECORRUPT;
+        }
+        memcpy(data + pos, slot->data, std::min<uint32_t>(INLINE_DATA, entry.size - pos));
+        slot_index = slot->next;
+    }
+    return 0;
+}
+
+// clears the slots of an inline file, the caller writes the directory block
+void FS::freeInline(dir_entry *dir_entries, dir_entry &entry){
+    int slot_index = entry.first_blk;
+    while (slot_index < (int)MAX_DIR_ENTRIES){
+        inline_slot *slot = (inline_slot*)&dir_entries[slot_index];
+        if (slot->marker != INLINE_SLOT){
+            return;
+        }
+        slot_index = slot->next;
+        memset(slot, 0, sizeof(inline_slot));
+    }
+}
+
+// moves the content of an inline file of the directory block out to a chain
+// of blocks, to give its slots back as directory entries. 'index' is set to a
+// free entry, or -1 when the block has no inline file.
+int FS::spillInline(int dir_block, dir_entry *dir_entries, int &index){
+    index = -1;
+    for (int i = 0; i < (int)MAX_DIR_ENTRIES; i++){
+        dir_entry &entry = dir_entries[i];
+        if (entry.file_name[0] == 0 || entry.file_name[0] == INLINE_SLOT
+            || !(entry.type & TYPE_INLINE) || entry.size == 0){
+            continue;
+        }
+        uint8_t content[INLINE_MAX];
+        int status = readInline(dir_entries, entry, content);
+        if (status){
+            return status;
+        }
+        chain_writer writer;
+        writerInit(writer, compression);
+        status = writerPut(writer, (char*)content, entry.size);
+        if (status == 0){
+            status = writerFinish(writer);
+        }
+        if (status){
+            return status;
+        }
+        freeInline(dir_entries, entry);
+        entry.first_blk = writer.first_block;
+        entry.type = TYPE_FILE | (writer.compressed ? TYPE_COMPRESSED : 0);
+        status = disk.write_meta(dir_block, (uint8_t*)dir_entries);
+        if (status == 0){
+            status = writeToFAT();
+        }
+        if (status){
+            return status;
+        }
+        for (int j = 0; j < (int)MAX_DIR_ENTRIES; j++){
+            if (dir_entries[j].file_name[0] == 0){
+                index = j;
+                break;
+            }
+        }
+        return 0;
+    }
+    return 0;
+}
+
+// Writes 'length' bytes of 'data' (zeroes if nullptr) at 'offset' and sets
+// the size of the file to 'new_size'. The bytes between the old end and
+// 'offset' are cleared. An inline file is written again as a whole, and so
+// is a compressed file first, since its frames can't be changed in place.
+int FS::writeRange(dir_info &dir, uint32_t offset, const char *data, uint32_t length, uint32_t new_size,
+                   block_list *blocks){
+    ArenaScope scope(arena);
+    dir_entry &entry = dir.entries[dir.index];
+    int status;
+    if (entry.type & TYPE_INLINE){
+        size_t content_size = std::max(new_size, offset + length);
+        char *content = arena.alloc<char>(content_size);
+        memset(content, 0, content_size);
+        uint8_t old_content[INLINE_MAX];
+        status = readInline(dir.entries, entry, old_content);
+        if (status){
+            return status;
+        }
+        memcpy(content, old_content, std::min(entry.size, new_size));
+        if (data){
+            memcpy(&content[offset], data, length);
+        }
+        freeInline(dir.entries, entry);
+        chain_writer writer;
+        writerInit(writer, false);
+        status = writerPut(writer, content, new_size);
+        if (status == 0){
+            status = writerStore(writer, dir);
+        }
+        if (status == 0){
+            status = disk.write_meta(dir.block, (uint8_t*)dir.entries);
+        }
+        if (status == 0 && !(entry.type & TYPE_INLINE)){
+            status = writeToFAT();
+            if (status == 0 && blocks){
+                status = getChain(entry.first_blk, *blocks);
+            }
+        }
+        return status;
+    }
+    // the block map of an open file is used as it is, otherwise the chain is walked once
+    block_list chain(arena);
+    block_list &map = blocks ? *blocks : chain;
+    if (entry.type & TYPE_COMPRESSED){
+        status = inflateFile(dir);
+        if (status == 0){
+            status = getChain(entry.first_blk, map);
+        }
+        if (status){
+            return status;
+        }
+    }
+    else if (!blocks){
+        status = getChain(entry.first_blk, map);
+        if (status){
+            return status;
+        }
+    }
+
+    uint32_t start = std::min(offset, entry.size);
+    uint32_t end = offset + length;
+    unsigned first_index = start / BLOCK_SIZE;
+    unsigned last_index = end > start ? (end - 1) / BLOCK_SIZE : first_index;
+    status = unshareChain(entry, last_index, &map);
+    if (status){
+        return status;
+    }
+    uint8_t block_data[BLOCK_SIZE];
+    for (unsigned i = first_index; i <= last_index && end > start; i++){
+        bool fresh = i >= map.size();
+        int block;
+        if (fresh){
+            // the file is extended with a block of zeroes
+            block = findFreeBlock();
+            if (block < 0){
+                CONSOLE << "Error: No free blocks\n";
+                return FS_ENOSPC;
+            }
+            fat[block] = FAT_EOF;
+            fat[map.back()] = block;
+            map.push_back(block);
+        }
+        else {
+            block = map[i];
+        }
+        uint32_t block_start = i * BLOCK_SIZE;
+        if (fresh){
+            memset(block_data, 0, BLOCK_SIZE);
+        }
+        else if ((status = disk.read(block, block_data))){
+            return status;
+        }
+        uint32_t from = std::max(block_start, start);
+        uint32_t to = std::min<uint32_t>(block_start + BLOCK_SIZE, offset);
+        if (from < to){
+            memset(&block_data[from - block_start], 0, to - from);
+        }
+        from = std::max(block_start, offset);
+        to = std::min<uint32_t>(block_start + BLOCK_SIZE, end);
+        if (from < to){
+            if (data){
+                memcpy(&block_data[from - block_start], data + (from - offset), to - from);
+            }
+            else {
+                memset(&block_data[from - block_start], 0, to - from);
+            }
+        }
+        forgetBlock(block);
+        status = disk.write(block, block_data);
+        if (status){
+            return status;
+        }
+    }
+    entry.size = new_size;
+    status = disk.write_meta(dir.block, (uint8_t*)dir.entries);
+    if (status){
+        return status;
+    }
+    return writeToFAT();
+}
+
+// gives the file its own copy of the blocks it shares with other files, when
+// the shared tail starts at or before block 'last_index' of the chain. The
+// block map 'blocks', if any, is built again after a copy.
+int FS::unshareChain(dir_entry &entry, unsigned last_index, block_list *blocks){
+    int previous = -1;
+    int block = entry.first_blk;
+    unsigned i = 0;
+    while (block != FAT_EOF && !(has_super && super.refcount[block] > 0)){
+        previous = block;
+        block = fat[block];
+        i++;
+    }
+    if (block == FAT_EOF || i > last_index){
+        return 0;
+    }
+    int shared = block;
+    uint8_t data[BLOCK_SIZE];
+    while (block != FAT_EOF){
+        int copy = findFreeBlock();
+        if (copy < 0){
+            CONSOLE << "Error: No free blocks\n";
+            return FS_ENOSPC;
+        }
+        fat[copy] = FAT_EOF;
+        if (previous >= 0){
+            fat[previous] = copy;
+        }
+        else {
+            entry.first_blk = copy;
+        }
+        int status = disk.read(block, data);
+        if (status == 0){
+            status = disk.write(copy, data);
+        }
+        if (status){
+            return status;
+        }
+        previous = copy;
+        block = fat[block];
+    }
+    releaseChain(shared);
+    return blocks ? getChain(entry.first_blk, *blocks) : 0;
+}
+
+// rewrites a compressed file uncompressed, for the commands that modify blocks in place
+int FS::inflateFile(dir_info &dir){
+    dir_entry &entry = dir.entries[dir.index];
+    chain_reader reader;
+    chain_writer writer;
+    int status = readerInit(reader, entry, dir.entries);
+    if (status){
+        return status;
+    }
+    writerInit(writer, false);
+    char data[BLOCK_SIZE];
+    for (uint32_t tot_size = 0; tot_size < entry.size; tot_size += BLOCK_SIZE){
+        status = readerNext(reader, data);
+        if (status == 0){
+            status = writerPut(writer, data, std::min<uint32_t>(BLOCK_SIZE, entry.size - tot_size));
+        }
+        if (status){
+            return status;
+        }
+    }
+    status = writerFinish(writer);
+    if (status){
+        return status;
+    }
+
+    releaseChain(entry.first_blk);
+    entry.first_blk = writer.first_block;
+    entry.type &= ~TYPE_COMPRESSED;
+    status = disk.write_meta(dir.block, (uint8_t*)dir.entries);
+    if (status){
+        return status;
+    }
+    return writeToFAT();
+}
+
+// dedup <on|off> selects if identical blocks are shared between files
+int FS::set_dedup(bool on){
+    TRACE(TRACE_DEDUP, on);
+    DiskCommand command(disk);
+    if (on && !has_super){
+        CONSOLE << "Error: The disk has no superblock for the reference counts, format it first\n";
+        return FS_ENOFS;
+    }
+    dedup = on;
+    block_index.clear();
+    block_key.assign(BLOCK_SIZE / 2, 0);
+    if (!on){
+        return 0;
+    }
+    // the index is built from the files on the disk, and kept up to date from now on
+    int status = ReadFromFAT();
+    if (status){
+        return status;
+    }
+    return buildIndex(ROOT_BLOCK);
+}
+
+// snapshot <name> freezes the whole tree under <name>. Every directory block
+// is copied and every file of the copy is a clone, so taking a snapshot
+// writes one block per directory and no data.
+int FS::snapshot(std::string name){
+    TRACE(TRACE_SNAPSHOT, name);
+    DiskCommand command(disk);
+    CONSOLE << "FS::snapshot(" << name << ")\n";
+    if (!has_super){
+        CONSOLE << "Error: The disk has no superblock for snapshots, format it first\n";
+        return FS_ENOFS;
+    }
+    int status = ReadFromFAT();
+    if (status) return status;
+    if (name.empty() || name.length() >= SNAPSHOT_NAME || name.find('/') != std::string::npos){
+        CONSOLE << "Error: A snapshot name is 1 to " << SNAPSHOT_NAME - 1 << " characters without '/'\n";
+        return FS_ENAME;
+    }
+    if (findSnapshot(name) >= 0){
+        CONSOLE << "Error: Snapshot already exists: " << name << "\n";
+        return FS_EEXIST;
+    }
+    int slot = findSnapshot("");
+    if (slot < 0){
+        CONSOLE << "Error: There are already " << MAX_SNAPSHOTS << " snapshots\n";
+        return FS_ENOSPC;
+    }
+
+    tree_plan plan;
+    plan.share = true;
+    int root = findFreeBlock();
+    if (root < 0){
+        CONSOLE << "Error: There isn't anymore free blocks in FAT" << std::endl;
+        return FS_ENOSPC;
+    }
+    fat[root] = FAT_EOF;
+    status = planTree(ROOT_BLOCK, root, root, plan);
+    if (status) return status;
+    // only files whose blocks already have the most references are copied
+    status = copyBlocks(plan);
+    if (status) return status;
+    for (std::map<int, int>::iterator it = plan.clones.begin(); it != plan.clones.end(); ++it){
+        super.refcount[it->first] += it->second;
+    }
+    for (std::map<int, std::vector<dir_entry> >::iterator it = plan.dirs.begin(); it != plan.dirs.end(); ++it){
+        status = disk.write_meta(it->first, (uint8_t*)it->second.data());
+        if (status) return status;
+    }
+    snapshot_entry &snap = super.snapshots[slot];
+    memset(&snap, 0, sizeof(snap));
+    memcpy(snap.name, name.c_str(), name.length());
+    snap.root_block = root;
+    snap.created = time(nullptr);
+    snap.generation = super.generation;
+    // the table is written with the reference counts, in the same commit as the FAT
+    refcounts_changed = true;
+    return writeToFAT();
+}
+
+// snapshots lists the snapshots with their generation and time
+int FS::snapshots(){
+    std::vector<snapshot_entry> list;
+    int status = snapshots(list);
+    if (status) return status;
+    CONSOLE << "Name\t\t Generation\t Created" << std::endl;
+    for (size_t i = 0; i < list.size(); i++){
+        char created[32];
+        time_t t = list[i].created;
+        strftime(created, sizeof(created), "%Y-%m-%d %H:%M:%S", localtime(&t));
+        CONSOLE << list[i].name << (strlen(list[i].name) < 8 ? "\t\t " : "\t ") << list[i].generation
+                << "\t\t " << created << std::endl;
+    }
+    return 0;
+}
+
+int FS::snapshots(std::vector<snapshot_entry> &list){
+    list.clear();
+    for (int i = 0; i < MAX_SNAPSHOTS && has_super; i++){
+        if (super.snapshots[i].name[0] != 0){
+            list.push_back(super.snapshots[i]);
+        }
+    }
+    std::sort(list.begin(), list.end(), [](const snapshot_entry &a, const snapshot_entry &b){
+        return a.generation < b.generation;
+    });
+    return 0;
+}
+
+// snapshot-rm <name> removes the snapshot like rm -r removes a tree: the
+// directory blocks are freed and the references to the file blocks dropped
+int FS::snapshot_rm(std::string name){
+    TRACE(TRACE_SNAPSHOT_RM, name);
+    DiskCommand command(disk);
+    CONSOLE << "FS::snapshot_rm(" << name << ")\n";
+    int slot = name.empty() ? -1 : findSnapshot(name);
+    if (slot < 0){
+        CONSOLE << "Error: No such snapshot: " << name << "\n";
+        return FS_ENOENT;
+    }
+    int status = ReadFromFAT();
+    if (status) return status;
+    ArenaScope scope(arena);
+    block_list dirs(arena);
+    block_list chains(arena);
+    status = walkTree(super.snapshots[slot].root_block, dirs, chains);
+    if (status) return status;
+    for (size_t i = 0; i < chains.size(); i++){
+        releaseChain(chains[i]);
+    }
+    for (size_t i = 0; i < dirs.size(); i++){
+        fat[dirs[i]] = FAT_FREE;
+        disk.trim(dirs[i]);
+    }
+    memset(&super.snapshots[slot], 0, sizeof(snapshot_entry));
+    refcounts_changed = true;
+    return writeToFAT();
+}
+
+// the index of the snapshot in the table, "" finds a free entry, -1 if there is none
+int FS::findSnapshot(const std::string &name){
+    for (int i = 0; i < MAX_SNAPSHOTS && has_super; i++){
+        if (strncmp(super.snapshots[i].name, name.c_str(), SNAPSHOT_NAME) == 0){
+            return i;
+        }
+    }
+    return -1;
+}
+
+// the entry of "@<name>/<path>", a path in a snapshot. The root of the
+// snapshot is a directory that can be read but not changed.
+int FS::snapshotEntry(std::string path, dir_entry &entry){
+    size_t slash = path.find('/');
+    std::string name = path.substr(1, slash == std::string::npos ? std::string::npos : slash - 1);
+    int slot = name.empty() ? -1 : findSnapshot(name);
+    if (slot < 0){
+        CONSOLE << "Error: No such snapshot: " << name << "\n";
+        return FS_ENOENT;
+    }
+    memset(&entry, 0, sizeof(entry));
+    memcpy(entry.file_name, path.c_str(), std::min<size_t>(path.length(), sizeof(entry.file_name) - 1));
+    entry.first_blk = super.snapshots[slot].root_block;
+    entry.type = TYPE_DIR;
+    entry.access_rights = READ | EXECUTE;
+    while (slash != std::string::npos){
+        size_t next = path.find('/', slash + 1);
+        std::string part = path.substr(slash + 1, next == std::string::npos ? std::string::npos : next - slash - 1);
+        slash = next;
+        if (part.empty()){
+            continue;
+        }
+        if ((entry.type & TYPE_MASK) != TYPE_DIR){
+            CONSOLE << "Error: Filepath is not a directory: " << path << "\n";
+            return FS_ENOTDIR;
+        }
+        dir_entry entries[MAX_DIR_ENTRIES];
+        int status = disk.read(entry.first_blk, (uint8_t*)entries);
+        if (status) return status;
+        int found = -1;
+        for (int i = 0; i < (int)MAX_DIR_ENTRIES && found < 0; i++){
+            if (entries[i].file_name[0] != INLINE_SLOT && part == entries[i].file_name && part != PARENT_DIR){
+                found = i;
+            }
+        }
+        if (found < 0){
+            CONSOLE << "Error: File not found: " << path << "\n";
+            return FS_ENOENT;
+        }
+        entry = entries[found];
+    }
+    return 0;
+}
+
+// the root directory blocks of the snapshots, for fsck
+std::vector<unsigned> FS::snapshotRoots(){
+    std::vector<unsigned> roots;
+    for (int i = 0; i < MAX_SNAPSHOTS && has_super; i++){
+        if (super.snapshots[i].name[0] != 0){
+            roots.push_back(super.snapshots[i].root_block);
+        }
+    }
+    return roots;
+}
+
+// export-delta <since-gen> <hostfile> writes the blocks changed since the delta
+// of generation <since-gen> to <hostfile>, each one compressed when that makes
+// it smaller. The bits of the blocks are cleared once the file is written, and
+// the next delta starts from the generation of this one.
+int FS::export_delta(uint64_t since, std::string hostfile){
+    TRACE(TRACE_EXPORT_DELTA, hostfile, since);
+    DiskCommand command(disk);
+    CONSOLE << "FS::export_delta(" << since << ", " << hostfile << ")\n";
+    if (!has_super){
+        CONSOLE << "Error: The disk has no superblock for deltas, format it first\n";
+        return FS_ENOFS;
+    }
+    int status = ReadFromFAT();
+    if (status) return status;
+    if (since != 0 && since != super.delta_base){
+        if (super.delta_base == 0)
+            CONSOLE << "Error: The changes since generation " << since << " are not known, export a full delta (0)\n";
+        else
+            CONSOLE << "Error: The last delta is generation " << super.delta_base << ", not " << since << "\n";
+        return FS_EINVAL;
+    }
+    // the used blocks that changed, or all of them. The journal is not part of a delta.
+    std::vector<unsigned> blocks;
+    for (unsigned b = 0; b < disk.get_no_blocks(); b++){
+        if ((b >= JOURNAL_BLOCK && b <= SUPER_BLOCK) || fat[b] == FAT_FREE){
+            continue;
+        }
+        if (since == 0 || (super.changed[b / 8] & (1 << (b % 8)))){
+            blocks.push_back(b);
+        }
+    }
+    // the superblock the disk will have after this command, with the bits cleared
+    superblock next = super;
+    memset(next.changed, 0, sizeof(next.changed));
+    next.generation = std::max(super.generation, super.delta_base) + 1;
+    next.delta_base = next.generation;
+    next.clean = 0;
+
+    std::ofstream out(hostfile, std::ios::binary | std::ios::out | std::ios::trunc);
+    if (!out.is_open()){
+        CONSOLE << "Error: Can't create the file " << hostfile << " on the host\n";
+        return FS_EIO;
+    }
+    delta_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DELTA_MAGIC, sizeof(header.magic));
+    header.from = since;
+    header.to = next.delta_base;
+    header.blocks = blocks.size() + 1;
+    header.block_size = BLOCK_SIZE;
+    out.write((const char*)&header, sizeof(header));
+    ArenaScope scope(arena);
+    uint8_t *data = arena.alloc<uint8_t>((size_t)STREAM_BLOCKS * BLOCK_SIZE);
+    uint8_t *packed = arena.alloc<uint8_t>(BLOCK_SIZE);
+    uint64_t bytes = sizeof(header);
+    for (size_t first = 0; first <= blocks.size(); first += STREAM_BLOCKS){
+        std::vector<unsigned> batch(blocks.begin() + first, blocks.begin() + std::min(blocks.size(), first + STREAM_BLOCKS));
+        status = disk.read_many(batch, data);
+        if (status) return status;
+        if (first + STREAM_BLOCKS > blocks.size()){
+            // the superblock is the last block of the delta
+            batch.push_back(SUPER_BLOCK);
+            memset(data + (batch.size() - 1) * BLOCK_SIZE, 0, BLOCK_SIZE);
+            memcpy(data + (batch.size() - 1) * BLOCK_SIZE, &next, sizeof(next));
+        }
+        for (size_t i = 0; i < batch.size(); i++){
+            uint8_t *block = data + i * BLOCK_SIZE;
+            delta_block record;
+            record.block = batch[i];
+            int packed_len = lz_compress(block, BLOCK_SIZE, packed, BLOCK_SIZE - 1);
+            record.stored_len = packed_len > 0 ? packed_len : BLOCK_SIZE;
+            out.write((const char*)&record, sizeof(record));
+            out.write((const char*)(packed_len > 0 ? packed : block), record.stored_len);
+            bytes += sizeof(record) + record.stored_len;
+        }
+    }
+    out.close();
+    if (!out.good()){
+        CONSOLE << "Error: Can't write the file " << hostfile << " on the host\n";
+        return FS_EIO;
+    }
+    // the disk goes on from the superblock of the delta, writeSuper moves its
+    // generation past the delta, so the next delta gets a higher one
+    super = next;
+    status = writeSuper(false);
+    if (status) return status;
+    CONSOLE << header.blocks << " blocks, " << bytes << " bytes, generation " << since << " to "
+            << header.to << std::endl;
+    return 0;
+}
+
+// apply-delta <hostfile> writes the blocks of a delta to this disk and mounts
+// the tree it ends with. An incremental delta only applies to the generation
+// it was exported from, a full one to any formatted disk.
+int FS::apply_delta(std::string hostfile){
+    TRACE(TRACE_APPLY_DELTA, hostfile);
+    DiskCommand command(disk);
+    CONSOLE << "FS::apply_delta(" << hostfile << ")\n";
+    if (!has_super){
+        CONSOLE << "Error: The disk has no superblock for deltas, format it first\n";
+        return FS_ENOFS;
+    }
+    std::ifstream in(hostfile, std::ios::binary | std::ios::in);
+    if (!in.is_open()){
+        CONSOLE << "Error: Can't read the file " << hostfile << " on the host\n";
+        return FS_EIO;
+    }
+    delta_header header;
+    in.read((char*)&header, sizeof(header));
+    if (!in.good() || memcmp(header.magic, DELTA_MAGIC, sizeof(header.magic)) != 0 ||
+        header.block_size != BLOCK_SIZE || header.blocks == 0){
+        CONSOLE << "Error: " << hostfile << " is not a delta of this disk format\n";
+        return FS_EINVAL;
+    }
+    if (header.from != 0 && header.from != super.delta_base){
+        CONSOLE << "Error: The delta follows generation " << header.from << ", this disk is at "
+                << super.delta_base << "\n";
+        return FS_EINVAL;
+    }
+    int status = ReadFromFAT();
+    if (status) return status;
+    int16_t old_fat[BLOCK_SIZE / 2];
+    memcpy(old_fat, fat, sizeof(fat));
+    // a delta cut short leaves a mix of two generations, only a full delta can follow it
+    super.delta_base = 0;
+    status = writeSuper(false);
+    if (status) return status;
+    status = disk.sync();
+    if (status) return status;
+
+    uint8_t packed[BLOCK_SIZE];
+    uint8_t block[BLOCK_SIZE];
+    superblock next;
+    for (uint32_t i = 0; i < header.blocks; i++){
+        delta_block record;
+        in.read((char*)&record, sizeof(record));
+        if (record.stored_len > BLOCK_SIZE){
+            in.setstate(std::ios::failbit);
+        }
+        in.read((char*)packed, record.stored_len);
+        bool last = i + 1 == header.blocks;
+        if (!in.good() || record.block >= disk.get_no_blocks() || (record.block == SUPER_BLOCK) != last ||
+            (record.block >= JOURNAL_BLOCK && record.block < SUPER_BLOCK)){
+            CONSOLE << "Error: The delta " << hostfile << " is damaged\n";
+            return FS_ECORRUPT;
+        }
+        if (record.stored_len == BLOCK_SIZE){
+            memcpy(block, packed, BLOCK_SIZE);
+        }
+        else if (lz_decompress(packed, record.stored_len, block, BLOCK_SIZE) != BLOCK_SIZE){
+            CONSOLE << "Error: The delta " << hostfile << " is damaged\n";
+            return FS_ECORRUPT;
+        }
+        if (last){
+            memcpy(&next, block, sizeof(next));
+            continue;
+        }
+        status = disk.write(record.block, block);
+        if (status) return status;
+    }
+    if (next.magic != SUPER_MAGIC || next.version != FS_VERSION || next.no_blocks != disk.get_no_blocks()){
+        CONSOLE << "Error: The delta " << hostfile << " is damaged\n";
+        return FS_ECORRUPT;
+    }
+
+    // the tree of the delta replaces the one that was mounted
+    super = next;
+    status = ReadFromFAT();
+    if (status) return status;
+    for (unsigned b = FIRST_DATA_BLOCK; b < disk.get_no_blocks(); b++){
+        if (old_fat[b] != FAT_FREE && fat[b] == FAT_FREE){
+            disk.trim(b);
+        }
+    }
+    for (int fd = 0; fd < MAX_OPEN_FILES; fd++){
+        handles[fd].used = false;
+    }
+    ahead = read_ahead();
+    fat_stamp++;
+    block_index.clear();
+    block_key.assign(BLOCK_SIZE / 2, 0);
+    goHome();
+    if (dedup){
+        status = buildIndex(ROOT_BLOCK);
+        if (status) return status;
+    }
+    status = writeSuper(false);
+    if (status) return status;
+    CONSOLE << header.blocks << " blocks, generation " << header.from << " to " << header.to << std::endl;
+    return disk.sync();
+}
+
+uint64_t FS::blockKey(uint64_t hash, int next){
+    uint64_t key = hash ^ ((uint64_t)(next + 2) * 0x9e3779b97f4a7c15ULL);
+    return key ? key : 1;
+}
+
+// adds the blocks of every file in the directory tree to the index
+int FS::buildIndex(int dir_block){
+    dir_entry dir_entries[MAX_DIR_ENTRIES];
+    int status = disk.read(dir_block, (uint8_t*)dir_entries);
+    if (status){
+        return status;
+    }
+    uint8_t data[BLOCK_SIZE];
+    for (int i = 0; i < (int)MAX_DIR_ENTRIES; i++){
+        dir_entry &entry = dir_entries[i];
+        if (entry.file_name[0] == 0 || entry.file_name[0] == INLINE_SLOT || PARENT_DIR == entry.file_name
+            || (entry.type & TYPE_INLINE)){
+            continue;
+        }
+        if ((entry.type & TYPE_MASK) == TYPE_DIR){
+            status = buildIndex(entry.first_blk);
+            if (status){
+                return status;
+            }
+            continue;
+        }
+        ArenaScope file_scope(arena);
+        block_list chain(arena);
+        status = getChain(entry.first_blk, chain);
+        if (status){
+            return status;
+        }
+        for (size_t j = 0; j < chain.size(); j++){
+            int block = chain[j];
+            if (block_key[block] != 0){
+                // the rest of the chain is shared with a file that was indexed before
+                break;
+            }
+            status = readBlock(block, data);
+            if (status){
+                return status;
+            }
+            uint64_t key = blockKey(xxh64(data, BLOCK_SIZE), fat[block]);
+            if (block_index.find(key) == block_index.end()){
+                block_index[key] = block;
+            }
+            block_key[block] = key;
+        }
+    }
+    return 0;
+}
+
+// returns an indexed block with the same content and the same successor as
+// 'block', or -1. A candidate is compared byte by byte, not only by its hash.
+int FS::findDuplicate(uint64_t key, int block, int next){
+    std::unordered_map<uint64_t, int>::iterator it = block_index.find(key);
+    if (it == block_index.end()){
+        return -1;
+    }
+    int duplicate = it->second;
+    if (duplicate == block || block_key[duplicate] != key || fat[duplicate] != next
+        || super.refcount[duplicate] >= MAX_REFCOUNT){
+        return -1;
+    }
+    uint8_t data[BLOCK_SIZE];
+    uint8_t other[BLOCK_SIZE];
+    if (disk.read(block, data) || disk.read(duplicate, other) || !scan_equal(data, other, BLOCK_SIZE)){
+        return -1;
+    }
+    return duplicate;
+}
+
+// Shares the last blocks of a chain that was just written with identical
+// blocks of other files. In a FAT a block has one successor, so two chains
+// can only share a common tail: the blocks are compared from the last one
+// backwards, and the first block that differs ends the shared part.
+int FS::dedupChain(chain_writer &writer){
+    ArenaScope scope(arena);
+    block_list chain(arena);
+    int status = getChain(writer.first_block, chain);
+    if (status){
+        return status;
+    }
+    // the chain may start with blocks of the file that were kept (append)
+    size_t first_new = chain.size() - writer.hashes.size();
+    int next = FAT_EOF;
+    bool shared_next = false;
+    size_t i = chain.size();
+    while (i > first_new){
+        i--;
+        int block = chain[i];
+        uint64_t key = blockKey(writer.hashes[i - first_new], next);
+        int duplicate = findDuplicate(key, block, next);
+        if (duplicate < 0){
+            // this block and the ones in front of it stay, and are indexed
+            fat[block] = next;
+            for (size_t j = i + 1; j > first_new; j--){
+                block = chain[j - 1];
+                key = blockKey(writer.hashes[j - 1 - first_new], fat[block]);
+                if (block_index.find(key) == block_index.end()){
+                    block_index[key] = block;
+                }
+                block_key[block] = key;
+            }
+            return 0;
+        }
+        // the new chain joins the other file at 'duplicate' instead of at 'next'
+        super.refcount[duplicate]++;
+        if (shared_next){
+            super.refcount[next]--;
+        }
+        refcounts_changed = true;
+        fat[block] = FAT_FREE;
+        disk.trim(block);
+        next = duplicate;
+        shared_next = true;
+    }
+    // every new block was a duplicate
+    if (first_new > 0){
+        fat[chain[first_new - 1]] = next;
+    }
+    else {
+        writer.first_block = next;
+    }
+    return 0;
+}
+
+void FS::forgetBlock(int block){
+    uint64_t key = block_key[block];
+    if (key == 0){
+        return;
+    }
+    std::unordered_map<uint64_t, int>::iterator it = block_index.find(key);
+    if (it != block_index.end() && it->second == block){
+        block_index.erase(it);
+    }
+    block_key[block] = 0;
+}
+
+// gives the blocks of a file back to the FAT. A block shared with other
+// files only loses a reference, and the rest of the chain stays with it.
+void FS::releaseChain(int block){
+    while (block != FAT_EOF){
+        if (has_super && super.refcount[block] > 0){
+            super.refcount[block]--;
+            refcounts_changed = true;
+            return;
+        }
+        int next = fat[block];
+        fat[block] = FAT_FREE;
+        forgetBlock(block);
+        disk.trim(block);
+        block = next;
+    }
+}
+
+//----------------- OWN FUNCTIONS -----------------
+
+int FS::writeToFAT(){
+    //writes to FAT, the superblock keeps the free block count up to date
+    int status = disk.write_meta(FAT_BLOCK, (uint8_t*)fat);
+    // the block maps of the open files are built again on their next use
+    fat_stamp++;
+    if (status == 0 && has_super) {
+        super.free_blocks = countFreeBlocks();
+        if (refcounts_changed) {
+            // the reference counts are logged together with the FAT
+            refcounts_changed = false;
+            status = writeSuper(false);
+        }
+    }
     return status;
 }
 
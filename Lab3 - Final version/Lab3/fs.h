@@ -13,18 +13,35 @@
 #include <iostream>
 #include <cstdint>
 #include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <unordered_map>
 #include "disk.h"
+#include "journal.h"
+#include "fsck.h"
+#include "arena.h"
+#include "trace.h"
 
 #ifndef __FS_H__
 #define __FS_H__
 
 #define ROOT_BLOCK 0
 #define FAT_BLOCK 1
+#define JOURNAL_BLOCK 2     // first block of the metadata journal
+#define JOURNAL_BLOCKS 32   // journal header + 31 logged blocks
+#define SUPER_BLOCK (JOURNAL_BLOCK + JOURNAL_BLOCKS)
+#define FIRST_DATA_BLOCK (SUPER_BLOCK + 1)
+#define SUPER_MAGIC 0x46415446 // "FATF"
+#define FS_VERSION 1
 #define FAT_FREE 0
 #define FAT_EOF -1
 
 #define TYPE_FILE 0
 #define TYPE_DIR 1
+#define TYPE_MASK 0x0f        // the type, the upper bits of a file entry are flags
+#define TYPE_COMPRESSED 0x80  // the data is stored as compressed frames
+#define TYPE_INLINE 0x40      // the data is stored in the directory block, see inline_slot
 #define READ 0x04
 #define WRITE 0x02
 #define EXECUTE 0x01
@@ -35,14 +52,100 @@
 
 const std::string PARENT_DIR = "..";
 
+// Status of the FS calls: FS_OK, or one of the negative codes below. open,
+// read, write and seek return a descriptor, a count or an offset instead of
+// FS_OK. The Disk calls return -1 when they fail, which is FS_EIO.
+enum fs_status {
+    FS_OK = 0,
+    FS_EIO = -1,        // the disk or the host failed
+    FS_ENOENT = -2,     // no such file or directory
+    FS_EEXIST = -3,     // the name is taken
+    FS_EACCES = -4,     // the access rights do not allow it
+    FS_ENOTDIR = -5,    // a directory was expected
+    FS_EISDIR = -6,     // a file was expected
+    FS_ENOSPC = -7,     // no free blocks
+    FS_EDIRFULL = -8,   // no free entries in the directory
+    FS_ENAME = -9,      // the name is empty or longer than 55
+    FS_EFBIG = -10,     // the file would be larger than the disk
+    FS_EBADF = -11,     // the descriptor is not open, or not for this
+    FS_EMFILE = -12,    // MAX_OPEN_FILES are open
+    FS_ESTALE = -13,    // the file of the descriptor was removed or renamed
+    FS_EBUSY = -14,     // the working directory or the root
+    FS_EINVAL = -15,    // the arguments do not make sense together
+    FS_ECORRUPT = -16,  // the file system is damaged, run fsck
+    FS_ENOFS = -17,     // the disk is not formatted, or has another format
+};
+
+// a short text for a status, "unknown error" for anything else
+const char *fs_status_text(int status);
+
 struct dir_entry {
     char file_name[56]; // name of the file / sub-directory
     uint32_t size; // size of the file in bytes
     uint16_t first_blk; // index in the FAT for the first block of the file
-    uint8_t type; // directory (1) or file (0)
+    uint8_t type; // directory (1) or file (0), and the TYPE_COMPRESSED flag
     uint8_t access_rights; // read (0x04), write (0x02), execute (0x01)
 };
 
+// A snapshot is a copy of the root directory block and of every directory
+// below it. The files of the copy share their chains with the live files
+// through the reference counts, so a file that is changed afterwards gets
+// its own copy of the blocks it changes (copy-on-write, like dedup).
+#define MAX_SNAPSHOTS 16
+#define SNAPSHOT_NAME 24
+#define SNAPSHOT_PREFIX '@'   // "@<name>/<path>" is a path in a snapshot
+
+struct snapshot_entry {
+    char name[SNAPSHOT_NAME];  // empty for a free entry
+    uint16_t root_block;       // the copy of the root directory
+    uint16_t unused;
+    uint32_t created;          // seconds since the epoch
+    uint64_t generation;       // of the superblock when the snapshot was taken
+};
+
+// written at format, updated on sync and when the file system is unmounted
+struct superblock {
+    uint32_t magic;          // SUPER_MAGIC
+    uint32_t version;        // FS_VERSION, the on-disk format
+    uint32_t block_size;     // geometry: BLOCK_SIZE and number of blocks
+    uint32_t no_blocks;
+    uint32_t root_block;     // layout: fixed blocks of the file system
+    uint32_t fat_block;
+    uint32_t journal_block;
+    uint32_t journal_blocks;
+    uint32_t free_blocks;    // number of FAT_FREE entries
+    uint32_t clean;          // 1 when unmounted cleanly, 0 while mounted
+    uint64_t generation;     // incremented every time the superblock is written
+    // references to each block beyond the first, for blocks shared by files (dedup)
+    uint8_t refcount[BLOCK_SIZE / 2];
+    snapshot_entry snapshots[MAX_SNAPSHOTS];
+    // generation of the last delta exported or applied, 0 if only a full delta can follow
+    uint64_t delta_base;
+    // a bit per block written since then, see export_delta
+    uint8_t changed[BLOCK_SIZE / 2 / 8];
+};
+
+#define MAX_REFCOUNT 255
+
+// A delta is the blocks that changed on a disk since the delta before it, for
+// a copy of the disk elsewhere. The file is a delta_header and a delta_block
+// with its data for each block, the superblock last. A block is stored
+// compressed (lz.h) when that makes it smaller, stored_len is BLOCK_SIZE if not.
+#define DELTA_MAGIC "FSDELTA1"
+
+struct delta_header {
+    char magic[8];         // DELTA_MAGIC
+    uint64_t from;         // the generation the copy must be at, 0 for a full delta
+    uint64_t to;           // the generation the copy is at afterwards
+    uint32_t blocks;
+    uint32_t block_size;
+};
+
+struct delta_block {
+    uint16_t block;
+    uint16_t stored_len;
+};
+
 const unsigned MAX_DIR_ENTRIES = (BLOCK_SIZE / sizeof(dir_entry));
 
 struct dir_info {
@@ -51,25 +154,169 @@ struct dir_info {
     dir_entry entries[MAX_DIR_ENTRIES]; // all directory entries in a block
 };
 
+// A file of up to INLINE_MAX bytes is stored in the directory block itself, in
+// free entries taken from the end of the block. first_blk of the file is the
+// index of its first slot. A slot starts with INLINE_SLOT, which no name can
+// start with since '/' separates the directories of a path. The last byte of
+// a slot stays 0, so the slot still reads as a terminated name.
+#define INLINE_SLOT '/'
+#define INLINE_END 0xff
+#define INLINE_DATA 61
+#define INLINE_MAX (4 * INLINE_DATA)
+
+struct inline_slot {
+    char marker;             // INLINE_SLOT
+    uint8_t next;            // index of the next slot of the file, INLINE_END for the last
+    char data[INLINE_DATA];
+    char end;                // 0
+};
+
+// A compressed file is a stream of frames packed over its chain, one frame
+// for each BLOCK_SIZE bytes of the content. The size of the entry is the
+// size of the content, not of the chain.
+struct frame_header {
+    uint16_t raw_len;     // bytes of content in the frame
+    uint16_t stored_len;  // bytes stored after the header, raw_len if not compressed
+};
+
+// reads the content of a file one block at a time, compressed or not
+struct chain_reader {
+    bool compressed;
+    bool inlined;             // the content is in 'data', read from the directory block
+    int block;                // next block of the chain
+    uint32_t remaining;       // bytes of content not yet read
+    uint8_t data[BLOCK_SIZE]; // current block of the chain, compressed files only
+    unsigned pos;             // read position in 'data'
+};
+
+// writes the content of a new file one block at a time, compressed or not
+struct chain_writer {
+    bool compressed;
+    int first_block;
+    int last_block;
+    uint32_t size;            // bytes of content written
+    uint8_t raw[BLOCK_SIZE];  // content of the frame being filled, compressed files only
+    unsigned raw_len;
+    uint8_t out[BLOCK_SIZE];  // block of the chain being filled
+    unsigned out_len;
+    std::vector<uint64_t> hashes;  // hash of each block written, for dedup
+    int released;             // old blocks given back when the file is finished (writerOpen)
+};
+
+// The blocks of a chain in order. A temporary list takes its memory from the
+// arena of the command, a list that outlives the command (open_file) from the heap.
+typedef std::vector<int, ArenaAllocator<int> > block_list;
+
+#define MAX_OPEN_FILES 16
+
+// An open file. The location of the entry and the blocks of the chain are
+// kept, so a read or write at any offset needs neither the path nor a walk
+// of the FAT. The block map is built again after the FAT has changed.
+// For a compressed file the start of each frame in the stream is kept too,
+// found one header at a time as reads go further into the file, so a read
+// decompresses only the frames it returns.
+struct open_file {
+    bool used = false;
+    bool stale = false;       // the entry was removed, the slot may hold another file now
+    std::string name;         // name of the entry, to see that it is still the same file
+    int dir_block;            // directory block and index of the entry
+    int index;
+    uint8_t mode;             // READ and/or WRITE
+    uint32_t pos;             // offset of the next read or write
+    block_list blocks;        // block i of the file, valid while stamp is FS::fat_stamp
+    std::vector<uint32_t> frames;  // stream offset of frame i, compressed files only, same stamp
+    uint64_t stamp;
+};
+
+// Read-ahead of file chains. After READ_AHEAD_STREAK reads that followed
+// the FAT the next window of the chain is read with one call per run of
+// adjacent blocks. The first block of each window triggers the next one, so
+// a sequential reader finds its blocks in memory. The window doubles while
+// all read-ahead blocks are used and halves when most of them are dropped.
+#define READ_AHEAD_STREAK 2
+#define READ_AHEAD_MIN 4
+#define READ_AHEAD_MAX 64
+
+struct read_ahead {
+    int next = -1;        // block that a sequential reader reads next
+    unsigned streak = 0;  // reads in a row that followed the chain
+    int trigger = -1;     // reading this block starts the next window
+    int last = -1;        // last block read ahead
+    unsigned window = READ_AHEAD_MIN;
+};
+
+// A directory tree copied by cp -r. All blocks of the copy are allocated
+// before any data is copied. The data blocks are then copied by a pool of
+// threads, each with a slice of adjacent jobs, and the directory blocks and
+// the FAT are written at the end of the command.
+#define COPY_SLICE 64  // data blocks per copy thread at least
+
+// Commands that move file data in bulk (import-tree, export-tree, cp -r)
+// hold at most this many blocks of it in memory at a time.
+#define STREAM_BLOCKS 256
+
+struct tree_plan {
+    std::vector<unsigned> from;   // data block from[i] is copied to to[i]
+    std::vector<unsigned> to;
+    std::map<int, int> clones;    // shared first blocks and their new references (dedup)
+    std::map<int, std::vector<dir_entry> > dirs;  // new directory blocks and their entries
+    std::set<int> sources;        // directory blocks of the source tree
+    bool share = false;           // every file is a clone, dedup or not (snapshots)
+};
+
+// A file or directory of a host tree that is imported. The whole tree is
+// scanned first, so the blocks of all files can be allocated as one run
+// and written with a few large writes.
+struct import_node {
+    std::string path;        // path on the host
+    std::string name;
+    bool dir;
+    int parent;              // index of the node of the parent directory, -1 for the top
+    uint32_t size;           // bytes of content, every line ends with a NUL like create does
+    bool inlined;            // stored in slots of the directory block
+    int block;               // first data block, or the directory block
+    std::vector<int> children;
+};
+
+// A directory opened by FS::opendir. The directory block is read once and
+// FS::readdir returns the entries in it, so a listing allocates nothing.
+struct dir_stream {
+    int block;               // the directory block
+    unsigned next;           // index of the next entry to look at
+    dir_entry entries[MAX_DIR_ENTRIES];
+};
+
+// counters for defrag, a step is a move from one block of a chain to the next
+struct defrag_stats {
+    unsigned files = 0;
+    unsigned steps = 0;      // block-to-block steps in all chains
+    unsigned breaks = 0;     // steps that are not to the adjacent block
+    unsigned moved = 0;      // files moved to a contiguous run
+    unsigned remaining = 0;  // breaks left after the files were moved
+};
+
 class FS {
 private:
+    // the messages of the calls go here, nullptr when the FS is silent
+    std::ostream *console;
     Disk disk;
+    Journal journal{JOURNAL_BLOCK, JOURNAL_BLOCKS, FAT_BLOCK};
     std::string working_directory = "..";
     // size of a FAT entry is 2 bytes
     int16_t fat[BLOCK_SIZE/2];
     //----------- OWN FUNCTIONS -----------
     int ReadFromFAT();
     int writeToFAT();
+    superblock super;
+    bool has_super = false;
+    int mount();
+    int writeSuper(bool clean);
+    unsigned countFreeBlocks();
     int findFreeBlock();
     uint16_t curr_blk = ROOT_BLOCK;
     int FindingFileEntry(std::string filepath, uint8_t newOrExisting, dir_info& dir, uint8_t access_rights);
     int FileEntry(int dir_block, std::string filepath, int& dir_index, dir_entry* dir_entries, uint8_t NewOrOld, uint8_t accessrights);
     int GetDirectoryBlock(std::string filepath, int& dir_block, uint8_t accessRights);
-    int get_file_string(std::string filepath,std::string &text);
-    int create_with_string(std::string filepath,std::string line);
-    int get_free_blocks(int* free_blocks,int amount_blocks,int start_block);
-    int write_block(std::string text, int block_amount, int* free_blocks);
-    int update_FAT(int* free_block, int block_amount);
     int get_dir_name(std::string path, std::string &name, std::string &absolute_path);
     void goHome();
     void removeTrailingSlash(std::string& str);
@@ -79,18 +326,95 @@ private:
     std::string getFileName(std::string filepath);
     std::string getDirPath(std::string dirpath);
     int dotdot_remover(std::string &dirpath);
+    bool compression = false;
+    int readerInit(chain_reader &reader, dir_entry &entry, dir_entry *dir_entries);
+    int readerNext(chain_reader &reader, char *data);
+    int readerBytes(chain_reader &reader, uint8_t *data, unsigned length);
+    int frameStart(open_file &handle, unsigned frame, uint32_t &start);
+    void writerInit(chain_writer &writer, bool compressed);
+    int writerOpen(chain_writer &writer, dir_entry &entry);
+    int writerPut(chain_writer &writer, const char *data, unsigned length);
+    int writerFinish(chain_writer &writer);
+    int writerBytes(chain_writer &writer, const uint8_t *data, unsigned length);
+    int writerFrame(chain_writer &writer);
+    int writerBlock(chain_writer &writer);
+    int writerStore(chain_writer &writer, dir_info &dir);
+    bool writerInline(chain_writer &writer, dir_info &dir, int &first_slot);
+    int readInline(dir_entry *dir_entries, dir_entry &entry, uint8_t *data);
+    void freeInline(dir_entry *dir_entries, dir_entry &entry);
+    int spillInline(int dir_block, dir_entry *dir_entries, int &index);
+    int inflateFile(dir_info &dir);
+    int writeRange(dir_info &dir, uint32_t offset, const char *data, uint32_t length, uint32_t new_size,
+                   block_list *blocks = nullptr);
+    int unshareChain(dir_entry &entry, unsigned last_index, block_list *blocks = nullptr);
+    open_file handles[MAX_OPEN_FILES];
+    uint64_t fat_stamp = 0;  // incremented every time the FAT is written
+    int handleEntry(int fd, dir_info &dir);
+    // the entry at 'index' of 'dir_block' is gone (-1: every entry of the block),
+    // its descriptors are made stale so a new entry in the slot is not used through them
+    void dropHandles(int dir_block, int index);
+    read_ahead ahead;
+    // temporaries of the command: chains, block lists and staging buffers
+    Arena arena;
+    // the trace the calls are recorded to, when one is being recorded
+    TraceWriter recorder;
+    int readBlock(int block, uint8_t *data);
+    bool dedup = false;
+    bool refcounts_changed = false;
+    // data blocks by the hash of their content and their successor in the chain
+    std::unordered_map<uint64_t, int> block_index;
+    std::vector<uint64_t> block_key = std::vector<uint64_t>(BLOCK_SIZE / 2);  // key of each indexed block, 0 if none
+    uint64_t blockKey(uint64_t hash, int next);
+    int buildIndex(int dir_block);
+    int findDuplicate(uint64_t key, int block, int next);
+    int dedupChain(chain_writer &writer);
+    void forgetBlock(int block);
+    void releaseChain(int block);
+    int getChain(int first_blk, block_list &chain);
+    int findFreeRun(int length);
+    int defragDir(int dir_block, std::string path, bool dry_run, defrag_stats &stats);
+    int treeDestination(std::string destpath, std::string source_name, int &parent, std::string &name);
+    int planTree(int dir_block, int new_block, int parent_block, tree_plan &plan);
+    int copyBlocks(tree_plan &plan);
+    int createFile(std::string filepath, const char *data, uint32_t length);
+    int walkTree(int dir_block, block_list &dirs, block_list &chains);
+    int scanHost(int node, std::vector<import_node> &nodes);
+    int readHost(import_node &node, uint32_t offset, uint32_t length, uint8_t *data);
+    int exportDir(int dir_block, std::string path, unsigned &files, unsigned &dirs);
+    int findSnapshot(const std::string &name);
+    int snapshotEntry(std::string path, dir_entry &entry);
+    std::vector<unsigned> snapshotRoots();
 public:
-    FS();
+    // 'console' gets the trace of the calls, the error messages and what
+    // cat, ls, pwd, df, fsck and defrag print. With nullptr nothing is printed
+    // or even formatted, and the results come from the calls that take a
+    // buffer or a report. The disk is the file 'diskfile' of the host, see
+    // volumes.h for several disks in one process.
+    FS(std::ostream *console = &std::cout, const std::string &diskfile = DISKNAME);
     ~FS();
+    // the console from now on, nullptr makes the FS silent
+    void set_console(std::ostream *console);
     // formats the disk, i.e., creates an empty file system
     int format();
     // create <filepath> creates a new file on the disk, the data content is
     // written on the following rows (ended with an empty row)
     int create(std::string filepath);
+    // creates a new file with 'length' bytes of 'data' as its content
+    int create(std::string filepath, const char *data, uint32_t length);
     // cat <filepath> reads the content of a file and prints it on the screen
     int cat(std::string filepath);
+    // writes the content of the file to 'out', every NUL as a line break
+    int cat(std::string filepath, std::ostream &out);
     // ls lists the content in the current directory (files and sub-directories)
     int ls();
+    // ls [-l] [dirpath] lists the directory sorted by name, the current one when
+    // 'dirpath' is empty. -l adds the first block, the blocks and the flags
+    int ls(std::string dirpath, bool long_format);
+    // opens the directory <dirpath> for readdir, the current one when it is empty
+    int opendir(std::string dirpath, dir_stream &dir);
+    // the next entry of the directory or nullptr after the last one, without
+    // ".." and the inline slots. It points into 'dir'.
+    const dir_entry *readdir(dir_stream &dir);
 
     // cp <sourcepath> <destpath> makes an exact copy of the file
     // <sourcepath> to a new file <destpath>
@@ -100,9 +424,42 @@ public:
     int mv(std::string sourcepath, std::string destpath);
     // rm <filepath> removes / deletes the file <filepath>
     int rm(std::string filepath);
+    // cp -r <sourcepath> <destpath> copies the directory <sourcepath> and all
+    // below it to <destpath>, or into <destpath> if that is a directory
+    int copy_tree(std::string sourcepath, std::string destpath);
+    // rm -r <dirpath> removes the directory <dirpath> and all below it
+    int remove_tree(std::string dirpath);
+    // the entry of the file or directory <path>, "/" is the root directory
+    int stat(std::string path, dir_entry &entry);
+    // the entries of the directory <dirpath>, without ".." and the inline slots
+    int list(std::string dirpath, std::vector<dir_entry> &entries);
+    // import-tree <hostdir> <fsdir> copies the directory <hostdir> of the host
+    // and all below it to <fsdir>, or into <fsdir> if that is a directory
+    int import_tree(std::string hostdir, std::string fsdir);
+    // export-tree <fsdir> <hostdir> copies the directory <fsdir> and all below
+    // it to the new directory <hostdir> of the host
+    int export_tree(std::string fsdir, std::string hostdir);
     // append <filepath1> <filepath2> appends the contents of file <filepath1> to
     // the end of file <filepath2>. The file <filepath1> is unchanged.
     int append(std::string filepath1, std::string filepath2);
+    // write <filepath> <offset> <data> writes 'length' bytes of 'data' at
+    // 'offset' in the file, only the blocks in the range are written
+    int write(std::string filepath, uint32_t offset, const char *data, uint32_t length);
+    // truncate <filepath> <length> cuts the file to 'length' bytes, or extends it with zeroes
+    int truncate(std::string filepath, uint32_t length);
+
+    // open <filepath> [r|w|rw] returns a file descriptor for the file, or -1.
+    // 'mode' is READ and/or WRITE, and is checked against the access rights
+    int open(std::string filepath, uint8_t mode);
+    // close <fd> gives the descriptor back
+    int close(int fd);
+    // reads up to 'length' bytes at the offset of the descriptor, returns the
+    // number of bytes read (0 at the end of the file) or -1
+    int read(int fd, char *data, uint32_t length);
+    // writes 'length' bytes at the offset of the descriptor, returns 'length' or -1
+    int write(int fd, const char *data, uint32_t length);
+    // seek <fd> <offset> sets the offset of the next read or write, returns it or -1
+    int seek(int fd, uint32_t offset);
 
     // mkdir <dirpath> creates a new sub-directory with the name <dirpath>
     // in the current directory
@@ -112,10 +469,56 @@ public:
     // pwd prints the full path, i.e., from the root directory, to the current
     // directory, including the current directory name
     int pwd();
+    // the path of the current directory
+    int pwd(std::string &path);
 
     // chmod <accessrights> <filepath> changes the access rights for the
     // file <filepath> to <accessrights>.
     int chmod(std::string accessrights, std::string filepath);
+
+    // sync writes all buffered blocks to the disk and waits until they are durable
+    int sync();
+    // the number of blocks of the disk and how many of them are free
+    void usage(unsigned &blocks, unsigned &free);
+    // the number of blocks read ahead of a sequential reader, see read_ahead
+    unsigned read_ahead_window() { return ahead.window; }
+    // df prints the size of the disk, the number of free blocks and the generation
+    int df();
+    // fsck [-r] checks the FAT against the directory tree, with -r orphan blocks
+    // are reclaimed and broken chains and sizes are repaired
+    int fsck(bool repair);
+    int fsck(bool repair, fsck_report &report);
+    // defrag [-n] moves every fragmented file to a contiguous run of blocks and
+    // reports the fragmentation per file and for the disk, -n only reports
+    int defrag(bool dry_run);
+    int defrag(bool dry_run, defrag_stats &stats);
+    // compress <on|off> selects if files created from now on are compressed,
+    // compressed files are read and copied like any other file
+    int set_compression(bool on);
+    // dedup <on|off> selects if identical blocks are shared between files, from
+    // now on new files share their identical tail blocks and cp makes a clone
+    int set_dedup(bool on);
+    // durability <block|command|group> [ms] [blocks] selects when written blocks
+    // are made durable, see FLUSH_* in disk.h
+    int set_durability(int policy, unsigned group_ms = GROUP_COMMIT_MS, unsigned group_blocks = GROUP_COMMIT_BLOCKS);
+    // snapshot <name> freezes the whole tree under <name>. Directories are
+    // copied, files share their blocks until either side changes them.
+    // "@<name>/<path>" reaches the snapshot in ls, stat and export-tree.
+    int snapshot(std::string name);
+    // snapshots lists the snapshots with their generation and time
+    int snapshots();
+    int snapshots(std::vector<snapshot_entry> &list);
+    // snapshot-rm <name> removes the snapshot, the blocks only it used are freed
+    int snapshot_rm(std::string name);
+    // export-delta <since-gen> <hostfile> writes the blocks changed since the
+    // delta of generation <since-gen> to <hostfile>, 0 writes every used block
+    int export_delta(uint64_t since, std::string hostfile);
+    // apply-delta <hostfile> writes the blocks of a delta to this disk, which
+    // must be at the generation the delta was exported from
+    int apply_delta(std::string hostfile);
+    // record <tracefile|off> records every call, its arguments and how long it
+    // took to <tracefile>, see trace.h. An empty name stops the recording.
+    int record(std::string tracefile);
 };
 
 #endif // __FS_H__
@@ -0,0 +1,372 @@
+/**
+ * @file fsck.cpp
+ * @brief Consistency check of the FAT and the directory tree
+ *
+ * Every block gets an owner in a reachability map: the reserved blocks, the
+ * directory that is stored in it, or the file entry whose chain runs through
+ * it. The owner is claimed with a compare-and-swap, so the worker threads
+ * need no lock for the map, and a claim that fails tells that the block is
+ * reached twice: by the same chain (a cycle) or by another one (cross-link).
+ * A block with a reference count (dedup) may be reached by several chains,
+ * the chains that join it are counted and compared with the count. An inline
+ * file owns no block, only the slots of its directory block are checked.
+ */
+
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <memory>
+#include <vector>
+#include "fsck.h"
+#include "fs.h"
+
+#define OWNER_NONE 0
+#define OWNER_RESERVED 0xffffffff
+
+namespace {
+
+struct fsck_fix {
+    unsigned dir_block;  // directory block with the entry to fix
+    unsigned index;      // index of the entry in the block
+    bool remove;         // the chain has no valid block, the entry is removed
+    int cut_block;       // block that becomes the end of the chain, -1 if none
+    bool free_tail;      // the blocks after the cut are reclaimed
+    uint32_t size;       // new size of the file
+};
+
+class FsckWalk {
+public:
+    Disk &disk;
+    int16_t *fat;
+    uint8_t *refcount;
+    unsigned no_blocks;
+    unsigned first_data_block;
+    std::unique_ptr<std::atomic<uint32_t>[]> owner;
+    std::unique_ptr<std::atomic<uint32_t>[]> joined;  // chains that joined a shared block
+
+    std::mutex lock;
+    std::condition_variable wakeup;
+    std::vector<unsigned> queue;   // directory blocks left to scan
+    unsigned active = 0;           // workers scanning a directory block
+    int status = 0;
+
+    std::atomic<unsigned> files, dirs, bad_chains, cross_linked, size_mismatch, orphan_slots;
+    std::vector<fsck_fix> fixes;
+
+    FsckWalk(Disk &d, int16_t *f, uint8_t *r, unsigned first_data)
+        : disk(d), fat(f), refcount(r), no_blocks(d.get_no_blocks()), first_data_block(first_data),
+          owner(new std::atomic<uint32_t>[d.get_no_blocks()]),
+          joined(new std::atomic<uint32_t>[d.get_no_blocks()]),
+          files(0), dirs(0), bad_chains(0), cross_linked(0), size_mismatch(0), orphan_slots(0)
+    {
+        for (unsigned i = 0; i < no_blocks; i++) {
+            owner[i].store(OWNER_NONE);
+            joined[i].store(0);
+        }
+    }
+
+    bool claim(unsigned block, uint32_t tag, uint32_t &previous)
+    {
+        previous = OWNER_NONE;
+        return owner[block].compare_exchange_strong(previous, tag);
+    }
+
+    void add_fix(const fsck_fix &fix)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        fixes.push_back(fix);
+    }
+
+    void push_dir(unsigned block)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        queue.push_back(block);
+        wakeup.notify_one();
+    }
+
+    void check_file(unsigned dir_block, unsigned index, dir_entry &entry)
+    {
+        uint32_t tag = dir_block * MAX_DIR_ENTRIES + index + 1;
+        unsigned needed = entry.size ? (entry.size + BLOCK_SIZE - 1) / BLOCK_SIZE : 1;
+        fsck_fix fix = { dir_block, index, false, -1, false, entry.size };
+        int block = entry.first_blk;
+        int previous_block = -1;
+        int last_needed = -1;
+        unsigned length = 0;
+        bool shared = false;  // the rest of the chain is walked by the chain that claimed it
+
+        while (block != FAT_EOF) {
+            if (block < (int)first_data_block || block >= (int)no_blocks || fat[block] == FAT_FREE) {
+                // pointer out of the data area, or into a free block
+                if (shared)
+                    return;
+                bad_chains++;
+                fix.remove = previous_block < 0;
+                fix.cut_block = previous_block;
+                fix.size = std::min<uint32_t>(entry.size, length * BLOCK_SIZE);
+                add_fix(fix);
+                return;
+            }
+            if (shared) {
+                if (length >= no_blocks) {
+                    // a cycle, reported by the chain that claimed the blocks
+                    return;
+                }
+                length++;
+                block = fat[block];
+                continue;
+            }
+            uint32_t previous_owner;
+            if (!claim(block, tag, previous_owner)) {
+                if (previous_owner != tag && refcount && refcount[block] > 0) {
+                    // a tail shared with other files, it is only walked for the length
+                    joined[block]++;
+                    shared = true;
+                    continue;
+                }
+                cross_linked++;
+                if (previous_owner == tag) {
+                    // the chain loops back into itself
+                    fix.cut_block = previous_block;
+                    fix.size = std::min<uint32_t>(entry.size, length * BLOCK_SIZE);
+                    add_fix(fix);
+                }
+                // a block shared with another chain is only reported
+                return;
+            }
+            length++;
+            if (length == needed + 1)
+                last_needed = block;
+            previous_block = block;
+            block = fat[block];
+        }
+
+        // the chain of a compressed file is shorter than its size, only the links are checked
+        if (entry.type & TYPE_COMPRESSED)
+            return;
+        // a chain may hold one more block than the size needs, for the terminating NUL
+        if ((uint64_t)length * BLOCK_SIZE < entry.size) {
+            size_mismatch++;
+            fix.size = length * BLOCK_SIZE;
+            add_fix(fix);
+        }
+        else if (length > needed + 1) {
+            size_mismatch++;
+            if (shared)
+                return;
+            fix.cut_block = last_needed;
+            fix.free_tail = true;
+            add_fix(fix);
+        }
+    }
+
+    // an inline file owns no blocks, its slots are checked within the directory block
+    void check_inline(unsigned dir_block, unsigned index, dir_entry *entries, bool *claimed)
+    {
+        dir_entry &entry = entries[index];
+        unsigned slot = entry.first_blk;
+        for (uint32_t pos = 0; pos < entry.size; pos += INLINE_DATA) {
+            inline_slot *data = (inline_slot*)&entries[slot < MAX_DIR_ENTRIES ? slot : 0];
+            if (entry.size > INLINE_MAX || slot >= MAX_DIR_ENTRIES || data->marker != INLINE_SLOT || claimed[slot]) {
+                bad_chains++;
+                fsck_fix fix = { dir_block, index, true, -1, false, 0 };
+                add_fix(fix);
+                return;
+            }
+            claimed[slot] = true;
+            slot = (uint8_t)data->next;
+        }
+    }
+
+    void check_dir(unsigned dir_block, unsigned index, dir_entry &entry)
+    {
+        unsigned block = entry.first_blk;
+        fsck_fix fix = { dir_block, index, true, -1, false, 0 };
+        if (block < first_data_block || block >= no_blocks || fat[block] == FAT_FREE) {
+            bad_chains++;
+            add_fix(fix);
+            return;
+        }
+        uint32_t previous_owner;
+        if (!claim(block, dir_block * MAX_DIR_ENTRIES + index + 1, previous_owner)) {
+            // the directory block is in use by something else, don't walk it twice
+            cross_linked++;
+            return;
+        }
+        if (fat[block] != FAT_EOF) {
+            // a directory is one block, the rest of the chain is reclaimed as orphans
+            bad_chains++;
+            fix.remove = false;
+            fix.cut_block = block;
+            add_fix(fix);
+        }
+        push_dir(block);
+    }
+
+    void scan_dir(unsigned block)
+    {
+        dir_entry entries[MAX_DIR_ENTRIES];
+        if (disk.read(block, (uint8_t*)entries)) {
+            std::lock_guard<std::mutex> guard(lock);
+            status = -1;
+            return;
+        }
+        dirs++;
+        bool claimed[MAX_DIR_ENTRIES] = { false };  // slots that belong to an inline file
+        for (unsigned i = 0; i < MAX_DIR_ENTRIES; i++) {
+            if (entries[i].file_name[0] == 0 || entries[i].file_name[0] == INLINE_SLOT
+                || strcmp(entries[i].file_name, PARENT_DIR.c_str()) == 0)
+                continue;
+            if ((entries[i].type & TYPE_MASK) == TYPE_DIR)
+                check_dir(block, i, entries[i]);
+            else if (entries[i].type & TYPE_INLINE) {
+                files++;
+                check_inline(block, i, entries, claimed);
+            }
+            else {
+                files++;
+                check_file(block, i, entries[i]);
+            }
+        }
+        // slots left behind by an inline file that is gone are cleared like orphans
+        for (unsigned i = 1; i < MAX_DIR_ENTRIES; i++) {
+            if (entries[i].file_name[0] == INLINE_SLOT && !claimed[i]) {
+                orphan_slots++;
+                fsck_fix fix = { block, i, true, -1, false, 0 };
+                add_fix(fix);
+            }
+        }
+    }
+
+    void worker()
+    {
+        for (;;) {
+            unsigned block;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                wakeup.wait(guard, [this] { return !queue.empty() || active == 0; });
+                if (queue.empty())
+                    return;
+                block = queue.back();
+                queue.pop_back();
+                active++;
+            }
+            scan_dir(block);
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                active--;
+                if (active == 0 && queue.empty())
+                    wakeup.notify_all();
+            }
+        }
+    }
+};
+
+} // namespace
+
+int fsck_check(Disk &disk, int16_t *fat, uint8_t *refcount, bool repair, fsck_report &report, unsigned workers,
+               const std::vector<unsigned> &snapshots)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    report = fsck_report();
+
+    FsckWalk walk(disk, fat, refcount, FIRST_DATA_BLOCK);
+    for (unsigned i = 0; i < walk.first_data_block; i++)
+        walk.owner[i].store(OWNER_RESERVED);
+
+    if (workers == 0)
+        workers = std::thread::hardware_concurrency();
+    if (workers == 0)
+        workers = 1;
+    walk.queue.push_back(ROOT_BLOCK);
+    for (unsigned i = 0; i < snapshots.size(); i++) {
+        // the root of a snapshot is a directory block that no entry points to
+        uint32_t previous;
+        if (snapshots[i] >= walk.first_data_block && snapshots[i] < walk.no_blocks &&
+            fat[snapshots[i]] != FAT_FREE && walk.claim(snapshots[i], OWNER_RESERVED, previous))
+            walk.queue.push_back(snapshots[i]);
+    }
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < workers; i++)
+        threads.push_back(std::thread(&FsckWalk::worker, &walk));
+    walk.worker();
+    for (unsigned i = 0; i < threads.size(); i++)
+        threads[i].join();
+    if (walk.status)
+        return walk.status;
+
+    report.files = walk.files;
+    report.dirs = walk.dirs;
+    report.bad_chains = walk.bad_chains;
+    report.cross_linked = walk.cross_linked;
+    report.size_mismatch = walk.size_mismatch;
+    report.orphan_blocks = walk.orphan_slots;
+
+    if (repair) {
+        for (unsigned i = 0; i < walk.fixes.size(); i++) {
+            fsck_fix &fix = walk.fixes[i];
+            if (fix.cut_block >= 0) {
+                if (fix.free_tail) {
+                    // the rest of the chain becomes orphans and is reclaimed below
+                    uint32_t tag = fix.dir_block * MAX_DIR_ENTRIES + fix.index + 1;
+                    int block = fat[fix.cut_block];
+                    while (block >= 0 && block < (int)walk.no_blocks && walk.owner[block].load() == tag) {
+                        walk.owner[block].store(OWNER_NONE);
+                        block = fat[block];
+                    }
+                }
+                fat[fix.cut_block] = FAT_EOF;
+            }
+            dir_entry entries[MAX_DIR_ENTRIES];
+            if (disk.read(fix.dir_block, (uint8_t*)entries))
+                return -1;
+            if (fix.remove)
+                memset(&entries[fix.index], 0, sizeof(dir_entry));
+            else
+                entries[fix.index].size = fix.size;
+            if (disk.write_meta(fix.dir_block, (uint8_t*)entries))
+                return -1;
+            report.repaired++;
+        }
+    }
+
+    for (unsigned i = 0; i < walk.no_blocks; i++) {
+        if (walk.owner[i].load() != OWNER_NONE) {
+            report.used_blocks++;
+        }
+        else if (fat[i] != FAT_FREE) {
+            report.orphan_blocks++;
+            if (repair) {
+                fat[i] = FAT_FREE;
+                disk.trim(i);
+                report.repaired++;
+            }
+        }
+        // every chain that joined a block after the first is one reference
+        uint32_t references = std::min<uint32_t>(walk.joined[i].load(), MAX_REFCOUNT);
+        if (refcount && refcount[i] != references) {
+            report.bad_refcounts++;
+            if (repair) {
+                refcount[i] = references;
+                report.repaired++;
+            }
+        }
+    }
+
+    report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return 0;
+}
+
+void fsck_print(fsck_report &report, std::ostream &out)
+{
+    out << "Files \t Dirs \t Used blocks \t Orphans \t Bad chains \t Cross-linked \t Size mismatch \t Refcounts " << std::endl;
+    out << report.files << "\t " << report.dirs << "\t " << report.used_blocks << "\t\t "
+        << report.orphan_blocks << "\t\t " << report.bad_chains << "\t\t " << report.cross_linked
+        << "\t\t " << report.size_mismatch << "\t\t " << report.bad_refcounts << std::endl;
+    out << report.repaired << " repairs, " << report.seconds * 1000 << " ms" << std::endl;
+}
@@ -0,0 +1,45 @@
+/**
+ * @file fsck.h
+ * @brief Consistency check of the FAT and the directory tree
+ *
+ * The directory tree is walked by a pool of worker threads, one directory
+ * block at a time. Every chain that is followed is counted in a reachability
+ * map, which is compared with the FAT when the walk is done.
+ */
+
+#include <cstdint>
+#include <ostream>
+#include <vector>
+#include "disk.h"
+
+#ifndef __FSCK_H__
+#define __FSCK_H__
+
+struct fsck_report {
+    unsigned files = 0;          // file entries found in the tree
+    unsigned dirs = 0;           // directories found in the tree, the root included
+    unsigned used_blocks = 0;    // blocks reachable from the tree or reserved
+    unsigned orphan_blocks = 0;  // allocated in the FAT but not reachable, or inline slots without a file
+    unsigned bad_chains = 0;     // chains with invalid pointers or that run into free blocks
+    unsigned cross_linked = 0;   // blocks reached by more than one chain, or chains with cycles
+    unsigned size_mismatch = 0;  // files whose size does not match the length of the chain
+    unsigned bad_refcounts = 0;  // blocks whose reference count does not match the chains sharing them
+    unsigned repaired = 0;       // number of repairs made
+    double seconds = 0;          // time spent
+};
+
+// Checks the file system in 'fat' and on 'disk'. With 'repair' set, orphan
+// blocks are reclaimed, broken chains are cut at the last valid block and
+// sizes are adjusted to the chains; the FAT and 'refcount' (the extra
+// references of shared blocks, nullptr if there are none) are modified in
+// memory and fixed directory blocks are written with Disk::write_meta.
+// 'workers' = 0 uses one thread per core. 'snapshots' are the root blocks of
+// the snapshots, walked like the root directory. Returns 0 when the walk
+// succeeded, whatever was found.
+int fsck_check(Disk &disk, int16_t *fat, uint8_t *refcount, bool repair, fsck_report &report, unsigned workers = 0,
+               const std::vector<unsigned> &snapshots = std::vector<unsigned>());
+
+// prints the report the way the shell shows it
+void fsck_print(fsck_report &report, std::ostream &out);
+
+#endif // __FSCK_H__
@@ -0,0 +1,15 @@
+#include <iostream>
+#include <cstring>
+#include "fs.h"
+
+// fsck [-r] checks diskfile.bin without starting the shell, with -r it is repaired
+int
+main(int argc, char **argv)
+{
+    if (argc > 2 || (argc == 2 && strcmp(argv[1], "-r") != 0)) {
+        std::cout << "Usage: fsck [-r]\n";
+        return 2;
+    }
+    FS filesystem;
+    return filesystem.fsck(argc == 2) ? 1 : 0;
+}
@@ -0,0 +1,308 @@
+/**
+ * @file fuse_main.cpp
+ * @brief Mounts diskfile.bin with FUSE, so that any program can use the file system
+ *
+ * Built with libfuse3 (make fusefs). Requests are handled by the multi-threaded
+ * loop of fuse_main. The FS is not thread safe, so the calls into it are made
+ * one at a time under a lock; decoding the requests and copying the data to
+ * and from the kernel still overlap. The kernel may keep the pages of a file
+ * between opens (keep_cache) and names and attributes for FUSE_TIMEOUT
+ * seconds, as all changes go through this mount. Write requests are taken
+ * with splice when the kernel offers it. The FS runs without a console, its
+ * status codes are mapped to errno values.
+ */
+
+#define FUSE_USE_VERSION 31
+
+#include <fuse.h>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "fs.h"
+
+// seconds the kernel may cache names and attributes
+#define FUSE_TIMEOUT 1.0
+
+namespace {
+
+FS *filesystem;
+std::mutex fs_lock;
+
+// the negated errno of a status of the FS, a count is passed on
+int to_errno(int status)
+{
+    switch (status) {
+    case FS_ENOENT: return -ENOENT;
+    case FS_EEXIST: return -EEXIST;
+    case FS_EACCES: return -EACCES;
+    case FS_ENOTDIR: return -ENOTDIR;
+    case FS_EISDIR: return -EISDIR;
+    case FS_ENOSPC: return -ENOSPC;
+    case FS_EDIRFULL: return -ENOSPC;
+    case FS_ENAME: return -ENAMETOOLONG;
+    case FS_EFBIG: return -EFBIG;
+    case FS_EBADF: return -EBADF;
+    case FS_EMFILE: return -EMFILE;
+    case FS_ESTALE: return -ESTALE;
+    case FS_EBUSY: return -EBUSY;
+    case FS_EINVAL: return -EINVAL;
+    }
+    return status < 0 ? -EIO : status;
+}
+
+void to_stat(const dir_entry &entry, struct stat *st)
+{
+    memset(st, 0, sizeof(*st));
+    // READ, WRITE and EXECUTE are the rwx bits of the owner
+    mode_t rights = (entry.access_rights & (READ | WRITE | EXECUTE)) << 6;
+    if (entry.type == TYPE_DIR) {
+        st->st_mode = S_IFDIR | rights;
+        st->st_nlink = 2;
+        st->st_size = BLOCK_SIZE;
+    }
+    else {
+        st->st_mode = S_IFREG | rights;
+        st->st_nlink = 1;
+        st->st_size = entry.size;
+    }
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    st->st_blksize = BLOCK_SIZE;
+    st->st_blocks = (st->st_size + 511) / 512;
+}
+
+int fs_getattr(const char *path, struct stat *st, struct fuse_file_info *fi)
+{
+    std::lock_guard<std::mutex> guard(fs_lock);
+    dir_entry entry;
+    int status = filesystem->stat(path, entry);
+    if (status)
+        return to_errno(status);
+    to_stat(entry, st);
+    return 0;
+}
+
+int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+               struct fuse_file_info *fi, enum fuse_readdir_flags flags)
+{
+    std::lock_guard<std::mutex> guard(fs_lock);
+    dir_stream dir;
+    int status = filesystem->opendir(path, dir);
+    if (status)
+        return to_errno(status);
+    filler(buf, ".", nullptr, 0, (enum fuse_fill_dir_flags)0);
+    filler(buf, "..", nullptr, 0, (enum fuse_fill_dir_flags)0);
+    for (const dir_entry *entry = filesystem->readdir(dir); entry; entry = filesystem->readdir(dir)) {
+        struct stat st;
+        to_stat(*entry, &st);
+        filler(buf, entry->file_name, &st, 0, FUSE_FILL_DIR_PLUS);
+    }
+    return 0;
+}
+
+int open_fd(const char *path, struct fuse_file_info *fi)
+{
+    uint8_t mode = 0;
+    int access = fi->flags & O_ACCMODE;
+    if (access == O_RDONLY || access == O_RDWR)
+        mode |= READ;
+    if (access == O_WRONLY || access == O_RDWR)
+        mode |= WRITE;
+    int fd = filesystem->open(path, mode);
+    if (fd < 0)
+        return to_errno(fd);
+    fi->fh = fd;
+    fi->keep_cache = 1;
+    return 0;
+}
+
+int fs_open(const char *path, struct fuse_file_info *fi)
+{
+    std::lock_guard<std::mutex> guard(fs_lock);
+    dir_entry entry;
+    int status = filesystem->stat(path, entry);
+    if (status)
+        return to_errno(status);
+    if (entry.type == TYPE_DIR)
+        return -EISDIR;
+    if (fi->flags & O_TRUNC) {
+        status = filesystem->truncate(path, 0);
+        if (status)
+            return to_errno(status);
+    }
+    return open_fd(path, fi);
+}
+
+int fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    std::lock_guard<std::mutex> guard(fs_lock);
+    dir_entry entry;
+    if (filesystem->stat(path, entry) == 0)
+        return -EEXIST;
+    int status = filesystem->create(path, "", 0);
+    if (status == FS_OK)
+        status = filesystem->chmod(std::to_string((mode >> 6) & 7), path);
+    if (status)
+        return to_errno(status);
+    return open_fd(path, fi);
+}
+
+int fs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    std::lock_guard<std::mutex> guard(fs_lock);
+    if (offset > UINT32_MAX)
+        return 0;
+    int status = filesystem->seek(fi->fh, offset);
+    if (status < 0)
+        return to_errno(status);
+    return to_errno(filesystem->read(fi->fh, buf, size));
+}
+
+int fs_write_buf(const char *path, struct fuse_bufvec *bufv, off_t offset, struct fuse_file_info *fi)
+{
+    // the data may be in a pipe (splice), it is copied out before the FS is locked
+    size_t size = fuse_buf_size(bufv);
+    std::vector<char> data(size);
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+    dst.buf[0].mem = data.data();
+    ssize_t copied = fuse_buf_copy(&dst, bufv, (enum fuse_buf_copy_flags)0);
+    if (copied < 0)
+        return copied;
+    if ((uint64_t)offset + copied > UINT32_MAX)
+        return -EFBIG;
+
+    std::lock_guard<std::mutex> guard(fs_lock);
+    int status = filesystem->seek(fi->fh, offset);
+    if (status < 0)
+        return to_errno(status);
+    return to_errno(filesystem->write(fi->fh, data.data(), copied));
+}
+
+int fs_truncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+    std::lock_guard<std::mutex> guard(fs_lock);
+    if (size > UINT32_MAX)
+        return -EFBIG;
+    return to_errno(filesystem->truncate(path, size));
+}
+
+int fs_unlink(const char *path)
+{
+    std::lock_guard<std::mutex> guard(fs_lock);
+    return to_errno(filesystem->rm(path));
+}
+
+int fs_mkdir(const char *path, mode_t mode)
+{
+    std::lock_guard<std::mutex> guard(fs_lock);
+    return to_errno(filesystem->mkdir(path));
+}
+
+int fs_rmdir(const char *path)
+{
+    std::lock_guard<std::mutex> guard(fs_lock);
+    dir_stream dir;
+    int status = filesystem->opendir(path, dir);
+    if (status)
+        return to_errno(status);
+    if (filesystem->readdir(dir))
+        return -ENOTEMPTY;
+    return to_errno(filesystem->remove_tree(path));
+}
+
+int fs_chmod(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    std::lock_guard<std::mutex> guard(fs_lock);
+    return to_errno(filesystem->chmod(std::to_string((mode >> 6) & 7), path));
+}
+
+int fs_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info *fi)
+{
+    // the FS keeps no times
+    return 0;
+}
+
+int fs_release(const char *path, struct fuse_file_info *fi)
+{
+    std::lock_guard<std::mutex> guard(fs_lock);
+    filesystem->close(fi->fh);
+    return 0;
+}
+
+int fs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    std::lock_guard<std::mutex> guard(fs_lock);
+    return to_errno(filesystem->sync());
+}
+
+int fs_statfs(const char *path, struct statvfs *st)
+{
+    std::lock_guard<std::mutex> guard(fs_lock);
+    unsigned blocks, free;
+    filesystem->usage(blocks, free);
+    memset(st, 0, sizeof(*st));
+    st->f_bsize = BLOCK_SIZE;
+    st->f_frsize = BLOCK_SIZE;
+    st->f_blocks = blocks;
+    st->f_bfree = free;
+    st->f_bavail = free;
+    st->f_namemax = 55;
+    return 0;
+}
+
+void *fs_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+    cfg->entry_timeout = FUSE_TIMEOUT;
+    cfg->attr_timeout = FUSE_TIMEOUT;
+    cfg->negative_timeout = 0;
+    // write requests are moved from /dev/fuse with splice, without a copy in user space
+    unsigned splice = FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE;
+    conn->want |= conn->capable & splice;
+    return nullptr;
+}
+
+void fs_destroy(void *private_data)
+{
+    std::lock_guard<std::mutex> guard(fs_lock);
+    filesystem->sync();
+}
+
+} // namespace
+
+// fusefs <mountpoint> [FUSE options] mounts diskfile.bin of the current directory
+int
+main(int argc, char **argv)
+{
+    if (argc < 2) {
+        std::cout << "Usage: fusefs <mountpoint> [FUSE options]\n";
+        return 2;
+    }
+    FS fs(nullptr);
+    filesystem = &fs;
+
+    struct fuse_operations ops;
+    memset(&ops, 0, sizeof(ops));
+    ops.getattr = fs_getattr;
+    ops.readdir = fs_readdir;
+    ops.open = fs_open;
+    ops.create = fs_create;
+    ops.read = fs_read;
+    ops.write_buf = fs_write_buf;
+    ops.truncate = fs_truncate;
+    ops.unlink = fs_unlink;
+    ops.mkdir = fs_mkdir;
+    ops.rmdir = fs_rmdir;
+    ops.chmod = fs_chmod;
+    ops.utimens = fs_utimens;
+    ops.release = fs_release;
+    ops.fsync = fs_fsync;
+    ops.statfs = fs_statfs;
+    ops.init = fs_init;
+    ops.destroy = fs_destroy;
+    return fuse_main(argc, argv, &ops, nullptr);
+}
@@ -0,0 +1,204 @@
+/**
+ * @file journal.cpp
+ * @brief Write-ahead journal for metadata blocks (FAT and directory blocks)
+ *
+ * Commit order of a transaction:
+ *   1. the header and the logged blocks are written to the journal region in
+ *      one sequential write, followed by a barrier (fdatasync)
+ *   2. the blocks are written to their home locations, followed by a barrier
+ *   3. the header is cleared (count = 0)
+ * A crash before 1 is complete leaves a header with a bad checksum, and the
+ * transaction is discarded at mount. A crash after 1 is replayed at mount.
+ * The blocks that do not fit in the region are part of the write in 1, at
+ * free blocks of the disk, so a transaction of any size is atomic.
+ */
+
+#include <iostream>
+#include <cstring>
+#include "journal.h"
+
+static uint32_t crc_table[256];
+
+static void crc32_init()
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t len)
+{
+    if (crc_table[1] == 0)
+        crc32_init();
+    for (size_t i = 0; i < len; i++)
+        crc = crc_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+uint32_t Journal::checksum(journal_header &header, std::vector<uint8_t*> &blocks)
+{
+    uint32_t crc = 0xffffffff;
+    crc = crc32_update(crc, (uint8_t*)&header.sequence, sizeof(header.sequence));
+    crc = crc32_update(crc, (uint8_t*)&header.count, sizeof(header.count));
+    crc = crc32_update(crc, (uint8_t*)header.slots, header.count * sizeof(journal_slot));
+    for (unsigned i = 0; i < blocks.size(); i++)
+        crc = crc32_update(crc, blocks[i], BLOCK_SIZE);
+    return crc ^ 0xffffffff;
+}
+
+// marks the journal as clean, i.e. there is nothing to replay
+int Journal::clear(Disk &disk)
+{
+    journal_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = JOURNAL_MAGIC;
+    header.sequence = sequence;
+    return disk.write_through(first_block, (uint8_t*)&header);
+}
+
+int Journal::format(Disk &disk)
+{
+    return clear(disk);
+}
+
+int Journal::replay(Disk &disk)
+{
+    journal_header header;
+    int status = disk.read_through(first_block, (uint8_t*)&header);
+    if (status)
+        return status;
+    if (header.magic != JOURNAL_MAGIC)
+        return JOURNAL_NONE;
+    sequence = header.sequence;
+    if (header.count == 0)
+        return 0;
+    if (header.count > JOURNAL_SLOTS) {
+        std::cout << "Journal: invalid transaction " << header.sequence << ", discarding it\n";
+        return clear(disk);
+    }
+
+    std::vector<std::vector<uint8_t> > data(header.count, std::vector<uint8_t>(BLOCK_SIZE));
+    std::vector<uint8_t*> blocks;
+    for (unsigned i = 0; i < header.count; i++) {
+        unsigned location = header.slots[i].location ? header.slots[i].location : first_block + 1 + i;
+        if (location >= disk.get_no_blocks() || header.slots[i].target >= disk.get_no_blocks()) {
+            std::cout << "Journal: invalid transaction " << header.sequence << ", discarding it\n";
+            return clear(disk);
+        }
+        status = disk.read_through(location, data[i].data());
+        if (status)
+            return status;
+        blocks.push_back(data[i].data());
+    }
+    if (checksum(header, blocks) != header.checksum) {
+        // the crash happened while the transaction was logged, the home
+        // locations are untouched and the transaction never happened
+        std::cout << "Journal: incomplete transaction " << header.sequence << ", discarding it\n";
+        return clear(disk);
+    }
+
+    std::cout << "Journal: replaying transaction " << header.sequence << " (" << header.count << " blocks)\n";
+    for (unsigned i = 0; i < header.count; i++) {
+        status = disk.write_through(header.slots[i].target, blocks[i]);
+        if (status)
+            return status;
+    }
+    status = disk.barrier();
+    if (status)
+        return status;
+    return clear(disk);
+}
+
+// finds 'count' blocks for the part of a transaction that does not fit in
+// the region. They are free in the FAT on the disk and in the FAT of the
+// transaction (a free entry is 0), so neither the state before the
+// transaction nor the state after it has anything in them.
+int Journal::overflow(Disk &disk, std::map<unsigned, std::vector<uint8_t> > &blocks, unsigned count,
+                      std::vector<unsigned> &spare)
+{
+    int16_t before[BLOCK_SIZE / 2];
+    int status = disk.read_through(fat_block, (uint8_t*)before);
+    if (status)
+        return status;
+    std::map<unsigned, std::vector<uint8_t> >::iterator it = blocks.find(fat_block);
+    const int16_t *after = it == blocks.end() ? before : (const int16_t*)it->second.data();
+    for (unsigned b = 0; b < BLOCK_SIZE / 2 && b < disk.get_no_blocks() && spare.size() < count; b++) {
+        if (before[b] == 0 && after[b] == 0 && !blocks.count(b))
+            spare.push_back(b);
+    }
+    if (spare.size() < count) {
+        std::cout << "Journal: no free blocks to log a transaction of " << blocks.size() << " blocks\n";
+        return -1;
+    }
+    return 0;
+}
+
+int Journal::log(Disk &disk, std::map<unsigned, std::vector<uint8_t> > &blocks, std::vector<unsigned> &spare)
+{
+    spare.clear();
+    if (blocks.size() > JOURNAL_SLOTS) {
+        std::cout << "Journal: a transaction of " << blocks.size() << " blocks is larger than the journal\n";
+        return -1;
+    }
+    if (blocks.size() > capacity()) {
+        int status = overflow(disk, blocks, blocks.size() - capacity(), spare);
+        if (status)
+            return status;
+    }
+    journal_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = JOURNAL_MAGIC;
+    header.sequence = ++sequence;
+    std::vector<uint8_t*> logged;
+    for (std::map<unsigned, std::vector<uint8_t> >::iterator it = blocks.begin(); it != blocks.end(); ++it) {
+        journal_slot &slot = header.slots[header.count];
+        slot.target = it->first;
+        slot.location = header.count < capacity() ? 0 : spare[header.count - capacity()];
+        header.count++;
+        logged.push_back(it->second.data());
+    }
+    header.checksum = checksum(header, logged);
+
+    // header and blocks in one write, sequential as far as the region goes
+    std::map<unsigned, std::vector<uint8_t> > log;
+    log[first_block].assign((uint8_t*)&header, (uint8_t*)&header + BLOCK_SIZE);
+    for (unsigned i = 0; i < logged.size(); i++) {
+        unsigned location = header.slots[i].location ? header.slots[i].location : first_block + 1 + i;
+        log[location].assign(logged[i], logged[i] + BLOCK_SIZE);
+    }
+    int status = disk.write_blocks(log);
+    if (status)
+        return status;
+    return disk.barrier();
+}
+
+int Journal::commit(Disk &disk, std::map<unsigned, std::vector<uint8_t> > &blocks)
+{
+    if (blocks.empty())
+        return 0;
+    // 1. header and blocks, all of them under the one header
+    std::vector<unsigned> spare;
+    int status = log(disk, blocks, spare);
+    if (status)
+        return status;
+
+    // 2. checkpoint to the home locations
+    status = disk.write_blocks(blocks);
+    if (status)
+        return status;
+    status = disk.barrier();
+    if (status)
+        return status;
+
+    // 3. nothing left to replay
+    status = clear(disk);
+    if (status)
+        return status;
+    // the free blocks that held the overflow are punched out again
+    for (unsigned i = 0; i < spare.size(); i++)
+        disk.trimmed.insert(spare[i]);
+    return 0;
+}
@@ -0,0 +1,67 @@
+/**
+ * @file journal.h
+ * @brief Write-ahead journal for metadata blocks (FAT and directory blocks)
+ *
+ * The journal is a reserved region of the disk. Its first block is a header
+ * that describes the transaction; the following blocks hold copies of the
+ * metadata blocks. A transaction is logged with one sequential write, made
+ * durable, and only then written to the home locations of the blocks.
+ *
+ * A transaction with more blocks than the region holds logs the rest in
+ * blocks that are free in the FAT on the disk and in the FAT being committed,
+ * so a crash at any point leaves either the whole transaction or none of it.
+ */
+
+#include <cstdint>
+#include <map>
+#include <vector>
+#include "disk.h"
+
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#define JOURNAL_MAGIC 0x4a524e4c // "JRNL"
+#define JOURNAL_NONE 1           // returned by replay() when the disk has no journal
+
+struct journal_slot {
+    uint16_t target;    // home block number of the logged block
+    uint16_t location;  // where it is logged, 0 for block i + 1 of the region
+};
+
+#define JOURNAL_SLOTS ((BLOCK_SIZE - 16) / sizeof(journal_slot))
+
+struct journal_header {
+    uint32_t magic;     // JOURNAL_MAGIC
+    uint32_t sequence;  // number of the last logged transaction
+    uint32_t count;     // number of logged blocks, 0 when the journal is clean
+    uint32_t checksum;  // CRC32 of sequence, count, slots and the logged blocks
+    journal_slot slots[JOURNAL_SLOTS];
+};
+
+class Journal {
+private:
+    unsigned first_block;   // header block, the logged blocks follow it
+    unsigned no_blocks;     // size of the journal region including the header
+    unsigned fat_block;     // the FAT, for the free blocks a large transaction is logged in
+    uint32_t sequence = 0;
+    uint32_t checksum(journal_header &header, std::vector<uint8_t*> &blocks);
+    int clear(Disk &disk);
+    int overflow(Disk &disk, std::map<unsigned, std::vector<uint8_t> > &blocks, unsigned count,
+                 std::vector<unsigned> &spare);
+public:
+    Journal(unsigned first, unsigned blocks, unsigned fat) : first_block(first), no_blocks(blocks), fat_block(fat) {}
+    // number of metadata blocks that fit in the journal region, a larger
+    // transaction takes free blocks for the rest
+    unsigned capacity() { return no_blocks - 1; }
+    // writes an empty journal, i.e. reserves the region on a newly formatted disk
+    int format(Disk &disk);
+    // replays a committed but not checkpointed transaction, called at mount
+    int replay(Disk &disk);
+    // logs the blocks as one transaction and writes them to their home locations
+    int commit(Disk &disk, std::map<unsigned, std::vector<uint8_t> > &blocks);
+    // the first half of commit: logs the transaction and makes it durable, a
+    // crash after this is replayed at the next mount
+    int log(Disk &disk, std::map<unsigned, std::vector<uint8_t> > &blocks, std::vector<unsigned> &spare);
+};
+
+#endif // __JOURNAL_H__
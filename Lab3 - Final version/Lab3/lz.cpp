@@ -0,0 +1,127 @@
+/**
+ * @file lz.cpp
+ * @brief Small LZ77 codec for compressing file data, one block at a time
+ */
+
+#include <cstring>
+#include "lz.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+
+static uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// writes the extra bytes of a length that does not fit in its 4 bits
+static bool put_length(uint8_t *dst, int &op, int cap, int len)
+{
+    while (len >= 255) {
+        if (op >= cap) return false;
+        dst[op++] = 255;
+        len -= 255;
+    }
+    if (op >= cap) return false;
+    dst[op++] = (uint8_t)len;
+    return true;
+}
+
+static bool get_length(const uint8_t *src, int &ip, int n, int &len)
+{
+    uint8_t b;
+    do {
+        if (ip >= n) return false;
+        b = src[ip++];
+        len += b;
+    } while (b == 255);
+    return true;
+}
+
+// one sequence: literals src[anchor..anchor+lit) followed by a match (match_len 0 = none)
+static bool put_sequence(const uint8_t *src, int anchor, int lit, int offset, int match_len,
+                         uint8_t *dst, int &op, int cap)
+{
+    int ml = match_len ? match_len - LZ_MIN_MATCH : 0;
+    if (op >= cap) return false;
+    dst[op++] = (uint8_t)(((lit < 15 ? lit : 15) << 4) | (ml < 15 ? ml : 15));
+    if (lit >= 15 && !put_length(dst, op, cap, lit - 15)) return false;
+    if (op + lit > cap) return false;
+    memcpy(dst + op, src + anchor, lit);
+    op += lit;
+    if (match_len == 0) return true;
+    if (op + 2 > cap) return false;
+    dst[op++] = (uint8_t)(offset & 0xff);
+    dst[op++] = (uint8_t)(offset >> 8);
+    if (ml >= 15 && !put_length(dst, op, cap, ml - 15)) return false;
+    return true;
+}
+
+int lz_compress(const uint8_t *src, int src_len, uint8_t *dst, int dst_cap)
+{
+    int table[1 << LZ_HASH_BITS];
+    for (int i = 0; i < (1 << LZ_HASH_BITS); i++)
+        table[i] = -1;
+
+    int ip = 0;
+    int anchor = 0;
+    int op = 0;
+    while (ip + LZ_MIN_MATCH <= src_len) {
+        uint32_t sequence = read32(src + ip);
+        uint32_t hash = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+        int ref = table[hash];
+        table[hash] = ip;
+        if (ref < 0 || ip - ref > LZ_MAX_OFFSET || read32(src + ref) != sequence) {
+            ip++;
+            continue;
+        }
+        int len = LZ_MIN_MATCH;
+        while (ip + len < src_len && src[ref + len] == src[ip + len])
+            len++;
+        if (!put_sequence(src, anchor, ip - anchor, ip - ref, len, dst, op, dst_cap))
+            return 0;
+        ip += len;
+        anchor = ip;
+    }
+    // the last sequence has literals only
+    if (!put_sequence(src, anchor, src_len - anchor, 0, 0, dst, op, dst_cap))
+        return 0;
+    return op;
+}
+
+int lz_decompress(const uint8_t *src, int src_len, uint8_t *dst, int dst_cap)
+{
+    int ip = 0;
+    int op = 0;
+    while (ip < src_len) {
+        uint8_t token = src[ip++];
+        int lit = token >> 4;
+        if (lit == 15 && !get_length(src, ip, src_len, lit))
+            return -1;
+        if (ip + lit > src_len || op + lit > dst_cap)
+            return -1;
+        memcpy(dst + op, src + ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == src_len)
+            break;
+
+        if (ip + 2 > src_len)
+            return -1;
+        int offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        int len = token & 15;
+        if (len == 15 && !get_length(src, ip, src_len, len))
+            return -1;
+        len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || op + len > dst_cap)
+            return -1;
+        // byte by byte, the match may overlap the bytes it produces
+        for (int i = 0; i < len; i++, op++)
+            dst[op] = dst[op - offset];
+    }
+    return op;
+}
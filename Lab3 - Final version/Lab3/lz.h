@@ -0,0 +1,20 @@
+/**
+ * @file lz.h
+ * @brief Small LZ77 codec for compressing file data, one block at a time
+ *
+ * The format is the LZ4 block format: a sequence is a token (literal length
+ * and match length, 4 bits each), extra length bytes, the literals and a
+ * 16-bit little endian offset back into the output.
+ */
+
+#include <cstdint>
+
+#ifndef __LZ_H__
+#define __LZ_H__
+
+// compresses src into dst, returns the compressed size, or 0 if it does not fit in dst_cap
+int lz_compress(const uint8_t *src, int src_len, uint8_t *dst, int dst_cap);
+// decompresses src into dst, returns the decompressed size, or -1 if src is corrupt
+int lz_decompress(const uint8_t *src, int src_len, uint8_t *dst, int dst_cap);
+
+#endif // __LZ_H__
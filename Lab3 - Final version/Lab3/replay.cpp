@@ -0,0 +1,266 @@
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "fs.h"
+#include "trace.h"
+
+// replay [-c clients] [-p] <tracefile> runs the calls of a trace recorded
+// with the record command against a freshly formatted disk, and prints the
+// throughput and the latency of each kind of call. Each client is a process
+// with its own disk in the directory replay.<n>, so the clients run in
+// parallel. With -p the pauses between the recorded calls are kept.
+
+struct call_time {
+    uint8_t op;
+    uint32_t us;
+};
+
+static void
+usage()
+{
+    std::cout << "Usage: replay [-c clients] [-p] <tracefile>\n";
+    exit(2);
+}
+
+// made-up content of 'length' bytes, lines of 63 characters ended by a NUL
+static const char *
+content(std::vector<char> &buffer, uint64_t length)
+{
+    size_t old = buffer.size();
+    if (length > old) {
+        buffer.resize(length);
+        for (size_t i = old; i < length; i++)
+            buffer[i] = i % 64 == 63 ? 0 : 'a' + i % 26;
+    }
+    return buffer.data();
+}
+
+// runs the trace and writes the duration of the whole run in us, the number
+// of calls skipped, then the number and the times of the calls to 'out'
+static int
+run_client(const std::string &tracefile, bool pauses, int out)
+{
+    TraceReader reader;
+    if (!reader.open(tracefile))
+        return -1;
+    FS filesystem(nullptr);
+    filesystem.format();
+    std::vector<char> buffer;
+    std::map<uint64_t, int> fds;  // recorded descriptor -> descriptor of the replay
+    std::vector<call_time> times;
+    uint64_t skipped = 0;
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    trace_record r;
+    while (reader.next(r)) {
+        if (pauses && r.gap_us > 0)
+            std::this_thread::sleep_for(std::chrono::microseconds(r.gap_us));
+        int fd = fds.count(r.num[0]) ? fds[r.num[0]] : -1;
+        dir_entry entry;
+        std::vector<dir_entry> entries;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        switch (r.op) {
+        case TRACE_FORMAT:      filesystem.format(); break;
+        case TRACE_CREATE:      filesystem.create(r.text[0], content(buffer, r.num[0]), r.num[0]); break;
+        case TRACE_CAT: {
+            std::ostream discard(nullptr);
+            filesystem.cat(r.text[0], discard);
+            break;
+        }
+        case TRACE_LS:          filesystem.ls(r.text[0], r.num[0]); break;
+        case TRACE_CP:          filesystem.cp(r.text[0], r.text[1]); break;
+        case TRACE_MV:          filesystem.mv(r.text[0], r.text[1]); break;
+        case TRACE_RM:          filesystem.rm(r.text[0]); break;
+        case TRACE_COPY_TREE:   filesystem.copy_tree(r.text[0], r.text[1]); break;
+        case TRACE_REMOVE_TREE: filesystem.remove_tree(r.text[0]); break;
+        case TRACE_APPEND:      filesystem.append(r.text[0], r.text[1]); break;
+        case TRACE_WRITE:       filesystem.write(r.text[0], r.num[0], content(buffer, r.num[1]), r.num[1]); break;
+        case TRACE_TRUNCATE:    filesystem.truncate(r.text[0], r.num[0]); break;
+        case TRACE_OPEN:
+            fd = filesystem.open(r.text[0], r.num[0]);
+            if (fd >= 0)
+                fds[r.num[1]] = fd;
+            break;
+        case TRACE_CLOSE:
+            filesystem.close(fd);
+            fds.erase(r.num[0]);
+            break;
+        case TRACE_READ:
+            content(buffer, r.num[1]);
+            filesystem.read(fd, buffer.data(), r.num[1]);
+            break;
+        case TRACE_FWRITE:      filesystem.write(fd, content(buffer, r.num[1]), r.num[1]); break;
+        case TRACE_SEEK:        filesystem.seek(fd, r.num[1]); break;
+        case TRACE_MKDIR:       filesystem.mkdir(r.text[0]); break;
+        case TRACE_CD:          filesystem.cd(r.text[0]); break;
+        case TRACE_CHMOD:       filesystem.chmod(r.text[0], r.text[1]); break;
+        case TRACE_SYNC:        filesystem.sync(); break;
+        case TRACE_STAT:        filesystem.stat(r.text[0], entry); break;
+        case TRACE_LIST:        filesystem.list(r.text[0], entries); break;
+        case TRACE_FSCK:        filesystem.fsck(r.num[0]); break;
+        case TRACE_DEFRAG:      filesystem.defrag(r.num[0]); break;
+        case TRACE_COMPRESS:    filesystem.set_compression(r.num[0]); break;
+        case TRACE_DEDUP:       filesystem.set_dedup(r.num[0]); break;
+        case TRACE_SNAPSHOT:    filesystem.snapshot(r.text[0]); break;
+        case TRACE_SNAPSHOT_RM: filesystem.snapshot_rm(r.text[0]); break;
+        default:
+            // import-tree, export-tree and the deltas need the host files of the recording
+            skipped++;
+            continue;
+        }
+        call_time t;
+        t.op = r.op;
+        t.us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+        times.push_back(t);
+    }
+    uint64_t elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - begin).count();
+    uint64_t count = times.size();
+    if (::write(out, &elapsed, sizeof(elapsed)) != sizeof(elapsed) ||
+        ::write(out, &skipped, sizeof(skipped)) != sizeof(skipped) ||
+        ::write(out, &count, sizeof(count)) != sizeof(count))
+        return -1;
+    size_t bytes = count * sizeof(call_time);
+    for (size_t done = 0; done < bytes; ) {
+        ssize_t n = ::write(out, (const char*)times.data() + done, bytes - done);
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return 0;
+}
+
+static bool
+read_all(int fd, void *data, size_t length)
+{
+    for (size_t done = 0; done < length; ) {
+        ssize_t n = ::read(fd, (char*)data + done, length - done);
+        if (n <= 0)
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+static uint32_t
+percentile(std::vector<uint32_t> &us, unsigned p)
+{
+    return us[std::min(us.size() - 1, us.size() * p / 100)];
+}
+
+int
+main(int argc, char **argv)
+{
+    unsigned clients = 1;
+    bool pauses = false;
+    std::string tracefile;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+            clients = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-p") == 0)
+            pauses = true;
+        else if (tracefile.empty() && argv[i][0] != '-')
+            tracefile = argv[i];
+        else
+            usage();
+    }
+    if (tracefile.empty() || clients == 0)
+        usage();
+    TraceReader check;
+    if (!check.open(tracefile)) {
+        std::cout << "Error: " << tracefile << " is not a trace\n";
+        return 1;
+    }
+    // the clients run in their own directories, the trace is found from there
+    if (tracefile[0] != '/') {
+        char cwd[4096];
+        if (getcwd(cwd, sizeof(cwd)) != nullptr)
+            tracefile = std::string(cwd) + "/" + tracefile;
+    }
+
+    std::vector<int> pipes(clients);
+    std::vector<pid_t> pids(clients);
+    for (unsigned c = 0; c < clients; c++) {
+        int p[2];
+        if (pipe(p) != 0) {
+            std::cout << "Error: Can't start client " << c << "\n";
+            return 1;
+        }
+        pids[c] = fork();
+        if (pids[c] == 0) {
+            ::close(p[0]);
+            std::string dir = "replay." + std::to_string(c);
+            ::mkdir(dir.c_str(), 0755);
+            if (chdir(dir.c_str()) != 0)
+                _exit(1);
+            unlink(DISKNAME);
+            // the disk layer prints to std::cout, which is not the report
+            int null = ::open("/dev/null", O_WRONLY);
+            dup2(null, 1);
+            int status = run_client(tracefile, pauses, p[1]);
+            std::cout.flush();
+            _exit(status ? 1 : 0);
+        }
+        ::close(p[1]);
+        pipes[c] = p[0];
+    }
+
+    std::map<int, std::vector<uint32_t> > latency;  // per call, and all calls under 0
+    uint64_t calls = 0;
+    uint64_t longest = 0;
+    uint64_t skipped = 0;
+    bool failed = false;
+    for (unsigned c = 0; c < clients; c++) {
+        uint64_t elapsed, count;
+        if (read_all(pipes[c], &elapsed, sizeof(elapsed)) && read_all(pipes[c], &skipped, sizeof(skipped)) &&
+            read_all(pipes[c], &count, sizeof(count))) {
+            std::vector<call_time> times(count);
+            if (read_all(pipes[c], times.data(), count * sizeof(call_time))) {
+                for (size_t i = 0; i < times.size(); i++) {
+                    latency[times[i].op].push_back(times[i].us);
+                    latency[0].push_back(times[i].us);
+                }
+                calls += count;
+                longest = std::max(longest, elapsed);
+            }
+        }
+        ::close(pipes[c]);
+        int status;
+        waitpid(pids[c], &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            failed = true;
+    }
+    if (failed) {
+        std::cout << "Error: A client failed\n";
+        return 1;
+    }
+
+    std::cout << tracefile << ": " << clients << " clients, " << calls << " calls, "
+              << longest / 1000.0 << " ms, " << (longest ? calls * 1000000.0 / longest : 0) << " calls/s";
+    if (skipped) {
+        std::cout << ", " << skipped << " calls per client skipped";
+    }
+    std::cout << std::endl;
+    std::cout << "Call\t\t Calls\t p50 us\t p90 us\t p99 us\t Max us" << std::endl;
+    // the calls in the order of trace.h, then all of them together
+    for (int op = 1; op <= TRACE_OPS; op++) {
+        int key = op % TRACE_OPS;
+        if (!latency.count(key))
+            continue;
+        std::vector<uint32_t> &us = latency[key];
+        std::sort(us.begin(), us.end());
+        std::string name = key ? trace_op_name(key) : "all";
+        std::cout << name << (name.length() < 8 ? "\t\t " : "\t ") << us.size() << "\t " << percentile(us, 50) << "\t "
+                  << percentile(us, 90) << "\t " << percentile(us, 99) << "\t " << us.back() << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,262 @@
+/**
+ * @file scan.cpp
+ * @brief Vectorised scanning of block sized buffers
+ *
+ * The AVX2 and SSE2 versions are compiled with the target attribute, so the
+ * rest of the program is still built for the baseline CPU. The SSE2 and AVX2
+ * loops handle 16 or 32 bytes per step, and the bytes that are left at the
+ * end go to the scalar version. The environment variable FS_SCAN (avx2, sse2
+ * or scalar) limits the choice, to compare the versions, and so does
+ * scan_select within a program.
+ */
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
+
+namespace {
+
+struct scan_kernels {
+    size_t (*byte)(const void *data, size_t length, uint8_t c);
+    size_t (*word)(const int16_t *data, size_t length, int16_t value);
+    bool (*zero)(const void *data, size_t length);
+    bool (*equal)(const void *a, const void *b, size_t length);
+    const char *isa;
+};
+
+size_t byte_scalar(const void *data, size_t length, uint8_t c)
+{
+    const uint8_t *p = (const uint8_t*)data;
+    for (size_t i = 0; i < length; i++)
+        if (p[i] == c)
+            return i;
+    return length;
+}
+
+size_t word_scalar(const int16_t *data, size_t length, int16_t value)
+{
+    for (size_t i = 0; i < length; i++)
+        if (data[i] == value)
+            return i;
+    return length;
+}
+
+bool zero_scalar(const void *data, size_t length)
+{
+    const uint8_t *p = (const uint8_t*)data;
+    for (size_t i = 0; i < length; i++)
+        if (p[i])
+            return false;
+    return true;
+}
+
+bool equal_scalar(const void *a, const void *b, size_t length)
+{
+    return memcmp(a, b, length) == 0;
+}
+
+#ifdef SCAN_X86
+
+__attribute__((target("sse2")))
+size_t byte_sse2(const void *data, size_t length, uint8_t c)
+{
+    const uint8_t *p = (const uint8_t*)data;
+    __m128i needle = _mm_set1_epi8((char)c);
+    size_t i = 0;
+    // four vectors per step, the one with the byte is looked up below
+    for (; i + 64 <= length; i += 64) {
+        __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + i)), needle);
+        __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + i + 16)), needle);
+        __m128i d = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + i + 32)), needle);
+        __m128i e = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + i + 48)), needle);
+        if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(d, e))))
+            break;
+    }
+    for (; i + 16 <= length; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, needle));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + byte_scalar(p + i, length - i, c);
+}
+
+__attribute__((target("sse2")))
+size_t word_sse2(const int16_t *data, size_t length, int16_t value)
+{
+    __m128i needle = _mm_set1_epi16(value);
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+        // two mask bits per word
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi16(v, needle));
+        if (mask)
+            return i + __builtin_ctz(mask) / 2;
+    }
+    return i + word_scalar(data + i, length - i, value);
+}
+
+__attribute__((target("sse2")))
+bool zero_sse2(const void *data, size_t length)
+{
+    const uint8_t *p = (const uint8_t*)data;
+    size_t i = 0;
+    for (; i + 64 <= length; i += 64) {
+        __m128i v = _mm_or_si128(_mm_or_si128(_mm_loadu_si128((const __m128i*)(p + i)),
+                                              _mm_loadu_si128((const __m128i*)(p + i + 16))),
+                                 _mm_or_si128(_mm_loadu_si128((const __m128i*)(p + i + 32)),
+                                              _mm_loadu_si128((const __m128i*)(p + i + 48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xffff)
+            return false;
+    }
+    return zero_scalar(p + i, length - i);
+}
+
+__attribute__((target("sse2")))
+bool equal_sse2(const void *a, const void *b, size_t length)
+{
+    const uint8_t *p = (const uint8_t*)a;
+    const uint8_t *q = (const uint8_t*)b;
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i v = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + i)), _mm_loadu_si128((const __m128i*)(q + i)));
+        if (_mm_movemask_epi8(v) != 0xffff)
+            return false;
+    }
+    return equal_scalar(p + i, q + i, length - i);
+}
+
+__attribute__((target("avx2")))
+size_t byte_avx2(const void *data, size_t length, uint8_t c)
+{
+    const uint8_t *p = (const uint8_t*)data;
+    __m256i needle = _mm256_set1_epi8((char)c);
+    size_t i = 0;
+    // four vectors per step, the one with the byte is looked up below
+    for (; i + 128 <= length; i += 128) {
+        __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + i)), needle);
+        __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + i + 32)), needle);
+        __m256i d = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + i + 64)), needle);
+        __m256i e = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + i + 96)), needle);
+        __m256i any = _mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(d, e));
+        if (!_mm256_testz_si256(any, any))
+            break;
+    }
+    for (; i + 32 <= length; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, needle));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + byte_scalar(p + i, length - i, c);
+}
+
+__attribute__((target("avx2")))
+size_t word_avx2(const int16_t *data, size_t length, int16_t value)
+{
+    __m256i needle = _mm256_set1_epi16(value);
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(data + i));
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi16(v, needle));
+        if (mask)
+            return i + __builtin_ctz(mask) / 2;
+    }
+    return i + word_scalar(data + i, length - i, value);
+}
+
+__attribute__((target("avx2")))
+bool zero_avx2(const void *data, size_t length)
+{
+    const uint8_t *p = (const uint8_t*)data;
+    size_t i = 0;
+    for (; i + 128 <= length; i += 128) {
+        __m256i v = _mm256_or_si256(_mm256_or_si256(_mm256_loadu_si256((const __m256i*)(p + i)),
+                                                     _mm256_loadu_si256((const __m256i*)(p + i + 32))),
+                                    _mm256_or_si256(_mm256_loadu_si256((const __m256i*)(p + i + 64)),
+                                                    _mm256_loadu_si256((const __m256i*)(p + i + 96))));
+        if (!_mm256_testz_si256(v, v))
+            return false;
+    }
+    return zero_scalar(p + i, length - i);
+}
+
+__attribute__((target("avx2")))
+bool equal_avx2(const void *a, const void *b, size_t length)
+{
+    const uint8_t *p = (const uint8_t*)a;
+    const uint8_t *q = (const uint8_t*)b;
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(p + i)),
+                                     _mm256_loadu_si256((const __m256i*)(q + i)));
+        if (!_mm256_testz_si256(v, v))
+            return false;
+    }
+    return equal_scalar(p + i, q + i, length - i);
+}
+
+#endif // SCAN_X86
+
+scan_kernels choose(const char *limit)
+{
+    std::string wanted = limit ? limit : "avx2";
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (wanted == "avx2" && __builtin_cpu_supports("avx2")) {
+        scan_kernels avx2 = { byte_avx2, word_avx2, zero_avx2, equal_avx2, "avx2" };
+        return avx2;
+    }
+    if (wanted != "scalar" && __builtin_cpu_supports("sse2")) {
+        scan_kernels sse2 = { byte_sse2, word_sse2, zero_sse2, equal_sse2, "sse2" };
+        return sse2;
+    }
+#endif
+    scan_kernels scalar = { byte_scalar, word_scalar, zero_scalar, equal_scalar, "scalar" };
+    return scalar;
+}
+
+scan_kernels &kernels()
+{
+    static scan_kernels chosen = choose(getenv("FS_SCAN"));
+    return chosen;
+}
+
+} // namespace
+
+size_t scan_byte(const void *data, size_t length, uint8_t c)
+{
+    return kernels().byte(data, length, c);
+}
+
+size_t scan_word(const int16_t *data, size_t length, int16_t value)
+{
+    return kernels().word(data, length, value);
+}
+
+bool scan_zero(const void *data, size_t length)
+{
+    return kernels().zero(data, length);
+}
+
+bool scan_equal(const void *a, const void *b, size_t length)
+{
+    return kernels().equal(a, b, length);
+}
+
+const char *scan_isa()
+{
+    return kernels().isa;
+}
+
+const char *scan_select(const char *isa)
+{
+    kernels() = choose(isa ? isa : getenv("FS_SCAN"));
+    return kernels().isa;
+}
@@ -0,0 +1,30 @@
+/**
+ * @file scan.h
+ * @brief Vectorised scanning of block sized buffers
+ *
+ * Every kernel has an AVX2, an SSE2 and a scalar version. The version is
+ * chosen once, when the program starts, from what the CPU supports.
+ */
+
+#include <cstddef>
+#include <cstdint>
+
+#ifndef __SCAN_H__
+#define __SCAN_H__
+
+// index of the first byte equal to 'c', or 'length' if there is none
+size_t scan_byte(const void *data, size_t length, uint8_t c);
+// index of the first 16-bit word equal to 'value', or 'length' (in words) if there is none
+size_t scan_word(const int16_t *data, size_t length, int16_t value);
+// true if all 'length' bytes are 0
+bool scan_zero(const void *data, size_t length);
+// true if the 'length' bytes of 'a' and 'b' are the same
+bool scan_equal(const void *a, const void *b, size_t length);
+// the instruction set of the kernels in use: "avx2", "sse2" or "scalar"
+const char *scan_isa();
+// uses the kernels of 'isa' ("avx2", "sse2" or "scalar") or the best ones
+// below it, nullptr goes back to the choice at start. Returns the one in use.
+// For tests that compare the versions, no scan may run at the same time.
+const char *scan_select(const char *isa);
+
+#endif // __SCAN_H__
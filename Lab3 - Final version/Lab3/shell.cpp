@@ -1,5 +1,5 @@
 #include <iostream>
-#include <sstream>
+#include <algorithm>
 #include <string>
 #include <vector>
 #include "shell.h"
@@ -7,15 +7,68 @@
 
 std::string commands_str[] = {
     "format", "create", "cat", "ls",
-    "cp", "mv", "rm", "append",
+    "cp", "mv", "rm", "append", "write", "truncate",
+    "import-tree", "export-tree",
+    "open", "fread", "fwrite", "seek", "close",
     "mkdir", "cd", "pwd",
     "chmod",
+    "sync", "durability", "df", "fsck", "defrag", "compress", "dedup", "record",
+    "snapshot", "snapshots", "snapshot-rm", "export-delta", "apply-delta",
+    "mount", "umount", "volumes",
     "help", "quit"
 };
 
+// the arguments of a command that are paths in the file system
+static std::vector<size_t>
+path_args(const std::string &cmd, const std::vector<std::string> &cmd_line)
+{
+    std::vector<size_t> args;
+    size_t n = cmd_line.size();
+    if (cmd == "create" || cmd == "cat" || cmd == "mkdir" || cmd == "cd" || cmd == "write" ||
+        cmd == "truncate" || cmd == "open" || cmd == "export-tree") {
+        if (n > 1)
+            args.push_back(1);
+    }
+    else if (cmd == "ls" || cmd == "rm") {
+        if (n > 1 && cmd_line[n - 1] != "-l" && cmd_line[n - 1] != "-r")
+            args.push_back(n - 1);
+    }
+    else if (cmd == "cp" || cmd == "mv" || cmd == "append") {
+        if (n > 2) {
+            args.push_back(n - 2);
+            args.push_back(n - 1);
+        }
+    }
+    else if (cmd == "import-tree" || cmd == "chmod") {
+        if (n > 2)
+            args.push_back(2);
+    }
+    return args;
+}
+
+// the decimal number in 'arg', false when it is something else or larger than 'max'
+static bool
+parse_number(const std::string &arg, unsigned long long max, unsigned long long &value)
+{
+    if (arg.empty())
+        return false;
+    value = 0;
+    for (char c : arg) {
+        if (c < '0' || c > '9')
+            return false;
+        unsigned digit = c - '0';
+        if (value > (max - digit) / 10)
+            return false;
+        value = value * 10 + digit;
+    }
+    return true;
+}
+
 Shell::Shell()
 {
     std::cout << "Starting shell...\n";
+    // the disk of the shell is not mounted a second time as a volume
+    volumes.exclude(DISKNAME);
 }
 
 Shell::~Shell()
@@ -28,32 +81,25 @@ Shell::run()
 {
     bool running = true;
     std::string line;
-    std::string str;
-    char c;
     std::vector<std::string> cmd_line;
     std::string cmd, arg1, arg2;
     int ret_val = 0;
     while (running) {
         std::cout << "filesystem> ";
         std::getline(std::cin, line);
-        std::stringstream linestream(line);
-        cmd_line.clear();
-        str.clear();
-        while (linestream.get(c)) {
-            //std::cout << "parsing cmd line: " << c << "\n";
-            if (c != ' ') {
-                str += c;
-            } else {
-                // strip multiple blanks
-                if (!str.empty()) {
-                    cmd_line.push_back(str);
-                    str.clear();
-                }
-            }
+        // the words of the line, multiple blanks are stripped. The strings of
+        // the last line are assigned again, so they keep their memory.
+        size_t words = 0;
+        size_t pos = 0;
+        while ((pos = line.find_first_not_of(' ', pos)) != std::string::npos) {
+            size_t end = std::min(line.find(' ', pos), line.size());
+            if (words == cmd_line.size())
+                cmd_line.push_back(std::string());
+            cmd_line[words++].assign(line, pos, end - pos);
+            pos = end;
         }
-        if (!str.empty())
-            cmd_line.push_back(str);
-        if (line.empty())
+        cmd_line.resize(words);
+        if (cmd_line.empty())
             cmd = "";
         else
             cmd = cmd_line[0];
@@ -65,188 +111,651 @@ Shell::run()
                 std::cout << "cmd/arg: " << cmd_line[i] << "\n";
         }
 
-        if (cmd == "format") {
-            if (cmd_line.size() != 1) {
-                std::cout << "Usage: format\n";
-                continue;
-            }
-            // check return value so everything is ok
-            ret_val = filesystem.format();
-            if (ret_val) {
-                std::cout << "Error: format failed, error code " << ret_val << std::endl;
-            }
+        // a path "/<name>/..." on a mounted volume sends the command there, other
+        // absolute paths go to the disk of the shell and relative ones to the
+        // volume of the working directory, like the commands without a path
+        std::string target = current;
+        std::vector<size_t> paths = path_args(cmd, cmd_line);
+        bool across = false;
+        for (size_t i = 0; i < paths.size(); i++) {
+            std::string &path = cmd_line[paths[i]];
+            std::string name = current;
+            std::string rest;
+            if (volumes.split(path, name, rest))
+                path = rest;
+            else if (!path.empty() && path[0] == '/')
+                name = "";
+            if (i == 0)
+                target = name;
+            else if (name != target)
+                across = true;
+        }
+        if (across) {
+            std::cout << "Error: " << cmd << " works within one volume, use export-tree and import-tree between volumes\n";
+            continue;
         }
 
-        else if (cmd == "create") {
-            if (cmd_line.size() != 2) {
-                std::cout << "Usage: create <file>\n";
+        if (cmd == "mount") {
+            if (cmd_line.size() != 3) {
+                std::cout << "Usage: mount <name> <diskfile>\n";
                 continue;
             }
             arg1 = cmd_line[1];
-            std::cout << "Enter data. Empty line to end.\n";
+            arg2 = cmd_line[2];
             // check return value so everything is ok
-            ret_val = filesystem.create(arg1);
+            ret_val = volumes.mount(arg1, arg2);
             if (ret_val) {
-                std::cout << "Error: create " << arg1;
-                std::cout << " failed, error code " << ret_val << std::endl;
+                std::cout << "Error: mount " << arg1 << " " << arg2;
+                std::cout << " failed, error code " << ret_val << " (" << fs_status_text(ret_val) << ")" << std::endl;
             }
         }
 
-        else if (cmd == "cat") {
+        else if (cmd == "umount") {
             if (cmd_line.size() != 2) {
-                std::cout << "Usage: cat <file>\n";
+                std::cout << "Usage: umount <name>\n";
                 continue;
             }
             arg1 = cmd_line[1];
             // check return value so everything is ok
-            ret_val = filesystem.cat(arg1);
+            ret_val = volumes.unmount(arg1);
             if (ret_val) {
-                std::cout << "Error: cat " << arg1;
-                std::cout << " failed, error code " << ret_val << std::endl;
+                std::cout << "Error: umount " << arg1;
+                std::cout << " failed, error code " << ret_val << " (" << fs_status_text(ret_val) << ")" << std::endl;
             }
+            else if (current == arg1)
+                current = "";
         }
 
-        else if (cmd == "ls") {
+        else if (cmd == "volumes") {
             if (cmd_line.size() != 1) {
-                std::cout << "Usage: ls\n";
+                std::cout << "Usage: volumes\n";
                 continue;
             }
-            // check return value so everything is ok
-            ret_val = filesystem.ls();
-            if (ret_val) {
-                std::cout << "Error: ls failed, error code " << ret_val << std::endl;
-            }
+            std::vector<std::string> names, diskfiles;
+            volumes.names(names, diskfiles);
+            std::cout << "Volume\t\t Disk file" << std::endl;
+            std::cout << "/\t\t " << DISKNAME << std::endl;
+            for (size_t i = 0; i < names.size(); i++)
+                std::cout << "/" << names[i] << (names[i].length() < 7 ? "\t\t " : "\t ") << diskfiles[i] << std::endl;
         }
 
-        else if (cmd == "cp") {
-            if (cmd_line.size() != 3) {
-                std::cout << "Usage: <oldfile> <newfile>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            arg2 = cmd_line[2];
-            // check return value so everything is ok
-            ret_val = filesystem.cp(arg1, arg2);
-            if (ret_val) {
-                std::cout << "Error: cp " << arg1 << " " << arg2;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
+        else if (cmd == "quit")
+            running = false;
+
+        else if (cmd == "help") {
+            std::cout << "Available commands:\n";
+            std::cout << "format, create, cat, ls, cp, mv, rm, append, write, truncate, import-tree, export-tree, open, fread, fwrite, seek, close, mkdir, cd, pwd, chmod, sync, durability, df, fsck, defrag, compress, dedup, record, snapshot, snapshots, snapshot-rm, export-delta, apply-delta, mount, umount, volumes, help, quit\n";
         }
 
-        else if (cmd == "mv") {
-            if (cmd_line.size() != 3) {
-                std::cout << "Usage: mv <sourcepath> <destpath>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            arg2 = cmd_line[2];
-            // check return value so everything is ok
-            ret_val = filesystem.mv(arg1, arg2);
-            if (ret_val) {
-                std::cout << "Error: mv " << arg1 << " " << arg2;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
+        else if (cmd == "") {
+            ; // do nothing
         }
 
-        else if (cmd == "rm") {
-            if (cmd_line.size() != 2) {
-                std::cout << "Usage: rm <file>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            // check return value so everything is ok
-            ret_val = filesystem.rm(arg1);
-            if (ret_val) {
-                std::cout << "Error: rm " << arg1;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
+        else if (target.empty())
+            ret_val = execute(filesystem, cmd_line, target);
+
+        else if (!volumes.mounted(target)) {
+            std::cout << "Error: The volume " << target << " is not mounted\n";
+            current = "";
         }
 
-        else if (cmd == "append") {
-            if (cmd_line.size() != 3) {
-                std::cout << "Usage: append <filepath1> <filepath2>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            arg2 = cmd_line[2];
-            // check return value so everything is ok
-            ret_val = filesystem.append(arg1, arg2);
-            if (ret_val) {
-                std::cout << "Error: append " << arg1 << " " << arg2;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
+        else {
+            // the command runs on the worker of the volume, in the lock domain
+            // of the volume, and the shell waits for it
+            std::future<int> done = volumes.submit(target, [this, &cmd_line, &target](FS &fs) {
+                return execute(fs, cmd_line, target);
+            });
+            ret_val = done.get();
         }
+    }
+}
 
-        else if (cmd == "mkdir") {
-            if (cmd_line.size() != 2) {
-                std::cout << "Usage: mkdir <dirpath>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            // check return value so everything is ok
-            ret_val = filesystem.mkdir(arg1);
-            if (ret_val) {
-                std::cout << "Error: mkdir " << arg1;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
+// runs one command of the shell on 'fs', the file system of the volume
+// 'target' ("" for the disk of the shell), and returns its status
+int
+Shell::execute(FS &fs, std::vector<std::string> &cmd_line, const std::string &target)
+{
+    std::string cmd = cmd_line[0];
+    std::string arg1, arg2;
+    int ret_val = 0;
+
+    if (cmd == "format") {
+        if (cmd_line.size() != 1) {
+            std::cout << "Usage: format\n";
+            return 0;
+        }
+        // check return value so everything is ok
+        ret_val = fs.format();
+        if (ret_val) {
+            std::cout << "Error: format failed, error code " << ret_val << " (" << fs_status_text(ret_val) << ")" << std::endl;
         }
+    }
 
-        else if (cmd == "cd") {
-            if (cmd_line.size() != 2) {
-                std::cout << "Usage: cd <dirpath>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            // check return value so everything is ok
-            ret_val = filesystem.cd(arg1);
-            if (ret_val) {
-                std::cout << "Error: cd " << arg1;
-                std::cout << " failed, error code " << ret_val << std::endl;
-            }
+    else if (cmd == "create") {
+        if (cmd_line.size() != 2) {
+            std::cout << "Usage: create <file>\n";
+            return 0;
         }
+        arg1 = cmd_line[1];
+        std::cout << "Enter data. Empty line to end.\n";
+        // check return value so everything is ok
+        ret_val = fs.create(arg1);
+        if (ret_val) {
+            std::cout << "Error: create " << arg1;
+            std::cout << " failed, error code " << ret_val << " (" << fs_status_text(ret_val) << ")" << std::endl;
+        }
+    }
 
-        else if (cmd == "pwd") {
-            if (cmd_line.size() != 1) {
-                std::cout << "Usage: pwd\n";
-                continue;
-            }
-            // check return value so everything is ok
-            ret_val = filesystem.pwd();
-            if (ret_val) {
-                std::cout << "Error: pwd failed, error code " << ret_val << std::endl;
-            }
+    else if (cmd == "cat") {
+        if (cmd_line.size() != 2) {
+            std::cout << "Usage: cat <file>\n";
+            return 0;
+        }
+        arg1 = cmd_line[1];
+        // check return value so everything is ok
+        ret_val = fs.cat(arg1);
+        if (ret_val) {
+            std::cout << "Error: cat " << arg1;
+            std::cout << " failed, error code " << ret_val << " (" << fs_status_text(ret_val) << ")" << std::endl;
         }
+    }
 
-        else if (cmd == "chmod") {
-            if (cmd_line.size() != 3) {
-                std::cout << "Usage: chmod <accessrights> <filepath>\n";
-                continue;
-            }
-            arg1 = cmd_line[1];
-            arg2 = cmd_line[2];
-            // check return value so everything is ok
-            ret_val = filesystem.chmod(arg1, arg2);
-            if (ret_val) {
-                std::cout << "Error: chmod " << arg1 << " " << arg2;
-                std::cout << " failed, error code " << ret_val << std::endl;
+    else if (cmd == "ls") {
+        bool long_format = cmd_line.size() > 1 && cmd_line[1] == "-l";
+        if (cmd_line.size() > (long_format ? 3u : 2u)) {
+            std::cout << "Usage: ls [-l] [dirpath]\n";
+            return 0;
+        }
+        arg1 = cmd_line.size() > (long_format ? 2u : 1u) ? cmd_line.back() : "";
+        // check return value so everything is ok
+        ret_val = fs.ls(arg1, long_format);
+        if (ret_val) {
+            std::cout << "Error: ls failed, error code " << ret_val << " (" << fs_status_text(ret_val) << ")" << std::endl;
+        }
+    }
+
+    else if (cmd == "cp") {
+        bool recursive = cmd_line.size() == 4 && cmd_line[1] == "-r";
+        if (cmd_line.size() != 3 && !recursive) {
+            std::cout << "Usage: cp [-r] <oldfile> <newfile>\n";
+            return 0;
+        }
+        arg1 = cmd_line[cmd_line.size() - 2];
+        arg2 = cmd_line[cmd_line.size() - 1];
+        // check return value so everything is ok
+        if (recursive)
+            ret_val = fs.copy_tree(arg1, arg2);
+        else
+            ret_val = fs.cp(arg1, arg2);
+        if (ret_val) {
+            std::cout << "Error: cp " << arg1 << " " << arg2;
+            std::cout << " failed, error code " << ret_val << " (" << fs_status_text(ret_val) << ")" << std::endl;
+        }
+    }
+
+    else if (cmd == "mv") {
+        if (cmd_line.size() != 3) {
+            std::cout << "Usage: mv <sourcepath> <destpath>\n";
+            return 0;
+        }
+        arg1 = cmd_line[1];
+        arg2 = cmd_line[2];
+        // check return value so everything is ok
+        ret_val = fs.mv(arg1, arg2);
+        if (ret_val) {
+            std::cout << "Error: mv " << arg1 << " " << arg2;
+            std::cout << " failed, error code " << ret_val << " (" << fs_status_text(ret_val) << ")" << std::endl;
+        }
+    }
+
+    else if (cmd == "rm") {
+        bool recursive = cmd_line.size() == 3 && cmd_line[1] == "-r";
+        if (cmd_line.size() != 2 && !recursive) {
+            std::cout << "Usage: rm [-r] <file>\n";
+            return 0;
+        }
+        arg1 = cmd_line[cmd_line.size() - 1];
+        // check return value so everything is ok
+        if (recursive)
+            ret_val = fs.remove_tree(arg1);
+        else
+            ret_val = fs.rm(arg1);
+        if (ret_val) {
+            std::cout << "Error: rm " << arg1;
+            std::cout << " failed, error code " << ret_val << " (" << fs_status_text(ret_val) << ")" << std::endl;
+        }
+    }
+
+    else if (cmd == "import-tree" || cmd == "export-tree") {
+        if (cmd_line.size() != 3) {
+            if (cmd == "import-tree")
+                std::cout << "Usage: import-tree <hostdir> <fsdir>\n";
+            else
+                std::cout << "Usage: export-tree <fsdir> <hostdir>\n";
+            return 0;
+        }
+        arg1 = cmd_line[1];
+        arg2 = cmd_line[2];
+        // check return value so everything is ok
+        if (cmd == "import-tree")
+            ret_val = fs.import_tree(arg1, arg2);
+        else
+            ret_val = fs.export_tree(arg1, arg2);
+        if (ret_val) {
+            std::cout << "Error: " << cmd << " " << arg1 << " " << arg2;
+            std::cout << " failed, error code " << ret_val << " (" << fs_status_text(ret_val) << ")" << std::endl;
+        }
+    }
+
+    else if (cmd == "append") {
+        if (cmd_line.size() != 3) {
+            std::cout << "Usage: append <filepath1> <filepath2>\n";
+            return 0;
+        }
+        arg1 = cmd_line[1];
+        arg2 = cmd_line[2];
+        // check return value so everything is ok
+        ret_val = fs.append(arg1, arg2);
+        if (ret_val) {
+            std::cout << "Error: append " << arg1 << " " << arg2;
+            std::cout << " failed, error code " << ret_val << " (" << fs_status_text(ret_val) << ")" << std::endl;
+        }
+    }
+
+    else if (cmd == "mkdir") {
+        if (cmd_line.size() != 2) {
+            std::cout << "Usage: mkdir <dirpath>\n";
+            return 0;
+        }
+        arg1 = cmd_line[1];
+        // check return value so everything is ok
+        ret_val = fs.mkdir(arg1);
+        if (ret_val) {
+            std::cout << "Error: mkdir " << arg1;
+            std::cout << " failed, error code " << ret_val << " (" << fs_status_text(ret_val) << ")" << std::endl;
+        }
+    }
+
+    else if (cmd == "cd") {
+        if (cmd_line.size() != 2) {
+            std::cout << "Usage: cd <dirpath>\n";
+            return 0;
+        }
+        arg1 = cmd_line[1];
+        // check return value so everything is ok
+        ret_val = fs.cd(arg1);
+        if (ret_val) {
+            std::cout << "Error: cd " << arg1;
+            std::cout << " failed, error code " << ret_val << " (" << fs_status_text(ret_val) << ")" << std::endl;
+        }
+        else
+            current = target;
+    }
+
+    else if (cmd == "pwd") {
+        if (cmd_line.size() != 1) {
+            std::cout << "Usage: pwd\n";
+            return 0;
+        }
+        // check return value so everything is ok
+        if (current.empty())
+            ret_val = fs.pwd();
+        else {
+            // the root of a volume is /<name>
+            std::string path;
+            ret_val = fs.pwd(path);
+            std::cout << "/" << current << path.substr(PARENT_DIR.length()) << std::endl;
+        }
+        if (ret_val) {
+            std::cout << "Error: pwd failed, error code " << ret_val << " (" << fs_status_text(ret_val) << ")" << std::endl;
+        }
+    }
+
+    else if (cmd == "write") {
+        if (cmd_line.size() < 4) {
+            std::cout << "Usage: write <filepath> <offset> <data>\n";
+            return 0;
+        }
+        unsigned long long offset;
+        if (!parse_number(cmd_line[2], UINT32_MAX, offset)) {
+            std::cout << "Usage: write <filepath> <offset> <data>\n";
+            return 0;
+        }
+        arg1 = cmd_line[1];
+        // the data is the rest of the line, with single blanks between the words
+        std::string data = cmd_line[3];
+        for (unsigned i = 4; i < cmd_line.size(); ++i)
+            data += " " + cmd_line[i];
+        // check return value so everything is ok
+        ret_val = fs.write(arg1, offset, data.c_str(), data.size());
+        if (ret_val) {
+            std::cout << "Error: write " << arg1 << " " << cmd_line[2];
+            std::cout << " failed, error code " << ret_val << " (" << fs_status_text(ret_val) << ")" << std::endl;
+        }
+    }
+
+    else if (cmd == "truncate") {
+        if (cmd_line.size() != 3) {
+            std::cout << "Usage: truncate <filepath> <length>\n";
+            return 0;
+        }
+        unsigned long long length;
+        if (!parse_number(cmd_line[2], UINT32_MAX, length)) {
+            std::cout << "Usage: truncate <filepath> <length>\n";
+            return 0;
+        }
+        arg1 = cmd_line[1];
+        // check return value so everything is ok
+        ret_val = fs.truncate(arg1, length);
+        if (ret_val) {
+            std::cout << "Error: truncate " << arg1 << " " << cmd_line[2];
+            std::cout << " failed, error code " << ret_val << " (" << fs_status_text(ret_val) << ")" << std::endl;
+        }
+    }
+
+    else if (cmd == "open") {
+        if (cmd_line.size() < 2 || cmd_line.size() > 3) {
+            std::cout << "Usage: open <filepath> [r|w|rw]\n";
+            return 0;
+        }
+        uint8_t mode = READ;
+        if (cmd_line.size() == 3) {
+            if (cmd_line[2] == "r")
+                mode = READ;
+            else if (cmd_line[2] == "w")
+                mode = WRITE;
+            else if (cmd_line[2] == "rw")
+                mode = READ | WRITE;
+            else {
+                std::cout << "Usage: open <filepath> [r|w|rw]\n";
+                return 0;
             }
         }
+        arg1 = cmd_line[1];
+        int fd = fs.open(arg1, mode);
+        if (fd < 0) {
+            std::cout << "Error: open " << arg1 << " failed" << std::endl;
+        }
+        else {
+            std::cout << "fd " << fd << std::endl;
+        }
+    }
 
-        else if (cmd == "quit")
-            running = false;
+    else if (cmd == "fread") {
+        if (cmd_line.size() != 3) {
+            std::cout << "Usage: fread <fd> <length>\n";
+            return 0;
+        }
+        unsigned long long fd, length;
+        if (!parse_number(cmd_line[1], INT32_MAX, fd) || !parse_number(cmd_line[2], UINT32_MAX, length)) {
+            std::cout << "Usage: fread <fd> <length>\n";
+            return 0;
+        }
+        // no file is larger than the disk, the buffer is not either
+        unsigned blocks, free;
+        fs.usage(blocks, free);
+        std::vector<char> data(std::min(length, (unsigned long long)blocks * BLOCK_SIZE));
+        ret_val = fs.read(fd, data.data(), data.size());
+        if (ret_val < 0) {
+            std::cout << "Error: fread " << cmd_line[1] << " failed" << std::endl;
+            return 0;
+        }
+        // the lines of a file end with a NUL, they are printed like cat does
+        for (int i = 0; i < ret_val; ++i)
+            std::cout << (data[i] ? data[i] : '\n');
+        std::cout << std::endl;
+    }
 
-        else if (cmd == "help") {
-            std::cout << "Available commands:\n";
-            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, help, quit\n";
+    else if (cmd == "fwrite") {
+        if (cmd_line.size() < 3) {
+            std::cout << "Usage: fwrite <fd> <data>\n";
+            return 0;
+        }
+        unsigned long long fd;
+        if (!parse_number(cmd_line[1], INT32_MAX, fd)) {
+            std::cout << "Usage: fwrite <fd> <data>\n";
+            return 0;
         }
+        std::string data = cmd_line[2];
+        for (unsigned i = 3; i < cmd_line.size(); ++i)
+            data += " " + cmd_line[i];
+        ret_val = fs.write(fd, data.c_str(), data.size());
+        if (ret_val < 0) {
+            std::cout << "Error: fwrite " << cmd_line[1] << " failed" << std::endl;
+        }
+    }
 
-        else if (cmd == "") {
-            ; // do nothing
+    else if (cmd == "seek") {
+        if (cmd_line.size() != 3) {
+            std::cout << "Usage: seek <fd> <offset>\n";
+            return 0;
+        }
+        unsigned long long fd, offset;
+        if (!parse_number(cmd_line[1], INT32_MAX, fd) || !parse_number(cmd_line[2], UINT32_MAX, offset)) {
+            std::cout << "Usage: seek <fd> <offset>\n";
+            return 0;
+        }
+        ret_val = fs.seek(fd, offset);
+        if (ret_val < 0) {
+            std::cout << "Error: seek " << cmd_line[1] << " failed" << std::endl;
         }
+    }
 
+    else if (cmd == "close") {
+        if (cmd_line.size() != 2) {
+            std::cout << "Usage: close <fd>\n";
+            return 0;
+        }
+        unsigned long long fd;
+        if (!parse_number(cmd_line[1], INT32_MAX, fd)) {
+            std::cout << "Usage: close <fd>\n";
+            return 0;
+        }
+        ret_val = fs.close(fd);
+        if (ret_val) {
+            std::cout << "Error: close " << cmd_line[1] << " failed" << std::endl;
+        }
+    }
+
+    else if (cmd == "chmod") {
+        if (cmd_line.size() != 3) {
+            std::cout << "Usage: chmod <accessrights> <filepath>\n";
+            return 0;
+        }
+        arg1 = cmd_line[1];
+        arg2 = cmd_line[2];
+        // check return value so everything is ok
+        ret_val = fs.chmod(arg1, arg2);
+        if (ret_val) {
+            std::cout << "Error: chmod " << arg1 << " " << arg2;
+            std::cout << " failed, error code " << ret_val << " (" << fs_status_text(ret_val) << ")" << std::endl;
+        }
+    }
+
+    else if (cmd == "sync") {
+        if (cmd_line.size() != 1) {
+            std::cout << "Usage: sync\n";
+            return 0;
+        }
+        // check return value so everything is ok
+        ret_val = fs.sync();
+        if (ret_val) {
+            std::cout << "Error: sync failed, error code " << ret_val << " (" << fs_status_text(ret_val) << ")" << std::endl;
+        }
+    }
+
+    else if (cmd == "df") {
+        if (cmd_line.size() != 1) {
+            std::cout << "Usage: df\n";
+            return 0;
+        }
+        // check return value so everything is ok
+        ret_val = fs.df();
+        if (ret_val) {
+            std::cout << "Error: df failed, error code " << ret_val << " (" << fs_status_text(ret_val) << ")" << std::endl;
+        }
+    }
+
+    else if (cmd == "snapshot" || cmd == "snapshot-rm") {
+        if (cmd_line.size() != 2) {
+            std::cout << "Usage: " << cmd << " <name>\n";
+            return 0;
+        }
+        arg1 = cmd_line[1];
+        // check return value so everything is ok
+        if (cmd == "snapshot")
+            ret_val = fs.snapshot(arg1);
+        else
+            ret_val = fs.snapshot_rm(arg1);
+        if (ret_val) {
+            std::cout << "Error: " << cmd << " " << arg1;
+            std::cout << " failed, error code " << ret_val << " (" << fs_status_text(ret_val) << ")" << std::endl;
+        }
+    }
+
+    else if (cmd == "snapshots") {
+        if (cmd_line.size() != 1) {
+            std::cout << "Usage: snapshots\n";
+            return 0;
+        }
+        // check return value so everything is ok
+        ret_val = fs.snapshots();
+        if (ret_val) {
+            std::cout << "Error: snapshots failed, error code " << ret_val << " (" << fs_status_text(ret_val) << ")" << std::endl;
+        }
+    }
+
+    else if (cmd == "export-delta") {
+        if (cmd_line.size() != 3) {
+            std::cout << "Usage: export-delta <since-gen> <hostfile>\n";
+            return 0;
+        }
+        unsigned long long since;
+        if (!parse_number(cmd_line[1], UINT64_MAX, since)) {
+            std::cout << "Usage: export-delta <since-gen> <hostfile>\n";
+            return 0;
+        }
+        arg1 = cmd_line[1];
+        arg2 = cmd_line[2];
+        // check return value so everything is ok
+        ret_val = fs.export_delta(since, arg2);
+        if (ret_val) {
+            std::cout << "Error: export-delta " << arg1 << " " << arg2;
+            std::cout << " failed, error code " << ret_val << " (" << fs_status_text(ret_val) << ")" << std::endl;
+        }
+    }
+
+    else if (cmd == "apply-delta") {
+        if (cmd_line.size() != 2) {
+            std::cout << "Usage: apply-delta <hostfile>\n";
+            return 0;
+        }
+        arg1 = cmd_line[1];
+        // check return value so everything is ok
+        ret_val = fs.apply_delta(arg1);
+        if (ret_val) {
+            std::cout << "Error: apply-delta " << arg1;
+            std::cout << " failed, error code " << ret_val << " (" << fs_status_text(ret_val) << ")" << std::endl;
+        }
+    }
+
+    else if (cmd == "fsck") {
+        if (cmd_line.size() > 2 || (cmd_line.size() == 2 && cmd_line[1] != "-r")) {
+            std::cout << "Usage: fsck [-r]\n";
+            return 0;
+        }
+        // check return value so everything is ok
+        ret_val = fs.fsck(cmd_line.size() == 2);
+        if (ret_val) {
+            std::cout << "Error: fsck failed, error code " << ret_val << " (" << fs_status_text(ret_val) << ")" << std::endl;
+        }
+    }
+
+    else if (cmd == "defrag") {
+        if (cmd_line.size() > 2 || (cmd_line.size() == 2 && cmd_line[1] != "-n")) {
+            std::cout << "Usage: defrag [-n]\n";
+            return 0;
+        }
+        // check return value so everything is ok
+        ret_val = fs.defrag(cmd_line.size() == 2);
+        if (ret_val) {
+            std::cout << "Error: defrag failed, error code " << ret_val << " (" << fs_status_text(ret_val) << ")" << std::endl;
+        }
+    }
+
+    else if (cmd == "compress") {
+        if (cmd_line.size() != 2 || (cmd_line[1] != "on" && cmd_line[1] != "off")) {
+            std::cout << "Usage: compress <on|off>\n";
+            return 0;
+        }
+        // check return value so everything is ok
+        ret_val = fs.set_compression(cmd_line[1] == "on");
+        if (ret_val) {
+            std::cout << "Error: compress " << cmd_line[1];
+            std::cout << " failed, error code " << ret_val << " (" << fs_status_text(ret_val) << ")" << std::endl;
+        }
+    }
+
+    else if (cmd == "dedup") {
+        if (cmd_line.size() != 2 || (cmd_line[1] != "on" && cmd_line[1] != "off")) {
+            std::cout << "Usage: dedup <on|off>\n";
+            return 0;
+        }
+        // check return value so everything is ok
+        ret_val = fs.set_dedup(cmd_line[1] == "on");
+        if (ret_val) {
+            std::cout << "Error: dedup " << cmd_line[1];
+            std::cout << " failed, error code " << ret_val << " (" << fs_status_text(ret_val) << ")" << std::endl;
+        }
+    }
+
+    else if (cmd == "record") {
+        if (cmd_line.size() != 2) {
+            std::cout << "Usage: record <tracefile|off>\n";
+            return 0;
+        }
+        // check return value so everything is ok
+        ret_val = fs.record(cmd_line[1] == "off" ? "" : cmd_line[1]);
+        if (ret_val) {
+            std::cout << "Error: record " << cmd_line[1];
+            std::cout << " failed, error code " << ret_val << " (" << fs_status_text(ret_val) << ")" << std::endl;
+        }
+    }
+
+    else if (cmd == "durability") {
+        if (cmd_line.size() < 2 || cmd_line.size() > 4) {
+            std::cout << "Usage: durability <block|command|group> [ms] [blocks]\n";
+            return 0;
+        }
+        int policy;
+        if (cmd_line[1] == "block")
+            policy = FLUSH_BLOCK;
+        else if (cmd_line[1] == "command")
+            policy = FLUSH_COMMAND;
+        else if (cmd_line[1] == "group")
+            policy = FLUSH_GROUP;
         else {
-            std::cout << "Available commands:\n";
-            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, help, quit\n";
+            std::cout << "Usage: durability <block|command|group> [ms] [blocks]\n";
+            return 0;
+        }
+        unsigned long long group_ms = GROUP_COMMIT_MS;
+        unsigned long long group_blocks = GROUP_COMMIT_BLOCKS;
+        if ((cmd_line.size() > 2 && !parse_number(cmd_line[2], UINT32_MAX, group_ms)) ||
+            (cmd_line.size() > 3 && !parse_number(cmd_line[3], UINT32_MAX, group_blocks))) {
+            std::cout << "Usage: durability <block|command|group> [ms] [blocks]\n";
+            return 0;
         }
+        // check return value so everything is ok
+        ret_val = fs.set_durability(policy, group_ms, group_blocks);
+        if (ret_val) {
+            std::cout << "Error: durability " << cmd_line[1];
+            std::cout << " failed, error code " << ret_val << " (" << fs_status_text(ret_val) << ")" << std::endl;
+        }
+    }
+
+    else {
+        std::cout << "Available commands:\n";
+        std::cout << "format, create, cat, ls, cp, mv, rm, append, write, truncate, import-tree, export-tree, open, fread, fwrite, seek, close, mkdir, cd, pwd, chmod, sync, durability, df, fsck, defrag, compress, dedup, record, snapshot, snapshots, snapshot-rm, export-delta, apply-delta, mount, umount, volumes, help, quit\n";
     }
+    return ret_val;
 }
@@ -1,5 +1,6 @@
 #include <iostream>
 #include "fs.h"
+#include "volumes.h"
 
 #ifndef __SHELL_H__
 #define __SHELL_H__
@@ -7,6 +8,11 @@
 class Shell {
 private:
     FS filesystem;
+    // the disks mounted with mount, "/<name>/<path>" is a path on one of them
+    Volumes volumes;
+    // the volume of the working directory, empty for 'filesystem'
+    std::string current;
+    int execute(FS &fs, std::vector<std::string> &cmd_line, const std::string &target);
 public:
     Shell();
     ~Shell();
@@ -0,0 +1,300 @@
+/******************************************************************************
+ *             File : test_script6.cpp
+ *
+ * Test program for crash consistency: durability policies, the metadata
+ * journal, the superblock and fsck. Follows the layout of test_script1-5.
+ *****************************************************************************/
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <cstring>
+#include <cstdio>
+#include <thread>
+#include <chrono>
+#include <unistd.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include "test_script.h"
+#include "fs.h"
+
+#define PRINTDIV std::cout <<  "================================================================================" << std::endl
+#define PRINTDIV2 std::cout << "----------------------------------------" << std::endl
+
+Shell::Shell()
+{
+    std::cout << "Creating and starting shell...\n";
+}
+
+Shell::~Shell()
+{
+    std::cout << "Exiting shell...\n";
+}
+
+void
+Shell::run()
+{
+    std::string arg1;
+    int ret_val = 0;
+    int fw;
+
+    PRINTDIV;
+    std::cout << "\\ / \\ / \\ / \\ / \\ / \\ / \\     new test session     / \\ / \\ / \\ / \\ / \\ / \\ / \\ /" << std::endl;
+    PRINTDIV;
+    std::cout << "Starting test sequence..." << std::endl;
+    PRINTDIV;
+    std::cout << "Task 6 ..." << std::endl;
+    PRINTDIV2;
+
+    std::cout << "Testing group commit, sync and df..." << std::endl;
+    filesystem.format();
+    ret_val = filesystem.set_durability(FLUSH_GROUP, 1000, 64);
+    if (ret_val) {
+        std::cout << "Error: durability failed, error code " << ret_val << std::endl;
+    }
+    fw = open("input1.txt", O_RDONLY);
+    dup2(fw, 0);
+    arg1 = "f1";
+    filesystem.create(arg1);
+    close(fw);
+    fw = open("input2.txt", O_RDONLY);
+    dup2(fw, 0);
+    arg1 = "f2";
+    filesystem.create(arg1);
+    close(fw);
+    filesystem.mkdir("d1");
+    filesystem.cp("f1", "/d1");
+    ret_val = filesystem.sync();
+    if (ret_val) {
+        std::cout << "Error: sync failed, error code " << ret_val << std::endl;
+    }
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "Blocks\t Free" << std::endl;
+    std::cout << "2048\t 2012" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.df();
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "hej heja hejare hejast" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.cat("f2");
+    PRINTDIV2;
+
+    std::cout << "Testing that an idle group is committed by the flusher..." << std::endl;
+    filesystem.set_durability(FLUSH_GROUP, 200, 64);
+    filesystem.create("f3", "idle", 4);
+    // looks for f3 in the root directory block of the disk file, not in the buffer
+    auto on_disk = [](const char *name) {
+        dir_entry entries[BLOCK_SIZE / sizeof(dir_entry)];
+        int fd = open(DISKNAME, O_RDONLY);
+        ssize_t got = pread(fd, entries, BLOCK_SIZE, ROOT_BLOCK * BLOCK_SIZE);
+        close(fd);
+        for (unsigned i = 0; got == BLOCK_SIZE && i < BLOCK_SIZE / sizeof(dir_entry); i++) {
+            if (strcmp(entries[i].file_name, name) == 0)
+                return 1;
+        }
+        return 0;
+    };
+    int buffered = on_disk("f3");
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "0 1" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    std::cout << buffered << " " << on_disk("f3") << std::endl;
+    filesystem.rm("f3");
+    PRINTDIV2;
+
+    std::cout << "Testing fsck on a consistent disk..." << std::endl;
+    filesystem.set_durability(FLUSH_COMMAND);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "Files\t Dirs\t Used blocks\t Orphans\t Bad chains\t Cross-linked\t Size mismatch\t Refcounts" << std::endl;
+    std::cout << "3\t 2\t 36\t\t 0\t\t 0\t\t 0\t\t 0\t\t 0" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    ret_val = filesystem.fsck(false);
+    if (ret_val) {
+        std::cout << "Error: fsck failed, error code " << ret_val << std::endl;
+    }
+    PRINTDIV2;
+
+    std::cout << "Leaking block 1000 behind the back of the file system..." << std::endl;
+    int16_t leaked = FAT_EOF;
+    fw = open(DISKNAME, O_WRONLY);
+    if (pwrite(fw, &leaked, sizeof(leaked), FAT_BLOCK * BLOCK_SIZE + 1000 * sizeof(int16_t)) != sizeof(leaked)) {
+        std::cout << "Error: could not write " << DISKNAME << std::endl;
+    }
+    close(fw);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "... 1 orphan block, then repaired, then a clean disk" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.fsck(false);
+    filesystem.fsck(true);
+    filesystem.fsck(false);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "Blocks\t Free" << std::endl;
+    std::cout << "2048\t 2012" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.df();
+    PRINTDIV2;
+
+    std::cout << "Testing the replay of a logged transaction after a crash..." << std::endl;
+    // a second disk, so the one of the shell is not opened twice
+    const char *crashdisk = "journal.test.bin";
+    unlink(crashdisk);
+    {
+        FS fs(nullptr, crashdisk);
+        fs.format();
+    }
+    // logs 60 blocks, more than the journal region holds, and stops before
+    // they are written to their home blocks 200-259, like a crash would
+    std::map<unsigned, std::vector<uint8_t> > blocks;
+    for (unsigned b = 200; b < 260; b++)
+        blocks[b].assign(BLOCK_SIZE, 'a' + b % 26);
+    std::vector<unsigned> spare;
+    {
+        Disk disk(crashdisk);
+        Journal journal(JOURNAL_BLOCK, JOURNAL_BLOCKS, FAT_BLOCK);
+        journal.replay(disk);
+        ret_val = journal.log(disk, blocks, spare);
+    }
+    uint8_t home[BLOCK_SIZE];
+    fw = open(crashdisk, O_RDWR);
+    bool untouched = pread(fw, home, BLOCK_SIZE, 259 * BLOCK_SIZE) == BLOCK_SIZE && home[0] == 0;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "Journal: replaying transaction 3 (60 blocks)" << std::endl;
+    std::cout << "0 29 1 60" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    {
+        FS fs(nullptr, crashdisk);
+    }
+    unsigned replayed = 0;
+    for (unsigned b = 200; b < 260; b++)
+        if (pread(fw, home, BLOCK_SIZE, (off_t)b * BLOCK_SIZE) == BLOCK_SIZE && home[0] == 'a' + b % 26 &&
+            home[BLOCK_SIZE - 1] == 'a' + b % 26)
+            replayed++;
+    std::cout << ret_val << " " << spare.size() << " " << untouched << " " << replayed << std::endl;
+
+    // a transaction whose logged copy is damaged never happened
+    blocks.clear();
+    blocks[300].assign(BLOCK_SIZE, 'x');
+    blocks[301].assign(BLOCK_SIZE, 'y');
+    {
+        Disk disk(crashdisk);
+        Journal journal(JOURNAL_BLOCK, JOURNAL_BLOCKS, FAT_BLOCK);
+        journal.replay(disk);
+        journal.log(disk, blocks, spare);
+    }
+    uint8_t damaged = 'z';
+    ret_val = pwrite(fw, &damaged, 1, (JOURNAL_BLOCK + 2) * BLOCK_SIZE + 100) != 1;
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "Journal: incomplete transaction 6, discarding it" << std::endl;
+    std::cout << "0 1 0" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    {
+        FS fs(nullptr, crashdisk);
+    }
+    bool discarded = pread(fw, home, BLOCK_SIZE, 300 * BLOCK_SIZE) == BLOCK_SIZE && home[0] == 0;
+    journal_header header;
+    ret_val += pread(fw, &header, sizeof(header), JOURNAL_BLOCK * BLOCK_SIZE) != sizeof(header);
+    close(fw);
+    unlink(crashdisk);
+    std::cout << ret_val << " " << discarded << " " << header.count << std::endl;
+    PRINTDIV2;
+
+    std::cout << "Testing defrag of fragmented files..." << std::endl;
+    // g2 leaves a hole of 3 blocks, g4 fills it and goes on after g3
+    std::string pieces[4];
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < (i == 3 ? 6 : 3) * BLOCK_SIZE / 8; j++)
+            pieces[i] += std::to_string(1000000 + i * 100000 + j).substr(0, 7) + " ";
+    }
+    filesystem.create("g1", pieces[0].c_str(), pieces[0].length());
+    filesystem.create("g2", pieces[1].c_str(), pieces[1].length());
+    filesystem.create("g3", pieces[2].c_str(), pieces[2].length());
+    filesystem.rm("g2");
+    filesystem.create("g4", pieces[3].c_str(), pieces[3].length());
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "Name \t Blocks \t Fragments \t Score " << std::endl;
+    std::cout << "---- \t ------ \t --------- \t ----- " << std::endl;
+    std::cout << "/g1\t 3\t\t 1\t\t 0%" << std::endl;
+    std::cout << "/g4\t 6\t\t 2\t\t 20%" << std::endl;
+    std::cout << "/g3\t 3\t\t 1\t\t 0%" << std::endl;
+    std::cout << "3 files, fragmentation 11%, 1 files moved, fragmentation now 0%" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    defrag_stats stats;
+    ret_val = filesystem.defrag(false, stats);
+    if (ret_val) {
+        std::cout << "Error: defrag failed, error code " << ret_val << std::endl;
+    }
+    filesystem.set_console(nullptr);
+    std::ostringstream moved, kept;
+    filesystem.cat("g4", moved);
+    filesystem.cat("g3", kept);
+    fsck_report defragged;
+    filesystem.fsck(false, defragged);
+    filesystem.set_console(&std::cout);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "same same 0 0 0 0 0" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    std::cout << (moved.str() == pieces[3] ? "same" : "different") << " " << (kept.str() == pieces[2] ? "same" : "different")
+              << " " << defragged.orphan_blocks << " " << defragged.bad_chains << " " << defragged.cross_linked << " "
+              << defragged.size_mismatch << " " << defragged.bad_refcounts << std::endl;
+    filesystem.rm("g1");
+    filesystem.rm("g3");
+    filesystem.rm("g4");
+    PRINTDIV2;
+
+    std::cout << "Testing hole punching of freed blocks and of zero blocks..." << std::endl;
+    const char *trimdisk = "trim.test.bin";
+    unlink(trimdisk);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "No disk file found..." << std::endl;
+    std::cout << "Creating disk file: " << trimdisk << std::endl;
+    std::cout << "1 1 1 1" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    uint8_t written[BLOCK_SIZE];
+    long long full, holed, rezeroed;
+    {
+        Disk disk(trimdisk);
+        memset(written, 'a', BLOCK_SIZE);
+        for (unsigned b = 100; b < 104; b++)
+            disk.write(b, written);
+        full = disk.host_bytes();
+        // freed blocks are punched out once the FAT that frees them is committed
+        for (unsigned b = 100; b < 104; b++)
+            disk.trim(b);
+        disk.sync();
+        holed = disk.host_bytes();
+        // a block of zeroes is punched instead of written
+        disk.write(200, written);
+        memset(written, 0, BLOCK_SIZE);
+        disk.write(200, written);
+        rezeroed = disk.host_bytes();
+        // a block that is freed and reused before the commit keeps its new data
+        disk.set_policy(FLUSH_COMMAND);
+        memset(written, 'c', BLOCK_SIZE);
+        disk.write(300, written);
+        disk.sync();
+        disk.trim(300);
+        memset(written, 'd', BLOCK_SIZE);
+        disk.write(300, written);
+        disk.sync();
+    }
+    // the disk file itself, past every buffer of the disk layer
+    auto filled = [trimdisk](unsigned block_no, uint8_t byte) {
+        uint8_t data[BLOCK_SIZE];
+        int fd = open(trimdisk, O_RDONLY);
+        bool same = pread(fd, data, BLOCK_SIZE, (off_t)block_no * BLOCK_SIZE) == BLOCK_SIZE;
+        close(fd);
+        for (unsigned i = 0; same && i < BLOCK_SIZE; i++)
+            same = data[i] == byte;
+        return same;
+    };
+    std::cout << (holed < full) << " " << (filled(101, 0) && filled(103, 0)) << " "
+              << (filled(200, 0) && rezeroed == holed) << " " << filled(300, 'd') << std::endl;
+    unlink(trimdisk);
+    PRINTDIV2;
+
+    std::cout << "... Task 6 done" << std::endl;
+    PRINTDIV;
+}
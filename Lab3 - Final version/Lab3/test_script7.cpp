@@ -0,0 +1,215 @@
+/******************************************************************************
+ *             File : test_script7.cpp
+ *
+ * Test program for storage efficiency: compressed files and dedup. Follows
+ * the layout of test_script1-6.
+ *****************************************************************************/
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <unistd.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include "test_script.h"
+#include "fs.h"
+#include "scan.h"
+
+#define PRINTDIV std::cout <<  "================================================================================" << std::endl
+#define PRINTDIV2 std::cout << "----------------------------------------" << std::endl
+
+Shell::Shell()
+{
+    std::cout << "Creating and starting shell...\n";
+}
+
+Shell::~Shell()
+{
+    std::cout << "Exiting shell...\n";
+}
+
+void
+Shell::run()
+{
+    std::string arg1;
+    int ret_val = 0;
+    int fw;
+
+    PRINTDIV;
+    std::cout << "\\ / \\ / \\ / \\ / \\ / \\ / \\     new test session     / \\ / \\ / \\ / \\ / \\ / \\ / \\ /" << std::endl;
+    PRINTDIV;
+    std::cout << "Starting test sequence..." << std::endl;
+    PRINTDIV;
+    std::cout << "Task 7 ..." << std::endl;
+    PRINTDIV2;
+
+    std::cout << "Testing compressed files..." << std::endl;
+    filesystem.format();
+    ret_val = filesystem.set_compression(true);
+    if (ret_val) {
+        std::cout << "Error: compress failed, error code " << ret_val << std::endl;
+    }
+    fw = open("input3.txt", O_RDONLY);
+    dup2(fw, 0);
+    arg1 = "f4129";
+    filesystem.create(arg1);
+    close(fw);
+    filesystem.set_compression(false);
+    fw = open("input2.txt", O_RDONLY);
+    dup2(fw, 0);
+    arg1 = "f2";
+    filesystem.create(arg1);
+    close(fw);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "f4129\t 4129\t rw-\t\t file" << std::endl;
+    std::cout << "f2\t 23\t rw-\t\t file" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.ls();
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "Blocks\t Free" << std::endl;
+    std::cout << "2048\t 2012" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.df();
+    filesystem.cp("f4129", "f4129copy");
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "16 lines of 0123456789ABCDEF (256 chars each), then XXXXXXXXXXXXXXXX" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.cat("f4129copy");
+    PRINTDIV2;
+
+    std::cout << "Testing append to a compressed file..." << std::endl;
+    filesystem.append("f2", "f4129");
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "... the 16 lines, then XXXXXXXXXXXXXXXX, then hej heja hejare hejast" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.cat("f4129");
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "Files\t Dirs\t Used blocks\t Orphans\t Bad chains\t Cross-linked\t Size mismatch\t Refcounts" << std::endl;
+    std::cout << "3\t 1\t 38\t\t 0\t\t 0\t\t 0\t\t 0\t\t 0" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    ret_val = filesystem.fsck(false);
+    if (ret_val) {
+        std::cout << "Error: fsck failed, error code " << ret_val << std::endl;
+    }
+    PRINTDIV2;
+
+    std::cout << "Testing dedup of identical files..." << std::endl;
+    filesystem.format();
+    ret_val = filesystem.set_dedup(true);
+    if (ret_val) {
+        std::cout << "Error: dedup failed, error code " << ret_val << std::endl;
+    }
+    fw = open("input3.txt", O_RDONLY);
+    dup2(fw, 0);
+    arg1 = "f1";
+    filesystem.create(arg1);
+    close(fw);
+    fw = open("input3.txt", O_RDONLY);
+    dup2(fw, 0);
+    arg1 = "f2";
+    filesystem.create(arg1);
+    close(fw);
+    filesystem.cp("f1", "f3");
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "Blocks\t Free" << std::endl;
+    std::cout << "2048\t 2011" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.df();
+    filesystem.rm("f1");
+    filesystem.append("f2", "f3");
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "Files\t Dirs\t Used blocks\t Orphans\t Bad chains\t Cross-linked\t Size mismatch\t Refcounts" << std::endl;
+    std::cout << "2\t 1\t 40\t\t 0\t\t 0\t\t 0\t\t 0\t\t 0" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    ret_val = filesystem.fsck(false);
+    if (ret_val) {
+        std::cout << "Error: fsck failed, error code " << ret_val << std::endl;
+    }
+    filesystem.set_dedup(false);
+    PRINTDIV2;
+
+    std::cout << "Testing small files stored inline in the directory..." << std::endl;
+    filesystem.format();
+    fw = open("input2.txt", O_RDONLY);
+    dup2(fw, 0);
+    arg1 = "f1";
+    filesystem.create(arg1);
+    close(fw);
+    filesystem.cp("f1", "f2");
+    filesystem.append("f2", "f1");
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "Blocks\t Free" << std::endl;
+    std::cout << "2048\t 2013" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.df();
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "hej heja hejare hejast" << std::endl;
+    std::cout << "hej heja hejare hejast" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.cat("f1");
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "Files\t Dirs\t Used blocks\t Orphans\t Bad chains\t Cross-linked\t Size mismatch\t Refcounts" << std::endl;
+    std::cout << "2\t 1\t 35\t\t 0\t\t 0\t\t 0\t\t 0\t\t 0" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    ret_val = filesystem.fsck(false);
+    if (ret_val) {
+        std::cout << "Error: fsck failed, error code " << ret_val << std::endl;
+    }
+    PRINTDIV2;
+
+    std::cout << "Testing the scan kernels against a byte loop..." << std::endl;
+    // odd lengths and offsets, so the scalar tail after the vector loops runs
+    // too. The kernels the CPU does not have fall back to the next one.
+    const char *isas[] = { "avx2", "sse2", "scalar" };
+    unsigned mismatches[4] = { 0, 0, 0, 0 };
+    std::vector<uint8_t> a(BLOCK_SIZE + 64), b(BLOCK_SIZE + 64);
+    for (int k = 0; k < 3; k++) {
+        scan_select(isas[k]);
+        for (size_t offset = 0; offset < 4; offset++) {
+            for (size_t length = 0; length <= BLOCK_SIZE + 1; length = length < 300 ? length + 1 : length + 947) {
+                for (size_t mark = 0; mark <= length; mark += 1 + length / 5) {
+                    std::fill(a.begin(), a.end(), 0);
+                    if (mark < length)
+                        a[offset + mark] = 7;
+                    // 'b' differs from 'a' at an odd mark, and past the end
+                    b = a;
+                    if (mark < length && mark % 2)
+                        b[offset + mark] ^= 1;
+                    b[offset + length] = 1;
+                    // a byte just past the end must not be seen
+                    a[offset + length] = 7;
+                    const uint8_t *p = a.data() + offset;
+                    size_t first = 0;
+                    while (first < length && p[first] != 7)
+                        first++;
+                    mismatches[0] += scan_byte(p, length, 7) != first;
+                    bool zero = first == length;
+                    mismatches[1] += scan_zero(p, length) != zero;
+                    bool equal = memcmp(p, b.data() + offset, length) == 0;
+                    mismatches[2] += scan_equal(p, b.data() + offset, length) != equal;
+                    // words of the same bytes, with the mark as a word of its own
+                    int16_t words[BLOCK_SIZE / 2 + 8];
+                    size_t count = length / 2;
+                    memset(words, 0, sizeof(words));
+                    words[count] = -1;
+                    if (mark < count)
+                        words[mark] = -1;
+                    size_t word = mark < count ? mark : count;
+                    mismatches[3] += scan_word(words, count, -1) != word;
+                }
+            }
+        }
+    }
+    scan_select(nullptr);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "0 0 0 0" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    std::cout << mismatches[0] << " " << mismatches[1] << " " << mismatches[2] << " " << mismatches[3] << std::endl;
+    PRINTDIV2;
+
+    std::cout << "... Task 7 done" << std::endl;
+    PRINTDIV;
+}
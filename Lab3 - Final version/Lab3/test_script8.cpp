@@ -0,0 +1,654 @@
+/******************************************************************************
+ *             File : test_script8.cpp
+ *
+ * Test program for random access: write at an offset, truncate and file
+ * descriptors. Follows the layout of test_script1-7.
+ *****************************************************************************/
+
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <string>
+#include <algorithm>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "test_script.h"
+#include "fs.h"
+#include "trace.h"
+#include "volumes.h"
+
+#define PRINTDIV std::cout <<  "================================================================================" << std::endl
+#define PRINTDIV2 std::cout << "----------------------------------------" << std::endl
+
+Shell::Shell()
+{
+    std::cout << "Creating and starting shell...\n";
+}
+
+Shell::~Shell()
+{
+    std::cout << "Exiting shell...\n";
+}
+
+void
+Shell::run()
+{
+    std::string arg1;
+    int ret_val = 0;
+    int fw;
+
+    PRINTDIV;
+    std::cout << "\\ / \\ / \\ / \\ / \\ / \\ / \\     new test session     / \\ / \\ / \\ / \\ / \\ / \\ / \\ /" << std::endl;
+    PRINTDIV;
+    std::cout << "Starting test sequence..." << std::endl;
+    PRINTDIV;
+    std::cout << "Task 8 ..." << std::endl;
+    PRINTDIV2;
+
+    std::cout << "Testing write in the middle of a small file..." << std::endl;
+    filesystem.format();
+    fw = open("input2.txt", O_RDONLY);
+    dup2(fw, 0);
+    arg1 = "f1";
+    filesystem.create(arg1);
+    close(fw);
+    ret_val = filesystem.write("f1", 4, "HEJA", 4);
+    if (ret_val) {
+        std::cout << "Error: write failed, error code " << ret_val << std::endl;
+    }
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "hej HEJA hejare hejast" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.cat("f1");
+    PRINTDIV2;
+
+    std::cout << "Testing write and truncate of a file with blocks..." << std::endl;
+    fw = open("input3.txt", O_RDONLY);
+    dup2(fw, 0);
+    arg1 = "f2";
+    filesystem.create(arg1);
+    close(fw);
+    filesystem.write("f2", 4096, "YYYY", 4);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "Blocks\t Free" << std::endl;
+    std::cout << "2048\t 2011" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.df();
+    filesystem.write("f2", 12000, "end", 4);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "name\t size" << std::endl;
+    std::cout << "f1\t 23" << std::endl;
+    std::cout << "f2\t 12004" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.ls();
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "Files\t Dirs\t Used blocks\t Orphans\t Bad chains\t Cross-linked\t Size mismatch\t Refcounts" << std::endl;
+    std::cout << "2\t 1\t 38\t\t 0\t\t 0\t\t 0\t\t 0\t\t 0" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.fsck(false);
+    ret_val = filesystem.truncate("f2", 100);
+    if (ret_val) {
+        std::cout << "Error: truncate failed, error code " << ret_val << std::endl;
+    }
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "0123456789ABCDEF0123456789ABCDEF0123456789ABCDEF0123456789ABCDEF0123456789ABCDEF0123456789ABCDEF0123" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.cat("f2");
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "Files\t Dirs\t Used blocks\t Orphans\t Bad chains\t Cross-linked\t Size mismatch\t Refcounts" << std::endl;
+    std::cout << "2\t 1\t 36\t\t 0\t\t 0\t\t 0\t\t 0\t\t 0" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.fsck(false);
+    PRINTDIV2;
+
+    std::cout << "Testing open, seek, read and write with a file descriptor..." << std::endl;
+    int fd = filesystem.open("f2", READ | WRITE);
+    if (fd < 0) {
+        std::cout << "Error: open failed" << std::endl;
+    }
+    filesystem.seek(fd, 96);
+    ret_val = filesystem.write(fd, "WXYZ", 4);
+    if (ret_val != 4) {
+        std::cout << "Error: write failed, returned " << ret_val << std::endl;
+    }
+    filesystem.seek(fd, 90);
+    char data[16] = { 0 };
+    ret_val = filesystem.read(fd, data, 10);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "10 ABCDEFWXYZ" << std::endl;
+    std::cout << "0" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    std::cout << ret_val << " " << data << std::endl;
+    std::cout << filesystem.read(fd, data, 10) << std::endl;
+    filesystem.rm("f2");
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "... some error message" << std::endl;
+    std::cout << "-13" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    std::cout << filesystem.read(fd, data, 10) << std::endl;
+    filesystem.close(fd);
+    PRINTDIV2;
+
+    std::cout << "Testing a descriptor of a file that was removed and created again..." << std::endl;
+    filesystem.create("g", "first-AA", 8);
+    fd = filesystem.open("g", READ | WRITE);
+    filesystem.rm("g");
+    // the new file takes the slot of the old one, and is read only
+    filesystem.create("g", "other-BB", 8);
+    filesystem.chmod("4", "g");
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "... some error messages" << std::endl;
+    std::cout << "-13 -13 -4 6 rights other-BB" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    memset(data, 0, sizeof(data));
+    int stale_read = filesystem.read(fd, data, 8);
+    int stale_write = filesystem.write(fd, "XXXX", 4);
+    filesystem.close(fd);
+    filesystem.create("h", "rights", 6);
+    fd = filesystem.open("h", READ | WRITE);
+    filesystem.chmod("4", "h");
+    int denied = filesystem.write(fd, "XXXX", 4);
+    int allowed = filesystem.read(fd, data, 6);
+    filesystem.close(fd);
+    std::ostringstream kept;
+    filesystem.set_console(nullptr);
+    filesystem.cat("g", kept);
+    filesystem.set_console(&std::cout);
+    std::cout << stale_read << " " << stale_write << " " << denied << " " << allowed << " " << data << " " << kept.str().substr(0, 8) << std::endl;
+    filesystem.chmod("6", "g");
+    filesystem.chmod("6", "h");
+    filesystem.rm("g");
+    filesystem.rm("h");
+    PRINTDIV2;
+
+    std::cout << "Testing cp -r and rm -r of a directory tree..." << std::endl;
+    filesystem.mkdir("d1");
+    filesystem.mkdir("d1/d2");
+    fw = open("input3.txt", O_RDONLY);
+    dup2(fw, 0);
+    arg1 = "d1/d2/f3";
+    filesystem.create(arg1);
+    close(fw);
+    filesystem.cp("f1", "/d1");
+    ret_val = filesystem.copy_tree("d1", "d3");
+    if (ret_val) {
+        std::cout << "Error: cp -r failed, error code " << ret_val << std::endl;
+    }
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "hej HEJA hejare hejast" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.cat("d3/f1");
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "Files\t Dirs\t Used blocks\t Orphans\t Bad chains\t Cross-linked\t Size mismatch\t Refcounts" << std::endl;
+    std::cout << "5\t 5\t 43\t\t 0\t\t 0\t\t 0\t\t 0\t\t 0" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.fsck(false);
+    ret_val = filesystem.remove_tree("d1");
+    if (ret_val) {
+        std::cout << "Error: rm -r failed, error code " << ret_val << std::endl;
+    }
+    filesystem.remove_tree("d3");
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "Files\t Dirs\t Used blocks\t Orphans\t Bad chains\t Cross-linked\t Size mismatch\t Refcounts" << std::endl;
+    std::cout << "1\t 1\t 35\t\t 0\t\t 0\t\t 0\t\t 0\t\t 0" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.fsck(false);
+    PRINTDIV2;
+
+    std::cout << "Testing import-tree and export-tree..." << std::endl;
+    mkdir("hosttree", 0755);
+    mkdir("hosttree/sub", 0755);
+    FILE *host = fopen("hosttree/a.txt", "w");
+    fputs("first line\nsecond line\n", host);
+    fclose(host);
+    host = fopen("hosttree/sub/b.txt", "w");
+    for (int i = 0; i < 500; i++) {
+        fprintf(host, "line %d of b\n", i);
+    }
+    fclose(host);
+    ret_val = filesystem.import_tree("hosttree", "t");
+    if (ret_val) {
+        std::cout << "Error: import-tree failed, error code " << ret_val << std::endl;
+    }
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "first line" << std::endl;
+    std::cout << "second line" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.cat("t/a.txt");
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "Files\t Dirs\t Used blocks\t Orphans\t Bad chains\t Cross-linked\t Size mismatch\t Refcounts" << std::endl;
+    std::cout << "3\t 3\t 39\t\t 0\t\t 0\t\t 0\t\t 0\t\t 0" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.fsck(false);
+    ret_val = filesystem.export_tree("t", "hosttree_out");
+    if (ret_val) {
+        std::cout << "Error: export-tree failed, error code " << ret_val << std::endl;
+    }
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "same" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    ret_val = system("cmp -s hosttree/sub/b.txt hosttree_out/sub/b.txt && cmp -s hosttree/a.txt hosttree_out/a.txt");
+    std::cout << (ret_val == 0 ? "same" : "different") << std::endl;
+    ret_val = system("rm -rf hosttree hosttree_out");
+    filesystem.remove_tree("t");
+    PRINTDIV2;
+
+    std::cout << "Testing stat, list, create from a buffer and rm by path..." << std::endl;
+    filesystem.mkdir("/d4");
+    ret_val = filesystem.create("/d4/f5", "abc", 4);
+    if (ret_val) {
+        std::cout << "Error: create failed, error code " << ret_val << std::endl;
+    }
+    dir_entry entry;
+    std::vector<dir_entry> entries;
+    filesystem.stat("/d4/f5", entry);
+    filesystem.list("/d4", entries);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "f5 4 1" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    std::cout << entry.file_name << " " << entry.size << " " << entries.size() << std::endl;
+    filesystem.rm("/d4/f5");
+    filesystem.list("/d4", entries);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "0" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    std::cout << entries.size() << std::endl;
+    filesystem.remove_tree("/d4");
+    PRINTDIV2;
+
+    std::cout << "Testing the FS without a console..." << std::endl;
+    filesystem.set_console(nullptr);
+    filesystem.create("f6", "one\0two", 8);
+    std::ostringstream content;
+    ret_val = filesystem.cat("f6", content);
+    int missing = filesystem.cat("f7", content);
+    int fd_missing = filesystem.open("f7", READ);
+    std::string path;
+    filesystem.pwd(path);
+    filesystem.rm("f6");
+    filesystem.set_console(&std::cout);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "0 one|two| -2 -2 no such file or directory .." << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    std::string text = content.str();
+    std::replace(text.begin(), text.end(), '\n', '|');
+    std::cout << ret_val << " " << text << " " << missing << " " << fd_missing << " "
+              << fs_status_text(missing) << " " << path << std::endl;
+    PRINTDIV2;
+
+    std::cout << "Testing ls -l of a path and opendir/readdir..." << std::endl;
+    filesystem.mkdir("d5");
+    filesystem.create("d5/small", "abc", 4);
+    fw = open("input3.txt", O_RDONLY);
+    dup2(fw, 0);
+    arg1 = "d5/big";
+    filesystem.create(arg1);
+    close(fw);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "Name\t Size\t Access rights\t Type\t First block\t Blocks\t Flags" << std::endl;
+    std::cout << "big\t 4129\t rw-\t\t file\t 36\t\t 2\t\t -" << std::endl;
+    std::cout << "small\t 4\t rw-\t\t file\t 63\t\t 0\t\t i" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.ls("/d5", true);
+    dir_stream dir;
+    unsigned count = 0;
+    filesystem.opendir("d5", dir);
+    while (filesystem.readdir(dir) != nullptr) {
+        count++;
+    }
+    ret_val = filesystem.opendir("d5/big", dir);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "2 -5" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    std::cout << count << " " << ret_val << std::endl;
+    filesystem.remove_tree("d5");
+    PRINTDIV2;
+
+    std::cout << "Testing the arena of the command temporaries..." << std::endl;
+    Arena arena;
+    for (int command = 0; command < 3; command++) {
+        ArenaScope scope(arena);
+        block_list chain(arena);
+        for (int i = 0; i < 2048; i++) {
+            chain.push_back(i);
+        }
+        uint8_t *staging = arena.alloc<uint8_t>(16 * BLOCK_SIZE);
+        memset(staging, command, 16 * BLOCK_SIZE);
+    }
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "1 0" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    std::cout << arena.heap_chunks() << " " << arena.used() << std::endl;
+    PRINTDIV2;
+
+    std::cout << "Testing files larger than the streaming buffers..." << std::endl;
+    mkdir("hostbig", 0755);
+    host = fopen("hostbig/big.txt", "w");
+    for (int i = 0; i < 80000; i++) {
+        fprintf(host, "line %05d of big\n", i);
+    }
+    fclose(host);
+    ret_val = filesystem.import_tree("hostbig", "tb");
+    if (ret_val == 0) {
+        ret_val = filesystem.copy_tree("tb", "tc");
+    }
+    if (ret_val == 0) {
+        ret_val = filesystem.export_tree("tc", "hostbig_out");
+    }
+    if (ret_val) {
+        std::cout << "Error: the round trip failed, error code " << ret_val << std::endl;
+    }
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "same" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    ret_val = system("cmp -s hostbig/big.txt hostbig_out/big.txt");
+    std::cout << (ret_val == 0 ? "same" : "different") << std::endl;
+    ret_val = system("rm -rf hostbig hostbig_out");
+    filesystem.remove_tree("tb");
+    filesystem.remove_tree("tc");
+    std::string lines;
+    for (int i = 0; i < 500; i++) {
+        lines += "line " + std::to_string(i);
+        lines += '\0';
+    }
+    filesystem.create("f8", lines.c_str(), lines.length());
+    ret_val = filesystem.append("f8", "f8");
+    filesystem.set_console(nullptr);
+    std::ostringstream doubled;
+    filesystem.cat("f8", doubled);
+    filesystem.set_console(&std::cout);
+    filesystem.stat("f8", entry);
+    std::string expected = lines + lines;
+    std::replace(expected.begin(), expected.end(), '\0', '\n');
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "0 " << 2 * lines.length() << " same" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    std::cout << ret_val << " " << entry.size << " " << (doubled.str() == expected ? "same" : "different") << std::endl;
+    filesystem.rm("f8");
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "Files\t Dirs\t Used blocks\t Orphans\t Bad chains\t Cross-linked\t Size mismatch\t Refcounts" << std::endl;
+    std::cout << "1\t 1\t 35\t\t 0\t\t 0\t\t 0\t\t 0\t\t 0" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    filesystem.fsck(false);
+    PRINTDIV2;
+
+    std::cout << "Testing random reads of a compressed file..." << std::endl;
+    filesystem.set_compression(true);
+    std::string numbers;
+    for (int i = 0; i < 4000; i++) {
+        numbers += std::to_string(i * 7919 % 10007) + " ";
+    }
+    filesystem.create("f9", numbers.c_str(), numbers.length());
+    filesystem.set_compression(false);
+    fd = filesystem.open("f9", READ);
+    uint32_t offsets[] = {15000, 100, 19000, 4090, 0};
+    std::string reads;
+    for (int i = 0; i < 5; i++) {
+        char piece[13] = {0};
+        filesystem.seek(fd, offsets[i]);
+        ret_val = filesystem.read(fd, piece, 12);
+        reads += (ret_val == 12 && numbers.compare(offsets[i], 12, piece) == 0) ? "ok " : "bad ";
+    }
+    filesystem.close(fd);
+    filesystem.stat("f9", entry);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "ok ok ok ok ok compressed" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    std::cout << reads << ((entry.type & TYPE_COMPRESSED) ? "compressed" : "plain") << std::endl;
+    filesystem.rm("f9");
+    PRINTDIV2;
+
+    std::cout << "Testing the window of the read-ahead..." << std::endl;
+    std::string chain(200 * BLOCK_SIZE, 'r');
+    filesystem.create("f10", chain.c_str(), chain.length());
+    filesystem.create("f11", chain.c_str(), chain.length());
+    filesystem.set_console(nullptr);
+    std::ostringstream sequential;
+    filesystem.cat("f10", sequential);
+    unsigned grown = filesystem.read_ahead_window();
+    // f11 is read ahead and removed before its blocks are read, they are wasted
+    char head[3 * BLOCK_SIZE];
+    fd = filesystem.open("f11", READ);
+    filesystem.read(fd, head, sizeof(head));
+    filesystem.close(fd);
+    filesystem.rm("f11");
+    fd = filesystem.open("f10", READ);
+    filesystem.read(fd, head, sizeof(head));
+    filesystem.close(fd);
+    unsigned shrunk = filesystem.read_ahead_window();
+    filesystem.set_console(&std::cout);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "same 64 32" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    std::cout << (sequential.str() == chain ? "same" : "different") << " " << grown << " " << shrunk << std::endl;
+    filesystem.rm("f10");
+    PRINTDIV2;
+
+    std::cout << "Testing the recording of a trace..." << std::endl;
+    filesystem.record("trace.bin");
+    filesystem.mkdir("d7");
+    filesystem.create("d7/a", lines.c_str(), 100);
+    fd = filesystem.open("d7/a", READ);
+    char piece[40];
+    filesystem.read(fd, piece, sizeof(piece));
+    filesystem.close(fd);
+    filesystem.remove_tree("d7");
+    filesystem.record("");
+    TraceReader trace;
+    trace_record record;
+    std::string calls;
+    if (trace.open("trace.bin")) {
+        while (trace.next(record)) {
+            calls += std::string(trace_op_name(record.op)) + " " + record.text[0] + " " +
+                     std::to_string(record.num[0]) + "|";
+        }
+    }
+    unlink("trace.bin");
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "mkdir d7 0|create d7/a 100|open d7/a 4|fread  0|close  0|rm -r d7 0|" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    std::cout << calls << std::endl;
+    PRINTDIV2;
+
+    std::cout << "Testing snapshots..." << std::endl;
+    unsigned blocks, free_before, free_after;
+    filesystem.usage(blocks, free_before);
+    filesystem.mkdir("d8");
+    filesystem.create("d8/a", expected.c_str(), expected.length());
+    filesystem.create("d8/s", "abc", 4);
+    ret_val = filesystem.snapshot("s1");
+    filesystem.write("d8/a", 0, "XYZ", 3);
+    filesystem.rm("d8/s");
+    filesystem.append("d8/a", "d8/a");
+    std::vector<snapshot_entry> snaps;
+    filesystem.snapshots(snaps);
+    filesystem.stat("@s1/d8/a", entry);
+    filesystem.list("@s1/d8", entries);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "0 1 s1 " << expected.length() << " 2" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    std::cout << ret_val << " " << snaps.size() << " " << snaps[0].name << " " << entry.size << " "
+              << entries.size() << std::endl;
+    ret_val = filesystem.export_tree("@s1/d8", "snapout");
+    std::ifstream saved("snapout/a");
+    std::string first_line;
+    std::getline(saved, first_line);
+    saved.close();
+    ret_val = system("rm -rf snapout");
+    fsck_report report;
+    filesystem.set_console(nullptr);
+    filesystem.fsck(false, report);
+    std::ostringstream live;
+    filesystem.cat("d8/a", live);
+    filesystem.set_console(&std::cout);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "line 0 XYZe 0 0 0 0" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    std::cout << first_line << " " << live.str().substr(0, 4) << " " << report.orphan_blocks << " "
+              << report.cross_linked << " " << report.bad_refcounts << " " << report.size_mismatch << std::endl;
+    filesystem.snapshot_rm("s1");
+    filesystem.remove_tree("d8");
+    filesystem.usage(blocks, free_after);
+    filesystem.set_console(nullptr);
+    filesystem.fsck(false, report);
+    filesystem.set_console(&std::cout);
+    filesystem.snapshots(snaps);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "0 0 0 0" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    std::cout << snaps.size() << " " << free_before - free_after << " " << report.orphan_blocks << " "
+              << report.bad_refcounts << std::endl;
+    PRINTDIV2;
+
+    std::cout << "Testing a tree with more directories than the journal holds..." << std::endl;
+    filesystem.set_console(nullptr);
+    filesystem.usage(blocks, free_before);
+    filesystem.mkdir("t10");
+    for (int i = 0; i < 40; i++) {
+        std::string dir = "t10/d" + std::to_string(i);
+        filesystem.mkdir(dir);
+        filesystem.create(dir + "/f", expected.c_str(), 5000);
+    }
+    // 41 directory blocks, the FAT and the superblock in one transaction each
+    int tree_copied = filesystem.copy_tree("t10", "t11");
+    int snapped = filesystem.snapshot("big");
+    filesystem.list("t11", entries);
+    filesystem.stat("t11/d39/f", entry);
+    filesystem.fsck(false, report);
+    unsigned listed = entries.size();
+    filesystem.snapshot_rm("big");
+    int removed = filesystem.remove_tree("t11") + filesystem.remove_tree("t10");
+    filesystem.usage(blocks, free_after);
+    filesystem.set_console(&std::cout);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "0 0 40 5000 0 0 0 0" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    std::cout << tree_copied << " " << snapped << " " << listed << " " << entry.size << " " << report.orphan_blocks << " "
+              << report.cross_linked << " " << removed << " " << free_before - free_after << std::endl;
+    PRINTDIV2;
+
+    std::cout << "Testing deltas of the disk for a copy of it..." << std::endl;
+    filesystem.mkdir("d9");
+    filesystem.create("d9/a", expected.c_str(), expected.length());
+    filesystem.create("d9/b", "abc", 4);
+    filesystem.set_console(nullptr);
+    int full_status = filesystem.export_delta(0, "delta.full");
+    filesystem.set_console(&std::cout);
+    delta_header full_header;
+    std::ifstream delta_in("delta.full", std::ios::binary);
+    delta_in.read((char*)&full_header, sizeof(full_header));
+    delta_in.close();
+    ::mkdir("delta.copy", 0755);
+    int copy_status, copy_again;
+    bool later;
+    fsck_report report_delta;
+    std::ostringstream copied;
+    {
+        // the copy is a second disk, in its own directory
+        if (chdir("delta.copy") != 0)
+            std::cout << "Error: Can't enter delta.copy" << std::endl;
+        FS copy(nullptr);
+        ret_val = chdir("..");
+        copy.format();
+        copy.apply_delta("delta.full");
+        filesystem.write("d9/a", 0, "XYZ", 3);
+        filesystem.rm("d9/b");
+        filesystem.set_console(nullptr);
+        ret_val = filesystem.export_delta(full_header.to + 5, "delta.bad");
+        filesystem.export_delta(full_header.to, "delta.next");
+        // a delta right after the last one, nothing changed in between
+        delta_header next_header, last_header;
+        delta_in.open("delta.next", std::ios::binary);
+        delta_in.read((char*)&next_header, sizeof(next_header));
+        delta_in.close();
+        filesystem.export_delta(next_header.to, "delta.last");
+        delta_in.open("delta.last", std::ios::binary);
+        delta_in.read((char*)&last_header, sizeof(last_header));
+        delta_in.close();
+        later = last_header.from == next_header.to && last_header.to > next_header.to;
+        filesystem.set_console(&std::cout);
+        copy_status = copy.apply_delta("delta.next");
+        copy_again = copy.apply_delta("delta.next");
+        copy.cat("d9/a", copied);
+        copy.fsck(false, report_delta);
+        copy_status += copy.stat("d9/b", entry);
+    }
+    struct stat full_st, next_st;
+    ::stat("delta.full", &full_st);
+    ::stat("delta.next", &next_st);
+    std::cout << "Expected output:" << std::endl;
+    std::cout << "0 -15 -2 -15 XYZe 0 0 1 1" << std::endl;
+    std::cout << "Actual output:" << std::endl;
+    std::cout << full_status << " " << ret_val << " " << copy_status << " " << copy_again << " "
+              << copied.str().substr(0, 4) << " " << report_delta.orphan_blocks << " " << report_delta.cross_linked
+              << " " << (next_st.st_size < full_st.st_size / 2) << " " << later << std::endl;
+    ret_val = system("rm -rf delta.copy delta.full delta.next delta.last delta.bad");
+    filesystem.remove_tree("d9");
+    PRINTDIV2;
+
+    std::cout << "Testing several volumes in one process..." << std::endl;
+    {
+        Volumes volumes;
+        const int count = 3;
+        int mounted = 0;
+        for (int v = 0; v < count; v++) {
+            std::string disk = "volume." + std::to_string(v) + ".bin";
+            unlink(disk.c_str());
+            mounted += volumes.mount("v" + std::to_string(v), disk, nullptr);
+        }
+        int busy = volumes.mount("again", "volume.0.bin", nullptr);
+        // the disk of the test itself is open already
+        volumes.exclude(DISKNAME);
+        busy += volumes.mount("own", "./" DISKNAME, nullptr);
+        // each volume fills its own disk on its own worker
+        std::vector<std::future<int> > results;
+        for (int v = 0; v < count; v++) {
+            results.push_back(volumes.submit("v" + std::to_string(v), [v](FS &fs) {
+                std::string data(7 + v, 'v');
+                int status = fs.mkdir("d");
+                for (int i = 0; i < 40 && status == 0; i++)
+                    status = fs.create("d/f" + std::to_string(i), data.c_str(), data.length());
+                return status;
+            }));
+        }
+        int created = 0;
+        for (size_t i = 0; i < results.size(); i++)
+            created += results[i].get();
+        std::string name, rest;
+        bool on_volume = volumes.split("/v2/d/f1", name, rest);
+        bool off_volume = volumes.split("/d9/f1", name, rest);
+        std::vector<dir_entry> listed;
+        int listing = volumes.run(name, [&listed](FS &fs) { return fs.list("/d", listed); });
+        volumes.unmount("v1");
+        int gone = volumes.run("v1", [](FS &fs) { return fs.mkdir("x"); });
+        volumes.unmount("v2");
+        volumes.mount("v2", "volume.2.bin", nullptr);
+        int persisted = volumes.run("v2", [&entry](FS &fs) { return fs.stat("d/f39", entry); });
+        // two mounts of the same new disk file at the same time, one of them is refused
+        unlink("volume.3.bin");
+        int racing[2];
+        std::thread first([&volumes, &racing]() { racing[0] = volumes.mount("w0", "volume.3.bin", nullptr); });
+        racing[1] = volumes.mount("w1", "volume.3.bin", nullptr);
+        first.join();
+        std::vector<std::string> names, diskfiles;
+        volumes.names(names, diskfiles);
+        bool raced = racing[0] + racing[1] == FS_EBUSY && names.size() == 3;
+        std::cout << "Expected output:" << std::endl;
+        std::cout << "0 -28 0 1 0 v2 /d/f1 0 40 -2 0 9 1" << std::endl;
+        std::cout << "Actual output:" << std::endl;
+        std::cout << mounted << " " << busy << " " << created << " " << on_volume << " " << off_volume << " "
+                  << name << " " << rest << " " << listing << " " << listed.size() << " " << gone << " "
+                  << persisted << " " << entry.size << " " << raced << std::endl;
+    }
+    ret_val = system("rm -f volume.0.bin volume.1.bin volume.2.bin volume.3.bin");
+    PRINTDIV2;
+
+    std::cout << "... Task 8 done" << std::endl;
+    PRINTDIV;
+}
@@ -0,0 +1,146 @@
+#include <cstring>
+#include "trace.h"
+
+static const char *op_names[TRACE_OPS] = {
+    "?", "format", "create", "cat", "ls", "cp", "mv", "rm", "cp -r", "rm -r",
+    "append", "write", "truncate", "open", "close", "fread", "fwrite", "seek",
+    "mkdir", "cd", "chmod", "sync", "stat", "list", "fsck", "defrag",
+    "compress", "dedup", "import-tree", "export-tree", "snapshot", "snapshot-rm",
+    "export-delta", "apply-delta"
+};
+
+const char *
+trace_op_name(int op)
+{
+    if (op <= 0 || op >= TRACE_OPS)
+        return op_names[0];
+    return op_names[op];
+}
+
+static void
+put_varint(std::string &buf, uint64_t value)
+{
+    while (value >= 0x80) {
+        buf += (char)(value | 0x80);
+        value >>= 7;
+    }
+    buf += (char)value;
+}
+
+static bool
+get_varint(std::ifstream &in, uint64_t &value)
+{
+    value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        int c = in.get();
+        if (c == EOF)
+            return false;
+        value |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80))
+            return true;
+    }
+    return false;
+}
+
+bool
+TraceWriter::open(const std::string &path)
+{
+    close();
+    out.open(path, std::ios::binary | std::ios::out | std::ios::trunc);
+    if (!out.is_open())
+        return false;
+    out.write(TRACE_MAGIC, strlen(TRACE_MAGIC));
+    last = std::chrono::steady_clock::now();
+    return true;
+}
+
+void
+TraceWriter::close()
+{
+    if (out.is_open())
+        out.close();
+}
+
+void
+TraceWriter::write(const trace_record &record)
+{
+    std::string buf;
+    buf += (char)record.op;
+    put_varint(buf, record.gap_us);
+    put_varint(buf, record.duration_us);
+    put_varint(buf, record.num[0]);
+    put_varint(buf, record.num[1]);
+    for (int i = 0; i < 2; i++) {
+        put_varint(buf, record.text[i].length());
+        buf += record.text[i];
+    }
+    out.write(buf.data(), buf.length());
+}
+
+bool
+TraceReader::open(const std::string &path)
+{
+    in.open(path, std::ios::binary | std::ios::in);
+    char magic[sizeof(TRACE_MAGIC)] = {0};
+    in.read(magic, strlen(TRACE_MAGIC));
+    return in.good() && strcmp(magic, TRACE_MAGIC) == 0;
+}
+
+bool
+TraceReader::next(trace_record &record)
+{
+    int op = in.get();
+    if (op == EOF)
+        return false;
+    record.op = op;
+    if (!get_varint(in, record.gap_us) || !get_varint(in, record.duration_us) ||
+        !get_varint(in, record.num[0]) || !get_varint(in, record.num[1]))
+        return false;
+    for (int i = 0; i < 2; i++) {
+        uint64_t length;
+        if (!get_varint(in, length) || length > 4096)
+            return false;
+        record.text[i].resize(length);
+        in.read(&record.text[i][0], length);
+        if (!in.good() && length > 0)
+            return false;
+    }
+    return true;
+}
+
+trace_call::trace_call(TraceWriter &w, uint8_t op, const std::string &a, const std::string &b,
+                       uint64_t x, uint64_t y)
+    : writer(w), outer(w.active() && w.depth == 0)
+{
+    w.depth++;
+    if (!outer)
+        return;
+    start = std::chrono::steady_clock::now();
+    record.op = op;
+    record.gap_us = std::chrono::duration_cast<std::chrono::microseconds>(start - w.last).count();
+    record.text[0] = a;
+    record.text[1] = b;
+    record.num[0] = x;
+    record.num[1] = y;
+    w.last = start;
+}
+
+trace_call::trace_call(TraceWriter &w, uint8_t op, const std::string &a, uint64_t x, uint64_t y)
+    : trace_call(w, op, a, "", x, y)
+{
+}
+
+trace_call::trace_call(TraceWriter &w, uint8_t op, uint64_t x, uint64_t y)
+    : trace_call(w, op, "", "", x, y)
+{
+}
+
+trace_call::~trace_call()
+{
+    writer.depth--;
+    if (!outer)
+        return;
+    record.duration_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    writer.write(record);
+}
@@ -0,0 +1,114 @@
+/**
+ * @file trace.h
+ * @brief Recording of FS calls to a compact binary trace, and reading it back
+ *
+ * A trace is TRACE_MAGIC followed by one record per call. A record is the
+ * call (1 byte), the time since the previous call started and the time the
+ * call took in microseconds, two numbers and two strings. The numbers and
+ * the string lengths are varints (7 bits per byte, the low bits first), so a
+ * typical record takes 10 to 30 bytes. The content of the data is not
+ * recorded, only its size: replay writes made-up data of the same size.
+ */
+
+#include <cstdint>
+#include <chrono>
+#include <fstream>
+#include <string>
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#define TRACE_MAGIC "FSTRACE1"
+
+// the calls that are recorded, the values are part of the format
+enum trace_op {
+    TRACE_FORMAT = 1,
+    TRACE_CREATE,        // path, size
+    TRACE_CAT,           // path
+    TRACE_LS,            // path, long format
+    TRACE_CP,            // source, destination
+    TRACE_MV,            // source, destination
+    TRACE_RM,            // path
+    TRACE_COPY_TREE,     // source, destination
+    TRACE_REMOVE_TREE,   // path
+    TRACE_APPEND,        // source, destination
+    TRACE_WRITE,         // path, offset, size
+    TRACE_TRUNCATE,      // path, length
+    TRACE_OPEN,          // path, mode, the descriptor returned
+    TRACE_CLOSE,         // fd
+    TRACE_READ,          // fd, size
+    TRACE_FWRITE,        // fd, size
+    TRACE_SEEK,          // fd, offset
+    TRACE_MKDIR,         // path
+    TRACE_CD,            // path
+    TRACE_CHMOD,         // rights, path
+    TRACE_SYNC,
+    TRACE_STAT,          // path
+    TRACE_LIST,          // path
+    TRACE_FSCK,          // repair
+    TRACE_DEFRAG,        // dry run
+    TRACE_COMPRESS,      // on
+    TRACE_DEDUP,         // on
+    TRACE_IMPORT_TREE,   // host directory, path (not replayed)
+    TRACE_EXPORT_TREE,   // path, host directory (not replayed)
+    TRACE_SNAPSHOT,      // name
+    TRACE_SNAPSHOT_RM,   // name
+    TRACE_EXPORT_DELTA,  // host file, since generation (not replayed)
+    TRACE_APPLY_DELTA,   // host file (not replayed)
+    TRACE_OPS
+};
+
+// the name of a call, as the shell command that makes it
+const char *trace_op_name(int op);
+
+struct trace_record {
+    uint8_t op = 0;
+    uint64_t gap_us = 0;       // since the previous call started
+    uint64_t duration_us = 0;
+    uint64_t num[2] = {0, 0};
+    std::string text[2];
+};
+
+// Writes the records of the calls. Only the outermost call is recorded
+// when one call makes another.
+class TraceWriter {
+private:
+    std::ofstream out;
+    std::chrono::steady_clock::time_point last;
+    unsigned depth = 0;
+    friend class trace_call;
+public:
+    // starts a new trace, returns false if the file can't be written
+    bool open(const std::string &path);
+    void close();
+    bool active() const { return out.is_open(); }
+    void write(const trace_record &record);
+};
+
+class TraceReader {
+private:
+    std::ifstream in;
+public:
+    // returns false if the file can't be read or is not a trace
+    bool open(const std::string &path);
+    // the next record, false at the end of the trace
+    bool next(trace_record &record);
+};
+
+// Records one call: the time from its construction to its destruction, if
+// the writer is active and no other call is being recorded.
+class trace_call {
+private:
+    TraceWriter &writer;
+    bool outer;
+    std::chrono::steady_clock::time_point start;
+public:
+    trace_record record;
+    trace_call(TraceWriter &w, uint8_t op, const std::string &a = "", const std::string &b = "",
+               uint64_t x = 0, uint64_t y = 0);
+    trace_call(TraceWriter &w, uint8_t op, const std::string &a, uint64_t x, uint64_t y = 0);
+    trace_call(TraceWriter &w, uint8_t op, uint64_t x, uint64_t y = 0);
+    ~trace_call();
+};
+
+#endif // __TRACE_H__
@@ -0,0 +1,242 @@
+#include <cstring>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "volumes.h"
+
+Volumes::~Volumes()
+{
+    std::vector<std::string> mounted, diskfiles;
+    names(mounted, diskfiles);
+    for (size_t i = 0; i < mounted.size(); i++)
+        unmount(mounted[i]);
+}
+
+void
+Volumes::exclude(const std::string &diskfile)
+{
+    std::lock_guard<std::mutex> guard(list_lock);
+    opened.push_back(diskfile);
+}
+
+std::shared_ptr<volume>
+Volumes::find(const std::string &name)
+{
+    std::lock_guard<std::mutex> guard(list_lock);
+    for (size_t i = 0; i < list.size(); i++)
+        if (list[i]->name == name)
+            return list[i];
+    return std::shared_ptr<volume>();
+}
+
+// the worker of a volume: runs the submitted calls in order until the volume is unmounted
+void
+Volumes::work(volume *v)
+{
+    while (true) {
+        std::packaged_task<int()> task;
+        {
+            std::unique_lock<std::mutex> guard(v->queue_lock);
+            v->wake.wait(guard, [v](){ return v->stopping || !v->queue.empty(); });
+            if (v->queue.empty())
+                return;
+            task = std::move(v->queue.front());
+            v->queue.pop_front();
+        }
+        task();
+    }
+}
+
+int
+Volumes::mount(std::string name, std::string diskfile, std::ostream *console)
+{
+    if (name.empty() || name.length() >= VOLUME_NAME || name.find('/') != std::string::npos || name == PARENT_DIR) {
+        if (console) *console << "Error: A volume name is 1 to " << VOLUME_NAME - 1 << " characters without '/'\n";
+        return FS_ENAME;
+    }
+    struct stat st;
+    bool exists = ::stat(diskfile.c_str(), &st) == 0;
+    size_t slash = diskfile.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : diskfile.substr(0, std::max<size_t>(slash, 1));
+    if (exists ? access(diskfile.c_str(), R_OK | W_OK) != 0 : access(dir.c_str(), W_OK) != 0) {
+        if (console) *console << "Error: Can't open the disk file " << diskfile << " on the host\n";
+        return FS_EIO;
+    }
+    std::shared_ptr<volume> v(new volume);
+    v->name = name;
+    v->diskfile = diskfile;
+    {
+        std::lock_guard<std::mutex> guard(list_lock);
+        if (list.size() + mounting.size() >= MAX_VOLUMES) {
+            if (console) *console << "Error: There are already " << MAX_VOLUMES << " volumes\n";
+            return FS_ENOSPC;
+        }
+        // the same disk file mounted twice would be written by two file systems
+        int status = conflict(*v, console);
+        if (status)
+            return status;
+        mounting.push_back(v);
+    }
+    // the file system is opened without list_lock: a replay, a repair or a
+    // format may take a while, and the other volumes are used meanwhile
+    FS *fs = new FS(console, diskfile);
+    int status = exists ? 0 : fs->format();
+    bool unformatted = status != 0;
+    {
+        std::lock_guard<std::mutex> guard(list_lock);
+        mounting.erase(std::find(mounting.begin(), mounting.end(), v));
+        if (status == 0)
+            status = conflict(*v, console);
+        if (status == 0) {
+            v->fs = fs;
+            v->worker = std::thread(work, v.get());
+            list.push_back(v);
+            return 0;
+        }
+    }
+    delete fs;
+    // a disk file that this mount created and could not format is not left behind
+    if (unformatted)
+        unlink(diskfile.c_str());
+    return status;
+}
+
+// FS_EEXIST or FS_EBUSY when the name or the disk file of 'v' is taken by
+// another volume or by an FS outside the manager. list_lock is held.
+int
+Volumes::conflict(const volume &v, std::ostream *console)
+{
+    struct stat st, other;
+    bool exists = ::stat(v.diskfile.c_str(), &st) == 0;
+    std::vector<std::shared_ptr<volume> > taken(list);
+    taken.insert(taken.end(), mounting.begin(), mounting.end());
+    for (size_t i = 0; i < taken.size(); i++) {
+        if (taken[i].get() == &v)
+            continue;
+        if (taken[i]->name == v.name) {
+            if (console) *console << "Error: Volume already exists: " << v.name << "\n";
+            return FS_EEXIST;
+        }
+        // a disk file that is being created has no inode yet, its path is compared
+        if (taken[i]->diskfile == v.diskfile || (exists && ::stat(taken[i]->diskfile.c_str(), &other) == 0 &&
+                                                st.st_dev == other.st_dev && st.st_ino == other.st_ino)) {
+            if (console) *console << "Error: " << v.diskfile << " is already mounted as " << taken[i]->name << "\n";
+            return FS_EBUSY;
+        }
+    }
+    for (size_t i = 0; i < opened.size(); i++) {
+        if (exists && ::stat(opened[i].c_str(), &other) == 0 && st.st_dev == other.st_dev && st.st_ino == other.st_ino) {
+            if (console) *console << "Error: " << v.diskfile << " is already open as " << opened[i] << "\n";
+            return FS_EBUSY;
+        }
+    }
+    return 0;
+}
+
+int
+Volumes::unmount(std::string name)
+{
+    std::shared_ptr<volume> v;
+    {
+        std::lock_guard<std::mutex> guard(list_lock);
+        for (size_t i = 0; i < list.size(); i++) {
+            if (list[i]->name == name) {
+                v = list[i];
+                list.erase(list.begin() + i);
+                break;
+            }
+        }
+    }
+    if (!v)
+        return FS_ENOENT;
+    // the calls already submitted still run, then the worker ends
+    {
+        std::lock_guard<std::mutex> guard(v->queue_lock);
+        v->stopping = true;
+    }
+    v->wake.notify_one();
+    v->worker.join();
+    std::lock_guard<std::mutex> guard(v->lock);
+    delete v->fs;
+    v->fs = nullptr;
+    return 0;
+}
+
+void
+Volumes::names(std::vector<std::string> &names, std::vector<std::string> &diskfiles)
+{
+    std::lock_guard<std::mutex> guard(list_lock);
+    names.clear();
+    diskfiles.clear();
+    for (size_t i = 0; i < list.size(); i++) {
+        names.push_back(list[i]->name);
+        diskfiles.push_back(list[i]->diskfile);
+    }
+}
+
+bool
+Volumes::split(const std::string &path, std::string &name, std::string &rest)
+{
+    if (path.empty() || path[0] != '/')
+        return false;
+    size_t slash = path.find('/', 1);
+    std::string first = path.substr(1, slash == std::string::npos ? std::string::npos : slash - 1);
+    if (!find(first))
+        return false;
+    name = first;
+    rest = slash == std::string::npos ? "/" : path.substr(slash);
+    return true;
+}
+
+int
+Volumes::run(std::string name, volume_call call)
+{
+    std::shared_ptr<volume> v;
+    std::unique_lock<std::mutex> guard;
+    FS *fs = acquire(name, v, guard);
+    if (fs == nullptr)
+        return FS_ENOENT;
+    return call(*fs);
+}
+
+std::future<int>
+Volumes::submit(std::string name, volume_call call)
+{
+    std::shared_ptr<volume> v = find(name);
+    if (!v) {
+        std::promise<int> none;
+        none.set_value(FS_ENOENT);
+        return none.get_future();
+    }
+    volume *target = v.get();
+    std::packaged_task<int()> task([target, call]() {
+        std::lock_guard<std::mutex> guard(target->lock);
+        return target->fs ? call(*target->fs) : (int)FS_ENOENT;
+    });
+    std::future<int> result = task.get_future();
+    {
+        std::lock_guard<std::mutex> guard(v->queue_lock);
+        if (v->stopping) {
+            std::promise<int> none;
+            none.set_value(FS_ENOENT);
+            return none.get_future();
+        }
+        v->queue.push_back(std::move(task));
+    }
+    v->wake.notify_one();
+    return result;
+}
+
+FS *
+Volumes::acquire(std::string name, std::shared_ptr<volume> &held, std::unique_lock<std::mutex> &guard)
+{
+    held = find(name);
+    if (!held)
+        return nullptr;
+    guard = std::unique_lock<std::mutex>(held->lock);
+    if (held->fs == nullptr) {
+        guard.unlock();
+        return nullptr;
+    }
+    return held->fs;
+}
@@ -0,0 +1,84 @@
+/**
+ * @file volumes.h
+ * @brief Several disk images mounted in one process
+ *
+ * Each volume is a file system of its own on its own disk file: it has its
+ * own buffers and read-ahead (Disk), its own arena and its own journal, so
+ * volumes share nothing but the process. A volume is used by one thread at
+ * a time, its lock is held for every call. Each volume also has a worker
+ * thread that runs the calls submitted to it, so calls on different volumes
+ * run in parallel, one core per volume.
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <memory>
+#include "fs.h"
+
+#ifndef __VOLUMES_H__
+#define __VOLUMES_H__
+
+#define MAX_VOLUMES 64
+#define VOLUME_NAME 24   // "/<name>/<path>" is a path on the volume, see Volumes::split
+
+typedef std::function<int(FS&)> volume_call;
+
+// A mounted volume. A caller that found it keeps it alive with its own
+// reference, and sees fs == nullptr if it was unmounted in the meantime.
+struct volume {
+    std::string name;
+    std::string diskfile;
+    FS *fs = nullptr;
+    std::mutex lock;              // held by whoever uses 'fs'
+    std::thread worker;
+    std::mutex queue_lock;
+    std::condition_variable wake;
+    std::deque<std::packaged_task<int()> > queue;  // calls submitted to the worker
+    bool stopping = false;
+};
+
+class Volumes {
+private:
+    std::vector<std::shared_ptr<volume> > list;
+    std::mutex list_lock;
+    std::vector<std::string> opened;  // disk files opened outside the manager
+    // volumes being mounted: their name and disk file are taken, but they are
+    // not in 'list' until their file system is open
+    std::vector<std::shared_ptr<volume> > mounting;
+    std::shared_ptr<volume> find(const std::string &name);
+    int conflict(const volume &v, std::ostream *console);
+    static void work(volume *v);
+public:
+    ~Volumes();
+    // a disk file that an FS outside the manager has open, mount refuses it
+    void exclude(const std::string &diskfile);
+    // mount <name> <diskfile> opens the disk file as the volume <name>. A disk
+    // file that does not exist is created and formatted. 'console' is what
+    // the file system of the volume prints to, nullptr for nothing.
+    int mount(std::string name, std::string diskfile, std::ostream *console = &std::cout);
+    // umount <name> waits for the calls submitted to the volume and unmounts it
+    int unmount(std::string name);
+    // the names and disk files of the mounted volumes, in the order they were mounted
+    void names(std::vector<std::string> &names, std::vector<std::string> &diskfiles);
+    // true if the volume <name> is mounted
+    bool mounted(const std::string &name) { return (bool)find(name); }
+    // splits "/<name>/<path>" of a mounted volume into <name> and "/<path>",
+    // false if the path is not on a mounted volume
+    bool split(const std::string &path, std::string &name, std::string &rest);
+    // runs the call on the volume in this thread, with the lock of the volume held
+    int run(std::string name, volume_call call);
+    // queues the call for the worker of the volume, the future gets its status
+    std::future<int> submit(std::string name, volume_call call);
+    // the file system of the volume for a caller that makes several calls in
+    // a row, with its lock held by 'guard'. nullptr if there is no such volume.
+    FS *acquire(std::string name, std::shared_ptr<volume> &held, std::unique_lock<std::mutex> &guard);
+};
+
+#endif // __VOLUMES_H__
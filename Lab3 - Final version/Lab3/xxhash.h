@@ -0,0 +1,14 @@
+/**
+ * @file xxhash.h
+ * @brief 64-bit xxHash (XXH64) of a buffer, used to find identical blocks
+ */
+
+#include <cstdint>
+#include <cstddef>
+
+#ifndef __XXHASH_H__
+#define __XXHASH_H__
+
+uint64_t xxh64(const void *data, size_t length, uint64_t seed = 0);
+
+#endif // __XXHASH_H__